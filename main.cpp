@@ -7,14 +7,393 @@
 #include <opencv2/features2d.hpp> // openCV module which contains SimpleBlobDetector
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <memory>
 #include "parsleyLib.hpp" // my library of functions
+#include "parsleyBatch.hpp" // batch mode: many images processed in parallel
+#include "parsleyStream.hpp" // stream mode: continuous feed from a video file or a watched directory
+#include "parsleyBenchmark.hpp" // performance benchmarks
+#include "parsleyTiled.hpp" // tiled mode: very large images processed in tiles
+#include "parsleyMetrics.hpp" // counters and stage latencies export
+#include "parsleyServer.hpp" // server mode: long running detection over a socket or stdin
+#include "parsleySweep.hpp" // parameters tuning: many gamma and minArea settings in one pass
+#include "parsleyResults.hpp" // detections saved as NDJSON or binary records
+#include "parsleyColor.hpp" // color lookup table classifier
+#include "parsleyRaster.hpp" // raster scan mode: images streamed a band of rows at a time
+#include "parsleyShard.hpp" // sharded mode: batch mode over many worker processes
+#include "parsleyCache.hpp" // detections of already processed images kept on disk
 
 using namespace std;
 using namespace cv;
 
-int main()
+// Prints the hit and miss counts of the result cache
+static void printCacheStats(const parsleyLib::ResultCache& cache)
 {
-    cout << "APParsley: a computer vision system for impurities detection among dried parsley leaves." << endl;
+    parsleyLib::ResultCacheStats stats = cache.stats();
+    size_t lookups = stats.hits + stats.misses;
+    cout << "Result cache: " << stats.hits << " hits, " << stats.misses << " misses";
+    if(lookups > 0)
+        cout << " (" << 100.0 * stats.hits / lookups << "% hit rate)";
+    cout << ", " << stats.stores << " stored, " << stats.evictions << " evicted, " << stats.entries << " entries, " << stats.bytes / (1024.0 * 1024.0) << " MB" << endl;
+}
+
+
+// Removes from args the option "--name=value" if present, saving its value
+static bool takeOption(vector<string>& args, const string& name, string& value)
+{
+    const string prefix = "--" + name + "=";
+    for(int i=1; i<args.size(); ++i)
+    {
+        if(args[i].compare(0, prefix.size(), prefix) == 0)
+        {
+            value = args[i].substr(prefix.size());
+            args.erase(args.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int main(int argc, char** argv)
+{
+    // options valid in every mode, the remaining arguments are positional
+    vector<string> args(argv, argv + argc);
+    string optionValue;
+    vector<string> workerOptions; // the options sharded mode passes on to its worker processes
+    
+    // --engine=blob|components|bitmask: SimpleBlobDetector + findContours (default), a single connected components labeling or the same labeling on a bit packed mask
+    parsleyLib::DetectorEngine engine = parsleyLib::DetectorEngine::SIMPLE_BLOB;
+    if(takeOption(args, "engine", optionValue))
+    {
+        if(!parsleyLib::parseDetectorEngine(optionValue, engine))
+        {
+            cerr << "Unknown detector engine: " << optionValue << endl;
+            return 1;
+        }
+        workerOptions.push_back("--engine=" + optionValue);
+    }
+    
+    // --threshold-drift=<bound|off> (stream mode): histogram drift over which the thresholding value is searched again, off to search it on every frame
+    bool trackThreshold = true;
+    double driftBound = 0.05;
+    if(takeOption(args, "threshold-drift", optionValue))
+    {
+        if(optionValue == "off")
+            trackThreshold = false;
+        else
+            driftBound = atof(optionValue.c_str());
+    }
+    
+    // --metrics=<file> [--metrics-interval=<seconds>]: counters and stage latencies saved periodically and at exit, as JSON (.json) or Prometheus text
+    unique_ptr<parsleyLib::PeriodicMetricsWriter> metricsWriter;
+    string metricsPath;
+    if(takeOption(args, "metrics", metricsPath))
+    {
+        double metricsInterval = takeOption(args, "metrics-interval", optionValue) ? atof(optionValue.c_str()) : 10;
+        metricsWriter.reset(new parsleyLib::PeriodicMetricsWriter(metricsPath, metricsInterval > 0 ? metricsInterval : 10));
+    }
+    
+    // --results=<file>: detections of every image saved as NDJSON (.ndjson, .jsonl) or compact binary records (any other extension)
+    unique_ptr<parsleyLib::ResultSink> resultSink;
+    if(takeOption(args, "results", optionValue))
+    {
+        resultSink = parsleyLib::openResultSink(optionValue);
+        if(!resultSink)
+        {
+            cerr << "Unable to create results file: " << optionValue << endl;
+            return 1;
+        }
+    }
+    
+    // --color-lut=<file> (single image and batch modes): pixels classified by a trained color lookup table instead of gamma correction and thresholding
+    parsleyLib::ColorClassifier colorClassifier;
+    if(takeOption(args, "color-lut", optionValue))
+    {
+        if(!colorClassifier.load(optionValue))
+        {
+            cerr << "Not a color lookup table: " << optionValue << endl;
+            return 1;
+        }
+        workerOptions.push_back("--color-lut=" + optionValue);
+    }
+    const parsleyLib::ColorClassifier* classifier = colorClassifier.empty() ? nullptr : &colorClassifier;
+    
+    // --clean-margin=<m> (single image, batch and stream modes): frames whose sampled histogram leaves fewer than m*minArea impurity pixels are reported clean without thresholding and detection
+    double cleanFrameMargin = 0;
+    if(takeOption(args, "clean-margin", optionValue))
+    {
+        cleanFrameMargin = atof(optionValue.c_str());
+        workerOptions.push_back("--clean-margin=" + optionValue);
+    }
+    
+    // --cache=<directory> [--cache-size=<MB>] (single image, batch and sharded modes): detections of images already processed with the same parameters taken from an on disk cache, least recently used entries evicted beyond the size (default 1024 MB)
+    parsleyLib::ResultCache resultCache;
+    parsleyLib::ResultCache* cache = nullptr;
+    if(takeOption(args, "cache", optionValue))
+    {
+        string cacheDirectory = optionValue;
+        double cacheMegabytes = takeOption(args, "cache-size", optionValue) ? atof(optionValue.c_str()) : 1024;
+        if(!resultCache.open(cacheDirectory, (size_t)(max(cacheMegabytes, 0.0) * 1024 * 1024)))
+        {
+            cerr << "Unable to open the result cache: " << cacheDirectory << endl;
+            return 1;
+        }
+        cache = &resultCache;
+        workerOptions.push_back("--cache=" + cacheDirectory);
+        workerOptions.push_back("--cache-size=" + to_string(cacheMegabytes));
+    }
+    
+    // --pin-cpus=off (sharded mode): worker processes not pinned to the CPUs of a NUMA node
+    bool pinCpus = !(takeOption(args, "pin-cpus", optionValue) && optionValue == "off");
+    
+    // Shard worker, started by sharded mode: APParsley --shard-worker <resultFd> <outputDirectory> <numThreads> <results|annotated|full> <none|lzw|packbits|deflate>
+    if(args.size() >= 7 && args[1] == "--shard-worker")
+    {
+        parsleyLib::OutputLevel outputLevel;
+        parsleyLib::TiffCompression compression;
+        if(!parsleyLib::parseOutputLevel(args[5], outputLevel) || !parsleyLib::parseTiffCompression(args[6], compression))
+        {
+            cerr << "Unknown output level or compression: " << args[5] << " " << args[6] << endl;
+            return 1;
+        }
+        int exitCode = parsleyLib::runShardWorker(atoi(args[2].c_str()), args[3], atoi(args[4].c_str()), outputLevel, compression, engine, classifier, cleanFrameMargin, cache);
+        if(cache)
+            printCacheStats(*cache);
+        return exitCode;
+    }
+    
+    // with the stdio server stdout carries the responses only
+    bool stdioServer = args.size() >= 3 && args[1] == "--serve" && args[2] == "-";
+    (stdioServer ? cerr : cout) << "APParsley: a computer vision system for impurities detection among dried parsley leaves." << endl;
+    
+    // Batch mode: APParsley --batch <imagesDirectory|manifestFile> <outputDirectory> [numThreads] [results|annotated|full] [none|lzw|packbits|deflate]
+    if(args.size() >= 4 && args[1] == "--batch")
+    {
+        int numThreads = (args.size() >= 5) ? atoi(args[4].c_str()) : 0; // 0: one worker per hardware thread
+        parsleyLib::OutputLevel outputLevel = parsleyLib::OutputLevel::FULL_DEBUG;
+        if(args.size() >= 6 && !parsleyLib::parseOutputLevel(args[5], outputLevel))
+        {
+            cerr << "Unknown output level: " << args[5] << endl;
+            return 1;
+        }
+        parsleyLib::TiffCompression compression = parsleyLib::TiffCompression::NONE;
+        if(args.size() >= 7 && !parsleyLib::parseTiffCompression(args[6], compression))
+        {
+            cerr << "Unknown compression: " << args[6] << endl;
+            return 1;
+        }
+        vector<string> inputImgPaths = parsleyLib::collectBatchInputs(args[2]);
+        if(inputImgPaths.empty())
+        {
+            cerr << "No images to process in: " << args[2] << endl;
+            return 1;
+        }
+        parsleyLib::processBatch(inputImgPaths, args[3], numThreads, outputLevel, compression, engine, resultSink.get(), classifier, cleanFrameMargin, cache);
+        if(cache)
+            printCacheStats(*cache);
+        return 0;
+    }
+    
+    // Sharded mode: APParsley --shard <imagesDirectory|manifestFile> <outputDirectory> [numWorkers] [results|annotated|full] [none|lzw|packbits|deflate]
+    if(args.size() >= 4 && args[1] == "--shard")
+    {
+        parsleyLib::ShardOptions options;
+        options.numWorkers = (args.size() >= 5) ? atoi(args[4].c_str()) : 0; // 0: one worker per NUMA node
+        options.pinCpus = pinCpus;
+        options.workerOptions = workerOptions;
+        parsleyLib::OutputLevel outputLevel;
+        parsleyLib::TiffCompression compression;
+        if(args.size() >= 6)
+            options.outputLevel = args[5];
+        if(args.size() >= 7)
+            options.compression = args[6];
+        if(!parsleyLib::parseOutputLevel(options.outputLevel, outputLevel) || !parsleyLib::parseTiffCompression(options.compression, compression))
+        {
+            cerr << "Unknown output level or compression: " << options.outputLevel << " " << options.compression << endl;
+            return 1;
+        }
+        vector<string> inputImgPaths = parsleyLib::collectBatchInputs(args[2]);
+        if(inputImgPaths.empty())
+        {
+            cerr << "No images to process in: " << args[2] << endl;
+            return 1;
+        }
+        // the merged log: --results, or results.ndjson in the output directory
+        if(!resultSink)
+            resultSink = parsleyLib::openResultSink(args[3] + "/results.ndjson");
+        if(!resultSink)
+        {
+            cerr << "Unable to create results file in: " << args[3] << endl;
+            return 1;
+        }
+        parsleyLib::ShardStats stats = parsleyLib::processSharded(inputImgPaths, args[3], options, *resultSink);
+        return stats.failed == 0 ? 0 : 1;
+    }
+    
+    // Stream mode: APParsley --stream <videoFile|directory> [block|drop-oldest|drop-newest] [latencyTargetMs] [idleTimeoutSeconds]
+    if(args.size() >= 3 && args[1] == "--stream")
+    {
+        parsleyLib::StreamOptions options;
+        options.engine = engine;
+        options.trackThreshold = trackThreshold;
+        options.driftBound = driftBound;
+        options.sink = resultSink.get();
+        options.cleanFrameMargin = cleanFrameMargin;
+        if(args.size() >= 4)
+        {
+            const string& policy = args[3];
+            if(policy == "drop-oldest")
+                options.dropPolicy = parsleyLib::FrameDropPolicy::DROP_OLDEST;
+            else if(policy == "drop-newest")
+                options.dropPolicy = parsleyLib::FrameDropPolicy::DROP_NEWEST;
+            else if(policy != "block")
+            {
+                cerr << "Unknown frame drop policy: " << policy << endl;
+                return 1;
+            }
+        }
+        if(args.size() >= 5)
+            options.latencyTarget = atof(args[4].c_str());
+        if(args.size() >= 6)
+            options.idleTimeout = atof(args[5].c_str());
+        parsleyLib::processStream(args[2], options);
+        return 0;
+    }
+    
+    // Tiled mode: APParsley --tiled <image> <outputDirectory> [tileSide] [results|annotated]
+    if(args.size() >= 4 && args[1] == "--tiled")
+    {
+        int tileSide = (args.size() >= 5) ? atoi(args[4].c_str()) : 2048;
+        if(tileSide <= 0)
+        {
+            cerr << "Invalid tile side: " << args[4] << endl;
+            return 1;
+        }
+        parsleyLib::OutputLevel outputLevel = parsleyLib::OutputLevel::RESULTS_ONLY;
+        if(args.size() >= 6 && !parsleyLib::parseOutputLevel(args[5], outputLevel))
+        {
+            cerr << "Unknown output level: " << args[5] << endl;
+            return 1;
+        }
+        parsleyLib::processImageTiled(args[2], args[3], tileSide, outputLevel);
+        return 0;
+    }
+    
+    // Raster scan mode: APParsley --raster <pgmFile|image|-> [calibrationRows] [bandRows]
+    if(args.size() >= 3 && args[1] == "--raster")
+    {
+        parsleyLib::RasterScanOptions options;
+        if(args.size() >= 4)
+            options.calibrationRows = atoi(args[3].c_str());
+        if(args.size() >= 5)
+            options.bandRows = atoi(args[4].c_str());
+        if(options.calibrationRows <= 0 || options.bandRows <= 0)
+        {
+            cerr << "Invalid calibration or band rows" << endl;
+            return 1;
+        }
+        parsleyLib::processRasterScan(args[2], options, resultSink.get());
+        return 0;
+    }
+    
+    // Parameter sweep: APParsley --sweep <imagesDirectory|manifestFile> <gammas> <minAreas>, values as "1.0,1.5,2.0" or "1.0:3.0:0.25"
+    if(args.size() >= 5 && args[1] == "--sweep")
+    {
+        vector<double> gammas, minAreaValues;
+        if(!parsleyLib::parseSweepValues(args[3], gammas) || !parsleyLib::parseSweepValues(args[4], minAreaValues))
+        {
+            cerr << "Invalid sweep values: " << args[3] << " " << args[4] << endl;
+            return 1;
+        }
+        vector<string> inputImgPaths = parsleyLib::collectBatchInputs(args[2]);
+        if(inputImgPaths.empty())
+        {
+            cerr << "No images to process in: " << args[2] << endl;
+            return 1;
+        }
+        vector<float> minAreas(minAreaValues.begin(), minAreaValues.end());
+        parsleyLib::sweepParameters(inputImgPaths, gammas, minAreas);
+        return 0;
+    }
+    
+    // Color lookup table training: APParsley --train-color <manifestFile> <tableFile> [bitsPerChannel] [impurityWeight], manifest lines as "<image> <labelsImage>"
+    if(args.size() >= 4 && args[1] == "--train-color")
+    {
+        int bitsPerChannel = (args.size() >= 5) ? atoi(args[4].c_str()) : 5;
+        double impurityWeight = (args.size() >= 6) ? atof(args[5].c_str()) : 1.0;
+        return parsleyLib::trainColorClassifier(args[2], args[3], bitsPerChannel, impurityWeight > 0 ? impurityWeight : 1.0) ? 0 : 1;
+    }
+    
+    // Results reader: APParsley --read-results <binaryResultsFile> [ndjsonFile]
+    if(args.size() >= 3 && args[1] == "--read-results")
+        return parsleyLib::readResults(args[2], (args.size() >= 4) ? args[3] : "") ? 0 : 1;
+    
+    // Server mode: APParsley --serve <socketPath|-> [numWorkers]
+    if(args.size() >= 3 && args[1] == "--serve")
+    {
+        parsleyLib::ServerOptions options;
+        options.engine = engine;
+        if(args.size() >= 4)
+            options.numWorkers = atoi(args[3].c_str());
+        parsleyLib::runServer(args[2], options);
+        return 0;
+    }
+    
+    // Server test client: APParsley --serve-bench <socketPath> <image> [connections] [requestsPerConnection] [bytes|path]
+    if(args.size() >= 4 && args[1] == "--serve-bench")
+    {
+        int connections = (args.size() >= 5) ? atoi(args[4].c_str()) : 8;
+        int requestsPerConnection = (args.size() >= 6) ? atoi(args[5].c_str()) : 100;
+        bool sendBytes = !(args.size() >= 7 && args[6] == "path");
+        return parsleyLib::benchmarkServer(args[2], args[3], connections, requestsPerConnection, sendBytes) ? 0 : 1;
+    }
+    
+    // Matching benchmark: APParsley --bench-matching [maxContours]
+    if(args.size() >= 2 && args[1] == "--bench-matching")
+    {
+        int maxContours = (args.size() >= 3) ? atoi(args[2].c_str()) : 100000;
+        return parsleyLib::benchmarkRectMatching(maxContours) ? 0 : 1;
+    }
+    
+    // Coarse to fine detection recall check: APParsley --bench-coarse [levels]
+    if(args.size() >= 2 && args[1] == "--bench-coarse")
+    {
+        int levels = (args.size() >= 3) ? atoi(args[2].c_str()) : 2;
+        return parsleyLib::benchmarkCoarseToFine(levels > 0 ? levels : 2) ? 0 : 1;
+    }
+    
+    // Color classifier check: APParsley --bench-color [repetitions]
+    if(args.size() >= 2 && args[1] == "--bench-color")
+    {
+        int repetitions = (args.size() >= 3) ? atoi(args[2].c_str()) : 5;
+        return parsleyLib::benchmarkColorClassifier(repetitions) ? 0 : 1;
+    }
+    
+    // Clean frame fast path check: APParsley --bench-clean [margin] [repetitions]
+    if(args.size() >= 2 && args[1] == "--bench-clean")
+    {
+        double margin = (args.size() >= 3) ? atof(args[2].c_str()) : 0.5;
+        int repetitions = (args.size() >= 4) ? atoi(args[3].c_str()) : 5;
+        return parsleyLib::benchmarkCleanFrames(margin > 0 ? margin : 0.5, repetitions) ? 0 : 1;
+    }
+    
+    // Bit mask engine check: APParsley --bench-bitmask [repetitions]
+    if(args.size() >= 2 && args[1] == "--bench-bitmask")
+    {
+        int repetitions = (args.size() >= 3) ? atoi(args[2].c_str()) : 5;
+        return parsleyLib::benchmarkBitMask(repetitions) ? 0 : 1;
+    }
+    
+    // Pipeline benchmark on synthetic images: APParsley --bench-pipeline <resultsFile> [baselineFile] [repetitions]
+    if(args.size() >= 3 && args[1] == "--bench-pipeline")
+    {
+        string baselinePath = (args.size() >= 4) ? args[3] : "";
+        int repetitions = (args.size() >= 5) ? atoi(args[4].c_str()) : 5;
+        return parsleyLib::benchmarkPipeline(args[2], baselinePath, repetitions) ? 0 : 1;
+    }
+    
     cout << "Insert path to the image you wish to process: " << endl;
     string inputImgPath;
     cin >> inputImgPath;
@@ -23,8 +402,9 @@ int main()
     string outputImgPath;
     cin >> outputImgPath;
     
-    parsleyLib::processImage(inputImgPath, outputImgPath);
+    parsleyLib::processImage(inputImgPath, outputImgPath, "processedImages.tiff", true, parsleyLib::OutputLevel::FULL_DEBUG, nullptr, engine, resultSink.get(), 0, classifier, cleanFrameMargin, cache);
+    if(cache)
+        printCacheStats(*cache);
     
     return 0;
 }
-
@@ -0,0 +1,253 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "parsleyBatch.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyResults.hpp"
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+WorkStealingPool::WorkStealingPool(int numThreads)
+    : queuedTasks(0), pendingTasks(0), nextQueue(0), stopping(false)
+{
+    if(numThreads <= 0)
+        numThreads = max(1, (int)thread::hardware_concurrency());
+
+    for(int i=0; i<numThreads; ++i)
+        queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue()));
+
+    // queues must all exist before the first worker tries to steal from them
+    for(int i=0; i<numThreads; ++i)
+        workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+}
+
+
+WorkStealingPool::~WorkStealingPool()
+{
+    wait();
+    {
+        lock_guard<mutex> lock(stateMutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for(int i=0; i<workers.size(); ++i)
+        workers[i].join();
+}
+
+
+void WorkStealingPool::submit(function<void()> task)
+{
+    size_t target;
+    {
+        // counters are incremented before the push, so a worker can never take a task not yet counted
+        lock_guard<mutex> lock(stateMutex);
+        target = nextQueue;
+        nextQueue = (nextQueue + 1) % queues.size();
+        ++pendingTasks;
+        ++queuedTasks;
+    }
+    {
+        lock_guard<mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(task));
+    }
+    workAvailable.notify_one();
+}
+
+
+void WorkStealingPool::wait()
+{
+    unique_lock<mutex> lock(stateMutex);
+    allDone.wait(lock, [this]{ return pendingTasks == 0; });
+}
+
+
+int WorkStealingPool::size() const
+{
+    return (int)workers.size();
+}
+
+
+bool WorkStealingPool::popLocal(int workerId, function<void()>& task)
+{
+    WorkerQueue& queue = *queues[workerId];
+    lock_guard<mutex> lock(queue.mutex);
+    if(queue.tasks.empty())
+        return false;
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    --queuedTasks;
+    return true;
+}
+
+
+bool WorkStealingPool::steal(int workerId, function<void()>& task)
+{
+    // visits the other queues starting from the next one, so that thieves do not all hit the same victim
+    for(int i=1; i<queues.size(); ++i)
+    {
+        WorkerQueue& victim = *queues[(workerId + i) % queues.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        if(!victim.tasks.empty())
+        {
+            // takes from the back: the task the owner would have reached last
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            --queuedTasks;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void WorkStealingPool::workerLoop(int workerId)
+{
+    while(true)
+    {
+        function<void()> task;
+        if(popLocal(workerId, task) || steal(workerId, task))
+        {
+            task();
+            lock_guard<mutex> lock(stateMutex);
+            if(--pendingTasks == 0)
+                allDone.notify_all();
+            continue;
+        }
+
+        unique_lock<mutex> lock(stateMutex);
+        workAvailable.wait(lock, [this]{ return stopping || queuedTasks > 0; });
+        if(stopping && queuedTasks == 0)
+            return;
+    }
+}
+
+
+
+// file name without directory and extension, used to name the per image output file
+static string imageStem(const string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    string name = (slash == string::npos) ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return (dot == string::npos || dot == 0) ? name : name.substr(0, dot);
+}
+
+
+vector<string> collectBatchInputs(const string& dirOrManifest)
+{
+    vector<string> inputImgPaths;
+
+    if(isDirectory(dirOrManifest))
+    {
+        vector<String> files;
+        glob(dirOrManifest, files, false); // sorted list of the directory files
+        for(int i=0; i<files.size(); ++i)
+        {
+            if(haveImageReader(files[i])) // skips files OpenCV is not able to decode
+                inputImgPaths.push_back(files[i]);
+        }
+        return inputImgPaths;
+    }
+
+    ifstream manifest(dirOrManifest);
+    if(!manifest.is_open())
+    {
+        cerr << "Unable to open batch input: " << dirOrManifest << endl;
+        return inputImgPaths;
+    }
+    string line;
+    while(getline(manifest, line))
+    {
+        // trims trailing spaces and carriage returns (manifests written on Windows)
+        size_t last = line.find_last_not_of(" \t\r");
+        if(last == string::npos || line[0] == '#')
+            continue;
+        inputImgPaths.push_back(line.substr(0, last + 1));
+    }
+    return inputImgPaths;
+}
+
+
+vector<BatchItemResult> processBatch(const vector<string>& inputImgPaths, const string& outputImgPath, int numThreads, OutputLevel outputLevel, TiffCompression compression, DetectorEngine engine, ResultSink* sink, const ColorClassifier* classifier, double cleanFrameMargin, ResultCache* cache)
+{
+    const string outputSuffix = (outputLevel == OutputLevel::ANNOTATED) ? "_annotated.tiff" : "_processedImages.tiff";
+
+    vector<BatchItemResult> results(inputImgPaths.size());
+    mutex coutMutex;
+
+    // every worker keeps a core busy: OpenCV parallel regions would only oversubscribe the cores
+    int previousCvThreads = getNumThreads();
+    setNumThreads(0);
+
+    double ticks = (double) getTickCount();
+    size_t failedWrites = 0;
+    {
+        // one writer shared by all the workers; declared before the pool, so it outlives the workers using it
+        unique_ptr<AsyncImageWriter> writer;
+        if(outputLevel != OutputLevel::RESULTS_ONLY)
+            writer.reset(new AsyncImageWriter(compression));
+
+        WorkStealingPool pool(numThreads);
+        cout << "Processing " << inputImgPaths.size() << " images with " << pool.size() << " worker threads" << endl;
+
+        for(int i=0; i<inputImgPaths.size(); ++i)
+        {
+            pool.submit([&, i]()
+            {
+                BatchItemResult& result = results[i];
+                result.inputImgPath = inputImgPaths[i];
+                double imageTicks = (double) getTickCount();
+                try
+                {
+                    result.detectedObjects = processImage(inputImgPaths[i], outputImgPath, imageStem(inputImgPaths[i]) + outputSuffix, false, outputLevel, writer.get(), engine, sink, i, classifier, cleanFrameMargin, cache);
+                    result.succeeded = true;
+                }
+                catch(const cv::Exception& e) // e.g. an unreadable image, must not stop the whole batch
+                {
+                    lock_guard<mutex> lock(coutMutex);
+                    cerr << "Failed to process " << inputImgPaths[i] << ": " << e.what() << endl;
+                }
+                result.elapsedTime = ((double)getTickCount() - imageTicks) / getTickFrequency();
+
+                if(result.succeeded)
+                {
+                    lock_guard<mutex> lock(coutMutex);
+                    cout << "Number of detected objects for: " << result.inputImgPath << ": " << result.detectedObjects << " (" << result.elapsedTime << " seconds)" << endl;
+                }
+            });
+        }
+        pool.wait();
+
+        // the batch ends when the last image is on disk
+        if(writer)
+        {
+            writer->finish();
+            failedWrites = writer->failedWrites();
+        }
+    }
+    double elapsedTime = ((double)getTickCount() - ticks) / getTickFrequency();
+
+    setNumThreads(previousCvThreads);
+
+    size_t succeeded = 0;
+    for(int i=0; i<results.size(); ++i)
+        succeeded += results[i].succeeded ? 1 : 0;
+
+    cout << "Processed " << succeeded << "/" << results.size() << " images in " << elapsedTime << " seconds";
+    if(elapsedTime > 0)
+        cout << " (" << succeeded / elapsedTime << " images per second)";
+    cout << endl;
+    if(failedWrites > 0)
+        cerr << failedWrites << " output files could not be written" << endl;
+
+    return results;
+}
+
+}
@@ -0,0 +1,130 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyBatch_hpp
+#define parsleyBatch_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "parsleyLib.hpp"
+#include "parsleyOutput.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ A fixed size thread pool where each worker owns a queue of tasks.
+
+ A worker takes tasks from the front of its own queue, when the queue is empty it steals from the back of the other workers queues.
+ In this way a few huge images assigned to the same worker do not leave the other workers idle.
+ */
+class WorkStealingPool
+{
+public:
+    /**
+     Starts the worker threads.
+
+     @param numThreads number of workers, if <= 0 the number of hardware threads is used
+     */
+    explicit WorkStealingPool(int numThreads);
+
+    /**
+     Waits for all submitted tasks to complete and joins the workers.
+     */
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /**
+     Adds a task to the pool. Tasks are distributed round robin over the workers queues.
+
+     @param task the task to execute, it must not throw
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     Blocks until every submitted task has been executed.
+     */
+    void wait();
+
+    /**
+     @return the number of worker threads
+     */
+    int size() const;
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool popLocal(int workerId, std::function<void()>& task);
+    bool steal(int workerId, std::function<void()>& task);
+    void workerLoop(int workerId);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex stateMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    std::atomic<std::size_t> queuedTasks; // submitted but not yet taken by a worker
+    std::size_t pendingTasks;             // submitted but not yet completed, guarded by stateMutex
+    std::size_t nextQueue;                // guarded by stateMutex
+    bool stopping;                        // guarded by stateMutex
+};
+
+
+/**
+ Outcome of a single image processed in batch mode.
+ */
+struct BatchItemResult
+{
+    std::string inputImgPath;
+    std::size_t detectedObjects = 0;
+    double elapsedTime = 0.0; // seconds
+    bool succeeded = false;
+};
+
+
+/**
+ Lists the images to process in batch mode.
+
+ @param dirOrManifest a directory (all the files it contains that OpenCV can decode are taken) or a manifest text file with one image path per line (empty lines and lines starting with '#' are skipped)
+ @return the list of image paths
+ */
+std::vector<std::string> collectBatchInputs(const std::string& dirOrManifest);
+
+
+/**
+ Processes many images at once on all cores with a WorkStealingPool, using processImage on each of them.
+
+ OpenCV internal threading is disabled while the batch runs, each worker already keeps a core busy.
+ Depending on outputLevel, for each image a file <image name>_processedImages.tiff (full debug stack) or <image name>_annotated.tiff is saved in outputImgPath by a background AsyncImageWriter.
+ Prints to console the detected objects count per image and the total throughput.
+
+ @param inputImgPaths the images to process
+ @param outputImgPath output directory
+ @param numThreads number of workers, if <= 0 the number of hardware threads is used
+ @param outputLevel which images to save for each input image
+ @param compression compression of the saved TIFF files
+ @param engine the algorithm used to extract the impurities from the binary image
+ @param sink if not null where to save the detections of each image, with its position in inputImgPaths as frame id (records are in completion order)
+ @param classifier if not null the pixels of each image are classified by this color lookup table instead of gamma correction and thresholding, see processImage
+ @param cleanFrameMargin if above 0 the images passing the sampled clean frame check are skipped, see processImage
+ @param cache if not null the detections of images already processed with the same parameters are taken from it, see processImage
+ @return one result per input image, in the same order as inputImgPaths
+ */
+std::vector<BatchItemResult> processBatch(const std::vector<std::string>& inputImgPaths, const std::string& outputImgPath, int numThreads, OutputLevel outputLevel = OutputLevel::FULL_DEBUG, TiffCompression compression = TiffCompression::NONE, DetectorEngine engine = DetectorEngine::SIMPLE_BLOB, ResultSink* sink = nullptr, const ColorClassifier* classifier = nullptr, double cleanFrameMargin = 0, ResultCache* cache = nullptr);
+
+}
+#endif /* parsleyBatch_hpp */
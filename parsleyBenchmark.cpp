@@ -0,0 +1,596 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyBenchmark.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyPipeline.hpp"
+#include "parsleyBitMask.hpp"
+#include "parsleyColor.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+// Contours rectangles spread over a square scene, with keypoints on half of them, at random positions and just outside the top left corner of a quarter of them
+// (within half a pixel: inside once rounded, as Rect::contains does, and often on a grid cell edge or left of and above the grid origin)
+static void generateMatchingScene(int nContours, RNG& rng, vector<RotatedRect>& rotRects, vector<KeyPoint>& keypoints)
+{
+    // the scene grows with the number of contours, keeping their density about constant (a heavily contaminated sample)
+    float sceneSide = (float)(200 * sqrt((double)nContours));
+
+    rotRects.clear();
+    keypoints.clear();
+    for(int i=0; i<nContours; ++i)
+    {
+        Point2f center(rng.uniform(0.f, sceneSide), rng.uniform(0.f, sceneSide));
+        rotRects.push_back(RotatedRect(center, Size2f(rng.uniform(5.f, 80.f), rng.uniform(5.f, 80.f)), rng.uniform(0.f, 180.f)));
+        if(i % 4 == 0)
+            keypoints.push_back(KeyPoint(center, 10.f));
+        else if(i % 4 == 1)
+            keypoints.push_back(KeyPoint(Point2f(rng.uniform(0.f, sceneSide), rng.uniform(0.f, sceneSide)), 10.f));
+        else if(i % 4 == 2)
+        {
+            Rect box = rotRects.back().boundingRect();
+            keypoints.push_back(KeyPoint(Point2f(box.x - 0.4f, box.y - 0.4f), 10.f));
+        }
+    }
+}
+
+
+bool benchmarkRectMatching(int maxContours)
+{
+    const int quadraticLimit = 20000; // above this the original implementation takes minutes
+    RNG rng(12345);                   // fixed seed: every run measures the same scenes
+    bool allEqual = true;
+
+    cout << "contours\tkeypoints\tselected\tgrid (ms)\toriginal (ms)\tspeedup" << endl;
+    for(int nContours=100; nContours<=maxContours; nContours*=10)
+    {
+        vector<RotatedRect> rotRects;
+        vector<KeyPoint> keypoints;
+        generateMatchingScene(nContours, rng, rotRects, keypoints);
+
+        double ticks = (double) getTickCount();
+        vector<RotatedRect> selected = selectBlobDetectedRects(keypoints, rotRects);
+        double gridTime = ((double)getTickCount() - ticks) * 1000.0 / getTickFrequency();
+
+        cout << nContours << "\t" << keypoints.size() << "\t" << selected.size() << "\t" << gridTime << "\t";
+        if(nContours > quadraticLimit)
+        {
+            cout << "skipped\t-" << endl;
+            continue;
+        }
+
+        ticks = (double) getTickCount();
+        vector<RotatedRect> original(rotRects);
+        vector<RotatedRect> originalCopy(rotRects);
+        eliminateBlobDetectedRect(keypoints, originalCopy);
+        vectorsDifference(original, originalCopy);
+        double originalTime = ((double)getTickCount() - ticks) * 1000.0 / getTickFrequency();
+
+        bool equal = (original.size() == selected.size());
+        for(int i=0; equal && i<selected.size(); ++i)
+            equal = (original[i].center == selected[i].center);
+        allEqual = allEqual && equal;
+
+        cout << originalTime << "\t" << (gridTime > 0 ? originalTime / gridTime : 0.0) << (equal ? "" : "\tMISMATCH") << endl;
+    }
+    return allEqual;
+}
+
+
+
+void generateParsleyScene(Size size, double impuritiesPerMegapixel, RNG& rng, Mat& image, vector<RotatedRect>& impurities)
+{
+    // dark tray, with sensor noise
+    image.create(size, CV_8UC3);
+    randu(image, Scalar(20, 20, 20), Scalar(45, 45, 45));
+
+    // dried parsley leaves: small dark green ellipses covering most of the tray
+    int nLeaves = (int)(size.area() / 250);
+    for(int i=0; i<nLeaves; ++i)
+    {
+        Point2f center(rng.uniform(0.f, (float)size.width), rng.uniform(0.f, (float)size.height));
+        RotatedRect leaf(center, Size2f(rng.uniform(8.f, 30.f), rng.uniform(3.f, 10.f)), rng.uniform(0.f, 180.f));
+        ellipse(image, leaf, Scalar(rng.uniform(30, 60), rng.uniform(70, 110), rng.uniform(40, 70)), FILLED);
+    }
+
+    // impurities: bright straw colored ellipses, away from the borders and from each other
+    const float margin = 60, minDistance = 130;
+    int nImpurities = cvRound(impuritiesPerMegapixel * size.area() / 1e6);
+    impurities.clear();
+    for(int attempt=0; attempt<nImpurities * 50 && impurities.size()<nImpurities; ++attempt)
+    {
+        Point2f center(rng.uniform(margin, size.width - margin), rng.uniform(margin, size.height - margin));
+        bool isolated = true;
+        for(int j=0; isolated && j<impurities.size(); ++j)
+        {
+            Point2f d = impurities[j].center - center;
+            isolated = (d.x * d.x + d.y * d.y >= minDistance * minDistance);
+        }
+        if(!isolated)
+            continue;
+        // axes of at least 50x40 pixels: area above pi/4*50*40 = 1570 pixels
+        RotatedRect impurity(center, Size2f(rng.uniform(50.f, 110.f), rng.uniform(40.f, 80.f)), rng.uniform(0.f, 180.f));
+        ellipse(image, impurity, Scalar(rng.uniform(150, 190), rng.uniform(200, 230), rng.uniform(215, 240)), FILLED);
+        impurities.push_back(impurity);
+    }
+
+    // softer edges, as from the camera optics
+    GaussianBlur(image, image, Size(3, 3), 0);
+}
+
+
+// Stages timed by benchmarkPipeline, in pipeline order
+enum BenchmarkStage { DECODE, GAMMA_HISTOGRAM, THRESHOLD, BINARIZE, BLOB_DETECT, RECT_MATCHING, DRAW, ENCODE, N_STAGES };
+static const char* const stageNames[N_STAGES] = {"decode", "gammaHistogram", "threshold", "binarize", "blobDetect", "rectMatching", "draw", "encode"};
+
+
+// Milliseconds since ticks, which is moved to now
+static double lapMilliseconds(double& ticks)
+{
+    double now = (double) getTickCount();
+    double elapsed = (now - ticks) * 1000.0 / getTickFrequency();
+    ticks = now;
+    return elapsed;
+}
+
+
+static double median(vector<double> values)
+{
+    sort(values.begin(), values.end());
+    return values.empty() ? 0.0 : values[values.size() / 2];
+}
+
+
+// FNV-1a hash of the detected centers, at 1/16 pixel: equal detections give equal hashes
+static string detectionsHash(const vector<KeyPoint>& keypoints)
+{
+    uint64 hash = 14695981039346656037ULL;
+    for(int i=0; i<keypoints.size(); ++i)
+    {
+        int values[2] = {cvRound(keypoints[i].pt.x * 16), cvRound(keypoints[i].pt.y * 16)};
+        const uchar* bytes = reinterpret_cast<const uchar*>(values);
+        for(int b=0; b<sizeof(values); ++b)
+            hash = (hash ^ bytes[b]) * 1099511628211ULL;
+    }
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+    return text;
+}
+
+
+// The node of the scene named name in a previous results file, or a none node
+static FileNode findBaselineScene(const FileNode& scenes, const string& name)
+{
+    for(int i=0; i<scenes.size(); ++i)
+        if((string)scenes[i]["name"] == name)
+            return scenes[i];
+    return FileNode();
+}
+
+
+bool benchmarkPipeline(const string& resultsPath, const string& baselinePath, int repetitions, double tolerance)
+{
+    const Size resolutions[] = {Size(1024, 768), Size(2592, 1944), Size(4096, 3072)};
+    const char* const densityNames[] = {"sparse", "dense"};
+    const double densities[] = {4, 30}; // impurities per megapixel
+    const double gamma = 1.5;           // same settings as processImage
+    const float minArea = 1500;
+    repetitions = max(1, repetitions);
+
+    FileStorage baseline;
+    FileNode baselineScenes;
+    if(!baselinePath.empty())
+    {
+        baseline.open(baselinePath, FileStorage::READ);
+        if(!baseline.isOpened())
+            cerr << "Unable to read the baseline: " << baselinePath << endl;
+        else
+            baselineScenes = baseline["scenes"];
+    }
+
+    FileStorage results(resultsPath, FileStorage::WRITE);
+    if(!results.isOpened())
+    {
+        cerr << "Unable to write: " << resultsPath << endl;
+        return false;
+    }
+    results << "repetitions" << repetitions;
+    results << "scenes" << "[";
+
+    SimpleBlobDetector::Params parameters = instantiateBlobParams();
+    Ptr<SimpleBlobDetector> blobDetector = getBlobDetectorInstance(&parameters, minArea);
+    RNG rng(12345); // fixed seed: every run, of every version, measures the same scenes
+    // the compile time gamma tables must give the same thresholds as pow(), or every detection would shift
+    bool sameDetections = checkGammaLookUpTables();
+    if(!sameDetections)
+        cout << "GAMMA TABLES DIFFER from pow()" << endl;
+
+    cout << "scene\timpurities\tdetected\trecall\tprecision\ttotal (ms)";
+    for(int s=0; s<N_STAGES; ++s)
+        cout << "\t" << stageNames[s];
+    cout << endl;
+
+    for(int r=0; r<sizeof(resolutions)/sizeof(resolutions[0]); ++r)
+        for(int d=0; d<sizeof(densities)/sizeof(densities[0]); ++d)
+        {
+            string name = to_string(resolutions[r].width) + "x" + to_string(resolutions[r].height) + "_" + densityNames[d];
+            Mat scene;
+            vector<RotatedRect> impurities;
+            generateParsleyScene(resolutions[r], densities[d], rng, scene, impurities);
+            vector<uchar> encodedScene;
+            imencode(".png", scene, encodedScene);
+            scene.release();
+
+            vector<double> stageTimes[N_STAGES];
+            vector<KeyPoint> keypoints;
+            for(int repetition=0; repetition<repetitions; ++repetition)
+            {
+                double ticks = (double) getTickCount();
+                Mat colorImg = imdecode(encodedScene, IMREAD_COLOR), img;
+                cvtColor(colorImg, img, COLOR_BGR2GRAY);
+                stageTimes[DECODE].push_back(lapMilliseconds(ticks));
+
+                vector<float> imgHistogramData, gammaHistogramData;
+                fusedGammaHistogram(img, gamma, imgHistogramData, gammaHistogramData);
+                stageTimes[GAMMA_HISTOGRAM].push_back(lapMilliseconds(ticks));
+
+                double thresholdingValue = getAdaptiveThreshValue(gammaHistogramData);
+                stageTimes[THRESHOLD].push_back(lapMilliseconds(ticks));
+
+                Mat binaryImage;
+                gammaToBinaryImage(img, gamma, thresholdingValue, binaryImage);
+                stageTimes[BINARIZE].push_back(lapMilliseconds(ticks));
+
+                keypoints.clear();
+                blobDetector->detect(binaryImage, keypoints);
+                stageTimes[BLOB_DETECT].push_back(lapMilliseconds(ticks));
+
+                vector<vector<Point>> contoursSet;
+                findContours(binaryImage, contoursSet, RETR_EXTERNAL, CHAIN_APPROX_NONE);
+                vector<RotatedRect> contoursRects(contoursSet.size());
+                for(int i=0; i<contoursSet.size(); ++i)
+                    contoursRects[i] = minAreaRect(contoursSet[i]);
+                vector<RotatedRect> boundingRects = selectBlobDetectedRects(keypoints, contoursRects);
+                stageTimes[RECT_MATCHING].push_back(lapMilliseconds(ticks));
+
+                drawRotatedBoundingBoxes(colorImg, boundingRects);
+                stageTimes[DRAW].push_back(lapMilliseconds(ticks));
+
+                vector<uchar> encodedOutput;
+                imencode(".tiff", colorImg, encodedOutput);
+                stageTimes[ENCODE].push_back(lapMilliseconds(ticks));
+            }
+
+            // ground truth: a detection is right if its center falls inside an impurity, an impurity is found if a detection falls inside it
+            int foundImpurities = 0, rightDetections = 0;
+            vector<bool> found(impurities.size(), false);
+            for(int k=0; k<keypoints.size(); ++k)
+            {
+                bool right = false;
+                for(int i=0; i<impurities.size(); ++i)
+                    if(pointBelongsToRect(impurities[i], keypoints[k].pt))
+                    {
+                        right = true;
+                        if(!found[i])
+                        {
+                            found[i] = true;
+                            ++foundImpurities;
+                        }
+                    }
+                rightDetections += right ? 1 : 0;
+            }
+            double recall = impurities.empty() ? 1.0 : (double)foundImpurities / impurities.size();
+            double precision = keypoints.empty() ? 1.0 : (double)rightDetections / keypoints.size();
+            string hash = detectionsHash(keypoints);
+
+            double medians[N_STAGES], total = 0;
+            for(int s=0; s<N_STAGES; ++s)
+            {
+                medians[s] = median(stageTimes[s]);
+                total += medians[s];
+            }
+
+            cout << name << "\t" << impurities.size() << "\t" << keypoints.size() << "\t" << recall << "\t" << precision << "\t" << total;
+            for(int s=0; s<N_STAGES; ++s)
+                cout << "\t" << medians[s];
+            cout << endl;
+
+            results << "{" << "name" << name << "width" << resolutions[r].width << "height" << resolutions[r].height;
+            results << "impurities" << (int)impurities.size() << "detections" << (int)keypoints.size();
+            results << "recall" << recall << "precision" << precision << "detectionsHash" << hash;
+            results << "totalMs" << total << "stagesMs" << "{";
+            for(int s=0; s<N_STAGES; ++s)
+                results << stageNames[s] << medians[s];
+            results << "}" << "}";
+
+            // comparison with the baseline run of the same scene
+            FileNode previous = findBaselineScene(baselineScenes, name);
+            if(previous.empty())
+                continue;
+            if((string)previous["detectionsHash"] != hash)
+            {
+                sameDetections = false;
+                cout << name << ": DETECTIONS CHANGED from the baseline (" << (int)previous["detections"] << " -> " << keypoints.size() << ")" << endl;
+            }
+            for(int s=0; s<N_STAGES; ++s)
+            {
+                double previousTime = (double)previous["stagesMs"][stageNames[s]];
+                if(previousTime > 0 && medians[s] > previousTime * (1 + tolerance))
+                    cout << name << ": " << stageNames[s] << " slower than the baseline (" << previousTime << " -> " << medians[s] << " ms)" << endl;
+            }
+            double previousTotal = (double)previous["totalMs"];
+            if(previousTotal > 0)
+                cout << name << ": total " << previousTotal << " -> " << total << " ms (speedup " << previousTotal / total << ")" << endl;
+        }
+
+    results << "]";
+    results.release();
+    return sameDetections;
+}
+
+
+
+// Fraction of the impurities containing at least one of the centers
+static double groundTruthRecall(const vector<RotatedRect>& impurities, const vector<Point2f>& centers)
+{
+    int found = 0;
+    for(int i=0; i<impurities.size(); ++i)
+    {
+        bool hit = false;
+        for(int c=0; !hit && c<centers.size(); ++c)
+            hit = pointBelongsToRect(impurities[i], centers[c]);
+        found += hit ? 1 : 0;
+    }
+    return impurities.empty() ? 1.0 : (double)found / impurities.size();
+}
+
+
+bool benchmarkCoarseToFine(int levels, int repetitions)
+{
+    const Size resolutions[] = {Size(2592, 1944), Size(4096, 3072)};
+    const double densities[] = {4, 30}; // impurities per megapixel
+    const float maxDistance = 3;        // pixels between a full resolution detection and its coarse to fine match
+    repetitions = max(1, repetitions);
+
+    PipelineSettings fullSettings;
+    PipelineSettings coarseSettings;
+    coarseSettings.coarseLevels = levels;
+    Pipeline fullPipeline(fullSettings), coarsePipeline(coarseSettings);
+    DetectionResult fullResult, coarseResult;
+    RNG rng(12345); // the same scenes at every run
+    bool allRecalled = true;
+
+    cout << "scene\tfull (ms)\tcoarse (ms)\tspeedup\trecall\trefined\tregions\tground truth full/coarse" << endl;
+    for(int r=0; r<sizeof(resolutions)/sizeof(resolutions[0]); ++r)
+        for(int d=0; d<sizeof(densities)/sizeof(densities[0]); ++d)
+        {
+            Mat scene, image;
+            vector<RotatedRect> impurities;
+            generateParsleyScene(resolutions[r], densities[d], rng, scene, impurities);
+            cvtColor(scene, image, COLOR_BGR2GRAY);
+
+            vector<double> fullTimes, coarseTimes;
+            for(int repetition=0; repetition<repetitions; ++repetition)
+            {
+                double ticks = (double) getTickCount();
+                fullPipeline.process(image, fullResult);
+                fullTimes.push_back(lapMilliseconds(ticks));
+                coarsePipeline.process(image, coarseResult);
+                coarseTimes.push_back(lapMilliseconds(ticks));
+            }
+
+            int recalled = 0;
+            for(int i=0; i<fullResult.centers.size(); ++i)
+            {
+                bool found = false;
+                for(int j=0; !found && j<coarseResult.centers.size(); ++j)
+                {
+                    Point2f d = fullResult.centers[i] - coarseResult.centers[j];
+                    found = (d.x * d.x + d.y * d.y <= maxDistance * maxDistance);
+                }
+                recalled += found ? 1 : 0;
+            }
+            double recall = fullResult.centers.empty() ? 1.0 : (double)recalled / fullResult.centers.size();
+            allRecalled = allRecalled && recalled == fullResult.centers.size();
+
+            double fullTime = median(fullTimes), coarseTime = median(coarseTimes);
+            cout << resolutions[r].width << "x" << resolutions[r].height << "@" << densities[d] << "\t" << fullTime << "\t" << coarseTime << "\t" << (coarseTime > 0 ? fullTime / coarseTime : 0.0) << "\t" << recall;
+            cout << "\t" << coarsePipeline.coarseToFineStats().refinedFraction << "\t" << coarsePipeline.coarseToFineStats().candidateRegions;
+            cout << "\t" << groundTruthRecall(impurities, fullResult.centers) << "/" << groundTruthRecall(impurities, coarseResult.centers) << endl;
+        }
+    return allRecalled;
+}
+
+
+bool benchmarkBitMask(int repetitions)
+{
+    const Size resolutions[] = {Size(2592, 1944), Size(4096, 3072), Size(8192, 6144)};
+    const double densities[] = {4, 30}; // impurities per megapixel
+    repetitions = max(1, repetitions);
+
+    SimpleBlobDetector::Params parameters = instantiateBlobParams();
+    Pipeline thresholdPipeline; // only for the thresholding value
+    DetectionResult thresholdResult;
+    DetectionBuffers componentBuffers;
+    RunLabelingBuffers runBuffers;
+    Mat binaryImage;
+    BitMask mask;
+    vector<KeyPoint> componentKeypoints, bitMaskKeypoints;
+    vector<RotatedRect> componentRects, bitMaskRects;
+    RNG rng(12345); // the same scenes at every run
+    bool allEqual = true;
+
+    cout << "scene\tbinarize components/bitmask (ms)\tlabel components/bitmask (ms)\tmemory components/bitmask (MB)\tobjects\tequal" << endl;
+    for(int r=0; r<sizeof(resolutions)/sizeof(resolutions[0]); ++r)
+        for(int d=0; d<sizeof(densities)/sizeof(densities[0]); ++d)
+        {
+            Mat scene, image;
+            vector<RotatedRect> impurities;
+            generateParsleyScene(resolutions[r], densities[d], rng, scene, impurities);
+            cvtColor(scene, image, COLOR_BGR2GRAY);
+            thresholdPipeline.process(image, thresholdResult);
+            double gamma = thresholdPipeline.settings().gamma;
+
+            vector<double> binarizeTimes[2], labelTimes[2];
+            for(int repetition=0; repetition<repetitions; ++repetition)
+            {
+                double ticks = (double) getTickCount();
+                gammaToBinaryImage(image, gamma, thresholdResult.thresholdingValue, binaryImage);
+                binarizeTimes[0].push_back(lapMilliseconds(ticks));
+                detectComponentRects(binaryImage, parameters, componentBuffers, componentKeypoints, componentRects);
+                labelTimes[0].push_back(lapMilliseconds(ticks));
+                gammaToBitMask(image, gamma, thresholdResult.thresholdingValue, mask);
+                binarizeTimes[1].push_back(lapMilliseconds(ticks));
+                detectBitMaskRects(mask, parameters, runBuffers, bitMaskKeypoints, bitMaskRects);
+                labelTimes[1].push_back(lapMilliseconds(ticks));
+            }
+
+            bool equal = componentKeypoints.size() == bitMaskKeypoints.size() && componentRects.size() == bitMaskRects.size();
+            for(int i=0; equal && i<componentKeypoints.size(); ++i)
+                equal = componentKeypoints[i].pt == bitMaskKeypoints[i].pt && componentKeypoints[i].size == bitMaskKeypoints[i].size;
+            for(int i=0; equal && i<componentRects.size(); ++i)
+                equal = componentRects[i].center == bitMaskRects[i].center && componentRects[i].size == bitMaskRects[i].size && componentRects[i].angle == bitMaskRects[i].angle;
+            allEqual = allEqual && equal;
+
+            double componentBytes = (double)(binaryImage.total() * binaryImage.elemSize() + componentBuffers.labels.total() * componentBuffers.labels.elemSize());
+            double bitMaskBytes = (double)(mask.memoryBytes() + runBuffers.runs.capacity() * sizeof(MaskRun) + (runBuffers.parent.capacity() + runBuffers.runComponent.capacity() + runBuffers.componentRuns.capacity()) * sizeof(int));
+            cout << resolutions[r].width << "x" << resolutions[r].height << "@" << densities[d];
+            cout << "\t" << median(binarizeTimes[0]) << "/" << median(binarizeTimes[1]) << "\t" << median(labelTimes[0]) << "/" << median(labelTimes[1]);
+            cout << "\t" << componentBytes / (1 << 20) << "/" << bitMaskBytes / (1 << 20) << "\t" << bitMaskKeypoints.size() << "\t" << (equal ? "yes" : "NO") << endl;
+        }
+    return allEqual;
+}
+
+
+bool benchmarkColorClassifier(int repetitions)
+{
+    const Size resolutions[] = {Size(2592, 1944), Size(4096, 3072)};
+    const double densities[] = {4, 30}; // impurities per megapixel
+    repetitions = max(1, repetitions);
+    RNG rng(12345); // the same scenes at every run
+
+    // training: impurities white, their blurred edges gray (ignored), the rest black
+    ColorClassifier classifier;
+    {
+        Mat scene, labels;
+        vector<RotatedRect> impurities;
+        generateParsleyScene(Size(2592, 1944), 30, rng, scene, impurities);
+        labels = Mat::zeros(scene.size(), CV_8U);
+        for(int i=0; i<impurities.size(); ++i)
+            ellipse(labels, impurities[i], Scalar(128), 5);
+        for(int i=0; i<impurities.size(); ++i)
+        {
+            RotatedRect inner = impurities[i];
+            inner.size.width -= 4;
+            inner.size.height -= 4;
+            ellipse(labels, inner, Scalar(255), FILLED);
+        }
+        classifier.addSamples(scene, labels);
+        classifier.train();
+    }
+
+    Pipeline pipeline;
+    DetectionResult grayResult, colorResult;
+    Mat binaryImage;
+    bool colorRecallsAll = true;
+
+    cout << "scene\tgammaToBinaryImage/classify (ms per megapixel)\tground truth recall gray/color\tobjects gray/color" << endl;
+    for(int r=0; r<sizeof(resolutions)/sizeof(resolutions[0]); ++r)
+        for(int d=0; d<sizeof(densities)/sizeof(densities[0]); ++d)
+        {
+            Mat scene, image;
+            vector<RotatedRect> impurities;
+            generateParsleyScene(resolutions[r], densities[d], rng, scene, impurities);
+            cvtColor(scene, image, COLOR_BGR2GRAY);
+            pipeline.process(image, grayResult);
+            pipeline.processColor(scene, classifier, colorResult);
+
+            vector<double> grayTimes, colorTimes;
+            for(int repetition=0; repetition<repetitions; ++repetition)
+            {
+                double ticks = (double) getTickCount();
+                gammaToBinaryImage(image, pipeline.settings().gamma, grayResult.thresholdingValue, binaryImage);
+                grayTimes.push_back(lapMilliseconds(ticks));
+                classifier.classify(scene, binaryImage);
+                colorTimes.push_back(lapMilliseconds(ticks));
+            }
+
+            double megapixels = scene.total() / 1e6;
+            double grayRecall = groundTruthRecall(impurities, grayResult.centers), colorRecall = groundTruthRecall(impurities, colorResult.centers);
+            colorRecallsAll = colorRecallsAll && colorRecall >= grayRecall;
+            cout << resolutions[r].width << "x" << resolutions[r].height << "@" << densities[d];
+            cout << "\t" << median(grayTimes) / megapixels << "/" << median(colorTimes) / megapixels;
+            cout << "\t" << grayRecall << "/" << colorRecall << "\t" << grayResult.centers.size() << "/" << colorResult.centers.size() << endl;
+        }
+    return colorRecallsAll;
+}
+
+
+bool benchmarkCleanFrames(double margin, int repetitions)
+{
+    const Size resolutions[] = {Size(2592, 1944), Size(4096, 3072)};
+    const char* const sceneNames[] = {"clean", "single", "sparse"};
+    repetitions = max(1, repetitions);
+
+    PipelineSettings fullSettings;
+    PipelineSettings cleanSettings;
+    cleanSettings.cleanFrameMargin = margin;
+    Pipeline fullPipeline(fullSettings), cleanPipeline(cleanSettings);
+    DetectionResult fullResult, cleanResult;
+    RNG rng(12345); // the same scenes at every run
+    bool dirtyNeverSkipped = true;
+    int cleanScenes = 0, cleanSkipped = 0;
+    double fullTotal = 0.0, checkedTotal = 0.0;
+
+    cout << "scene\tfull/checked (ms)\tclean frame\tground truth recall full/checked" << endl;
+    for(int r=0; r<sizeof(resolutions)/sizeof(resolutions[0]); ++r)
+        for(int s=0; s<sizeof(sceneNames)/sizeof(sceneNames[0]); ++s)
+        {
+            // no impurity, exactly one, then 4 per megapixel
+            const double megapixels = resolutions[r].area() / 1e6;
+            const double densities[] = {0, 1 / megapixels, 4};
+            Mat scene, image;
+            vector<RotatedRect> impurities;
+            generateParsleyScene(resolutions[r], densities[s], rng, scene, impurities);
+            cvtColor(scene, image, COLOR_BGR2GRAY);
+
+            vector<double> fullTimes, checkedTimes;
+            for(int repetition=0; repetition<repetitions; ++repetition)
+            {
+                double ticks = (double) getTickCount();
+                fullPipeline.process(image, fullResult);
+                fullTimes.push_back(lapMilliseconds(ticks));
+                cleanPipeline.process(image, cleanResult);
+                checkedTimes.push_back(lapMilliseconds(ticks));
+            }
+
+            bool skipped = cleanPipeline.lastImageClean();
+            if(impurities.empty())
+            {
+                ++cleanScenes;
+                cleanSkipped += skipped ? 1 : 0;
+            }
+            else
+                dirtyNeverSkipped = dirtyNeverSkipped && !skipped;
+            fullTotal += median(fullTimes);
+            checkedTotal += median(checkedTimes);
+            cout << resolutions[r].width << "x" << resolutions[r].height << "@" << sceneNames[s];
+            cout << "\t" << median(fullTimes) << "/" << median(checkedTimes) << "\t" << (skipped ? "yes" : "no");
+            cout << "\t" << groundTruthRecall(impurities, fullResult.centers) << "/" << groundTruthRecall(impurities, cleanResult.centers) << endl;
+        }
+    cout << "Margin " << margin << ": " << cleanSkipped << "/" << cleanScenes << " clean scenes skipped, " << (dirtyNeverSkipped ? "no" : "SOME") << " scenes with impurities skipped, total time " << fullTotal << "/" << checkedTotal << " ms" << endl;
+    return dirtyNeverSkipped;
+}
+
+}
@@ -0,0 +1,101 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyBenchmark_hpp
+#define parsleyBenchmark_hpp
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace parsleyLib{
+
+
+/**
+ Scaling benchmark of the keypoints to rotated rectangles matching step.
+
+ For a growing number of random contours rectangles (from 100 up to maxContours, with three quarters as many keypoints, some within half a pixel of a bounding box corner) times selectBlobDetectedRects against the original eliminateBlobDetectedRect + vectorsDifference pair, and checks that both select the same rectangles.
+ The original quadratic pair is skipped above 20000 contours. Prints a table to console.
+
+ @param maxContours the largest number of contours to test
+ @return false if the two implementations ever disagree
+ */
+bool benchmarkRectMatching(int maxContours = 100000);
+
+
+/**
+ Generates a synthetic image of dried parsley leaves with bright impurities at known positions.
+ 
+ Small dark green leaves cover a dark tray, impurities are bright ellipses (all above the default minArea of 1500 pixels) kept apart from each other. The same RNG state always gives the same image.
+ 
+ @param size the image size
+ @param impuritiesPerMegapixel impurities density, 0 for a scene without impurities
+ @param rng the random number generator
+ @param image where to save the CV_8UC3 image
+ @param impurities where to save the ground truth: the impurities ellipses, as rotated rectangles
+ */
+void generateParsleyScene(cv::Size size, double impuritiesPerMegapixel, cv::RNG& rng, cv::Mat& image, std::vector<cv::RotatedRect>& impurities);
+
+
+/**
+ Reproducible benchmark of the whole pipeline on synthetic parsley images (see generateParsleyScene) at several resolutions and impurities densities.
+ 
+ Each scene is encoded to PNG in memory, then every stage of processImage (annotated output, blob engine) is timed separately: decode, fused gamma correction and histograms, getAdaptiveThreshValue, binarization, blob detection, contours/rectangles matching, drawing and encoding. The median of the repetitions is reported.
+ Detections are checked against the ground truth (recall and precision) and summarized by a hash, so that a faster version can be shown to detect the same objects. The compile time gamma tables are checked first, see checkGammaLookUpTables.
+ Results are saved by cv::FileStorage (the extension chooses JSON, YAML or XML) and can be passed back as baseline of a later run.
+ 
+ @param resultsPath where to save the results
+ @param baselinePath results of a previous run to compare with, or empty
+ @param repetitions timed runs of each scene
+ @param tolerance relative slowdown of a stage over the baseline reported as a regression
+ @return false if the detections differ from the baseline ones or the gamma tables from pow()
+ */
+bool benchmarkPipeline(const std::string& resultsPath, const std::string& baselinePath = "", int repetitions = 5, double tolerance = 0.2);
+
+
+/**
+ Recall check and timing of the coarse to fine detection (PipelineSettings::coarseLevels) against the full resolution one, on synthetic parsley images.
+ 
+ A full resolution detection is recalled if a coarse to fine one lies within 3 pixels. Prints a table to console with times, recall, the refined fraction of the image and the ground truth recall of both.
+ 
+ @param levels the pyramid level of the coarse to fine detection
+ @param repetitions timed runs of each scene, the median time is reported
+ @return false if some full resolution detection is not recalled
+ */
+bool benchmarkCoarseToFine(int levels = 2, int repetitions = 3);
+
+
+/**
+ Checks and times the bit mask engine (gammaToBitMask + detectBitMaskRects) against the connected components one (gammaToBinaryImage + detectComponentRects) on synthetic parsley images.
+ 
+ Both binarize with the same thresholding value. Prints a table to console with the times of binarization and labeling and the working memory of each: binary image and label image against bit mask and runs.
+ 
+ @param repetitions timed runs of each scene, the median time is reported
+ @return false if the two engines ever give different detections
+ */
+bool benchmarkBitMask(int repetitions = 5);
+
+
+/**
+ Checks and times the clean frame fast path (see isCleanFrame) on synthetic parsley images without impurities, with exactly one and with 4 per megapixel.
+ 
+ Prints a table to console with the time of the whole pipeline without and with the check, whether the frame was reported clean and the ground truth recall of both.
+ 
+ @param margin confidence margin of the check
+ @param repetitions timed runs of each scene, the median time is reported
+ @return false if a scene with impurities is ever reported clean
+ */
+bool benchmarkCleanFrames(double margin = 0.5, int repetitions = 5);
+
+
+/**
+ Trains a ColorClassifier on a synthetic parsley image (impurity ellipses labeled from the ground truth, their blurred edges ignored) and checks it on other synthetic images against the grayscale pipeline.
+ 
+ Prints a table to console with the time per megapixel of classify against gammaToBinaryImage (same engine and minArea after them) and the ground truth recall of both.
+ 
+ @param repetitions timed runs of each scene, the median time is reported
+ @return false if the color classifier recalls fewer impurities than the grayscale pipeline
+ */
+bool benchmarkColorClassifier(int repetitions = 5);
+
+}
+#endif /* parsleyBenchmark_hpp */
@@ -0,0 +1,323 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "parsleyBitMask.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyMetrics.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+void BitMask::create(Size size)
+{
+    maskSize = size;
+    stride = (size.width + 63) / 64;
+    words.resize((size_t)stride * size.height);
+}
+
+
+Size BitMask::size() const
+{
+    return maskSize;
+}
+
+
+int BitMask::wordsPerRow() const
+{
+    return stride;
+}
+
+
+uint64_t* BitMask::row(int y)
+{
+    return words.data() + (size_t)y * stride;
+}
+
+
+const uint64_t* BitMask::row(int y) const
+{
+    return words.data() + (size_t)y * stride;
+}
+
+
+bool BitMask::at(int x, int y) const
+{
+    return (row(y)[x >> 6] >> (x & 63)) & 1;
+}
+
+
+size_t BitMask::memoryBytes() const
+{
+    return words.size() * sizeof(uint64_t);
+}
+
+
+void BitMask::toMat(Mat& binaryImage) const
+{
+    binaryImage.create(maskSize, CV_8U);
+    for(int y=0; y<maskSize.height; ++y)
+    {
+        uchar* out = binaryImage.ptr<uchar>(y);
+        for(int x=0; x<maskSize.width; ++x)
+            out[x] = at(x, y) ? 255 : 0;
+    }
+}
+
+
+// Sets the bits of the pixels of a row whose intensity passes the binary table
+static void tableRowBits(const uchar* src, uint64_t* dst, int cols, const uchar* binaryTable)
+{
+    for(int c=0, w=0; c<cols; c+=64, ++w)
+    {
+        uint64_t bits = 0;
+        int n = min(64, cols - c);
+        for(int b=0; b<n; ++b)
+            bits |= (uint64_t)binaryTable[src[c + b]] << b;
+        dst[w] = bits;
+    }
+}
+
+
+// Sets the bits of the pixels of a row above thresh: the comparison masks of 4 vectors of 16 pixels make a word
+static void thresholdRowBits(const uchar* src, uint64_t* dst, int cols, uchar thresh)
+{
+    int c = 0, w = 0;
+#if CV_SIMD128
+    const v_uint8x16 vThresh = v_setall_u8(thresh);
+    for( ; c<=cols-64; c+=64, ++w)
+    {
+        uint64_t bits = (uint64_t)(uint16_t)v_signmask(v_load(src + c) > vThresh);
+        bits |= (uint64_t)(uint16_t)v_signmask(v_load(src + c + 16) > vThresh) << 16;
+        bits |= (uint64_t)(uint16_t)v_signmask(v_load(src + c + 32) > vThresh) << 32;
+        bits |= (uint64_t)(uint16_t)v_signmask(v_load(src + c + 48) > vThresh) << 48;
+        dst[w] = bits;
+    }
+#endif
+    for( ; c<cols; c+=64, ++w)
+    {
+        uint64_t bits = 0;
+        int n = min(64, cols - c);
+        for(int b=0; b<n; ++b)
+            bits |= (uint64_t)(src[c + b] > thresh) << b;
+        dst[w] = bits;
+    }
+}
+
+
+void gammaToBitMask(const Mat& image, double gamma, double thresholdingValue, BitMask& mask)
+{
+    CV_Assert(image.type() == CV_8UC1);
+    mask.create(image.size());
+
+    // same decision as gammaToBinaryImage: the floor of the thresholding value against the gamma corrected intensity
+    const uchar* lookUpTable = getGammaLookUpTable(gamma);
+    int intThreshold = cvFloor(thresholdingValue);
+    uchar binaryTable[256];
+    for(int i=0; i<256; ++i)
+        binaryTable[i] = lookUpTable[i] > intThreshold ? 1 : 0;
+
+    // a non decreasing table is a step: a single compare with the last black intensity
+    int firstAbove = 256;
+    while(firstAbove > 0 && binaryTable[firstAbove-1])
+        --firstAbove;
+    bool monotonic = true;
+    for(int i=0; i<firstAbove; ++i)
+        monotonic = monotonic && !binaryTable[i];
+    const bool compare = monotonic && firstAbove > 0;
+    const uchar originalThreshold = (uchar)(firstAbove - 1);
+
+    const int nStripes = max(1, min(image.rows, getNumThreads() * 4));
+    parallel_for_(Range(0, nStripes), [&](const Range& range)
+    {
+        for(int s=range.start; s<range.end; ++s)
+        {
+            int rowEnd = (int)((int64)image.rows * (s + 1) / nStripes);
+            for(int r=(int)((int64)image.rows * s / nStripes); r<rowEnd; ++r)
+            {
+                if(compare)
+                    thresholdRowBits(image.ptr<uchar>(r), mask.row(r), image.cols, originalThreshold);
+                else
+                    tableRowBits(image.ptr<uchar>(r), mask.row(r), image.cols, binaryTable);
+            }
+        }
+    }, nStripes);
+}
+
+
+static inline int trailingZeros(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while(!(word & 1))
+    {
+        word >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+
+// Appends the runs of a mask row
+static void extractRowRuns(const uint64_t* row, int nWords, int cols, int y, vector<MaskRun>& runs)
+{
+    int w = 0;
+    uint64_t bits = nWords > 0 ? row[0] : 0;
+    while(true)
+    {
+        // next white pixel, black words are skipped whole
+        while(bits == 0)
+        {
+            if(++w >= nWords)
+                return;
+            bits = row[w];
+        }
+        int start = w * 64 + trailingZeros(bits);
+
+        // next black pixel: the first zero of the inverted word from the run start on
+        bits = ~row[w] & (~0ull << (start & 63));
+        while(bits == 0 && ++w < nWords)
+            bits = ~row[w];
+        int end = (w < nWords) ? min(cols, w * 64 + trailingZeros(bits)) : cols;
+        runs.push_back({y, start, end});
+        if(end >= cols)
+            return;
+
+        // the rest of the word after the run
+        w = end >> 6;
+        bits = row[w] & (~0ull << (end & 63));
+    }
+}
+
+
+void appendMaskRowRuns(const BitMask& mask, int y, vector<MaskRun>& runs)
+{
+    extractRowRuns(mask.row(y), mask.wordsPerRow(), mask.size().width, y, runs);
+}
+
+
+static int findRoot(vector<int>& parent, int i)
+{
+    while(parent[i] != i)
+    {
+        parent[i] = parent[parent[i]]; // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+
+void detectBitMaskRects(const BitMask& mask, const SimpleBlobDetector::Params& parameters, RunLabelingBuffers& buffers, vector<KeyPoint>& keypoints, vector<RotatedRect>& boundingRects)
+{
+    vector<MaskRun>& runs = buffers.runs;
+    vector<int>& parent = buffers.parent;
+    const Size size = mask.size();
+    runs.clear();
+
+    // runs row by row, each joined to the runs of the previous row it touches
+    int previousStart = 0, previousEnd = 0;
+    for(int y=0; y<size.height; ++y)
+    {
+        int rowStart = (int)runs.size();
+        extractRowRuns(mask.row(y), mask.wordsPerRow(), size.width, y, runs);
+        int rowEnd = (int)runs.size();
+        parent.resize(rowEnd);
+        for(int i=rowStart; i<rowEnd; ++i)
+            parent[i] = i;
+
+        // both rows are sorted: the first previous run still reaching the current one only moves forward
+        int j = previousStart;
+        for(int i=rowStart; i<rowEnd; ++i)
+        {
+            while(j < previousEnd && runs[j].end < runs[i].start) // 8-connectivity: a diagonal contact is enough
+                ++j;
+            for(int k=j; k<previousEnd && runs[k].start <= runs[i].end; ++k)
+            {
+                // the smallest index is the root, the first run in raster order
+                int a = findRoot(parent, i), b = findRoot(parent, k);
+                if(a < b)
+                    parent[b] = a;
+                else if(b < a)
+                    parent[a] = b;
+            }
+        }
+        previousStart = rowStart;
+        previousEnd = rowEnd;
+    }
+
+    // components numbered in raster order of their first pixel, the same order detectComponentRects sorts its components in
+    vector<int>& runComponent = buffers.runComponent;
+    runComponent.resize(runs.size());
+    int nComponents = 0;
+    for(int i=0; i<runs.size(); ++i)
+    {
+        int root = findRoot(parent, i);
+        runComponent[i] = (root == i) ? nComponents++ : runComponent[root];
+    }
+    countEvent(PipelineCounter::CONTOURS_FOUND, nComponents);
+
+    // area and bounding box, then the runs grouped by component
+    vector<int64_t>& areas = buffers.areas;
+    vector<Rect>& boxes = buffers.boxes;
+    vector<int>& componentOffset = buffers.componentOffset;
+    areas.assign(nComponents, 0);
+    boxes.resize(nComponents);
+    componentOffset.assign(nComponents + 1, 0);
+    for(int i=0; i<runs.size(); ++i)
+    {
+        int c = runComponent[i];
+        const MaskRun& run = runs[i];
+        if(areas[c] == 0)
+            boxes[c] = Rect(run.start, run.y, run.end - run.start, 1);
+        else
+            boxes[c] |= Rect(run.start, run.y, run.end - run.start, 1);
+        areas[c] += run.end - run.start;
+        ++componentOffset[c + 1];
+    }
+    for(int c=0; c<nComponents; ++c)
+        componentOffset[c + 1] += componentOffset[c];
+    vector<int>& componentRuns = buffers.componentRuns;
+    componentRuns.resize(runs.size());
+    {
+        vector<int>& next = parent; // no longer needed as a forest: reused as the fill position of each component
+        next.assign(componentOffset.begin(), componentOffset.end() - 1);
+        for(int i=0; i<runs.size(); ++i)
+            componentRuns[next[runComponent[i]]++] = i;
+    }
+
+    keypoints.clear();
+    boundingRects.clear();
+    vector<Point>& extremePoints = buffers.extremePoints;
+    for(int c=0; c<nComponents; ++c)
+    {
+        // same bounds as SimpleBlobDetector: minArea included, maxArea excluded
+        if(parameters.filterByArea && (areas[c] < parameters.minArea || areas[c] >= parameters.maxArea))
+            continue;
+
+        // moments relative to the bounding box, as detectComponentRects computes them: the same sums, so the same boxes
+        const Rect& box = boxes[c];
+        PixelMoments moments;
+        extremePoints.clear();
+        for(int r=componentOffset[c]; r<componentOffset[c + 1]; ++r)
+        {
+            const MaskRun& run = runs[componentRuns[r]];
+            moments.addRun(run.start - box.x, run.end - box.x, run.y - box.y);
+            extremePoints.push_back(Point(run.start - box.x, run.y - box.y));
+            extremePoints.push_back(Point(run.end - 1 - box.x, run.y - box.y));
+        }
+        Point2f centroid;
+        boundingRects.push_back(orientedBoxFromMoments(moments, extremePoints, box.tl(), centroid));
+        keypoints.push_back(KeyPoint(centroid, (float)(2 * sqrt(areas[c] / CV_PI))));
+    }
+}
+
+}
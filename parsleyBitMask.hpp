@@ -0,0 +1,115 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyBitMask_hpp
+#define parsleyBitMask_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+
+namespace parsleyLib{
+
+
+/**
+ Binary image with one bit per pixel: 8 times less memory than a CV_8U binary image.
+
+ Each row is a sequence of 64 bit words, pixel x is bit x % 64 (least significant first) of word x / 64. Bits past the last column are 0.
+ */
+class BitMask
+{
+public:
+    /**
+     Allocates the mask, its memory is reused when the size does not grow. The content is undefined.
+     */
+    void create(cv::Size size);
+
+    cv::Size size() const;
+    int wordsPerRow() const;
+    std::uint64_t* row(int y);
+    const std::uint64_t* row(int y) const;
+
+    /** @return true if the pixel (x, y) is white */
+    bool at(int x, int y) const;
+
+    /** @return the bytes taken by the mask bits */
+    std::size_t memoryBytes() const;
+
+    /**
+     Unpacks the mask into a CV_8U binary image (255 white, 0 black), e.g. for debugging output.
+     */
+    void toMat(cv::Mat& binaryImage) const;
+
+private:
+    cv::Size maskSize;
+    int stride = 0; // words per row
+    std::vector<std::uint64_t> words;
+};
+
+
+/**
+ Same as gammaToBinaryImage, writing the bits of a BitMask: the gamma correction and thresholding are folded into a single compare of the original intensities, 16 pixels at a time with SIMD.
+
+ @param image the CV_8U image
+ @param gamma gamma value of the correction
+ @param thresholdingValue pixels whose gamma corrected intensity is above it are white
+ @param mask where to save the mask
+ */
+void gammaToBitMask(const cv::Mat& image, double gamma, double thresholdingValue, BitMask& mask);
+
+
+/**
+ A horizontal run of white pixels of a BitMask: the pixels from start to end - 1 of row y.
+ */
+struct MaskRun
+{
+    int y;
+    int start;
+    int end;
+};
+
+
+/**
+ Appends the runs of white pixels of a mask row, in order: black words are skipped whole, runs are found a word at a time.
+
+ @param mask the mask
+ @param y the row
+ @param runs where to append the runs
+ */
+void appendMaskRowRuns(const BitMask& mask, int y, std::vector<MaskRun>& runs);
+
+
+/**
+ Working buffers of detectBitMaskRects, reused from an image to the next.
+ */
+struct RunLabelingBuffers
+{
+    std::vector<MaskRun> runs;
+    std::vector<int> parent;          // union find forest over the runs
+    std::vector<int> runComponent;
+    std::vector<int> componentOffset; // runs of each component, grouped by a counting sort
+    std::vector<int> componentRuns;
+    std::vector<std::int64_t> areas;
+    std::vector<cv::Rect> boxes;
+    std::vector<cv::Point> extremePoints;
+};
+
+
+/**
+ Connected components of a BitMask, labeled on runs of white pixels without a per pixel label image: the same keypoints and oriented bounding rectangles as detectComponentRects on the unpacked mask, in the same order (raster order of the first pixel of each component).
+
+ Runs are extracted a word at a time, skipping black words, and runs of consecutive rows are joined with a union find when they touch (8-connectivity).
+ Area, bounding box and moments of each component are summed run by run in closed form.
+
+ @param mask the mask to analyze, white pixels are the impurities
+ @param parameters the detection parameters (see instantiateBlobParams), only the area filter is used
+ @param buffers working buffers, reused across calls
+ @param keypoints where to save a keypoint for each kept component
+ @param boundingRects where to save the oriented bounding rectangles of the kept components, in the same order as keypoints
+ */
+void detectBitMaskRects(const BitMask& mask, const cv::SimpleBlobDetector::Params& parameters, RunLabelingBuffers& buffers, std::vector<cv::KeyPoint>& keypoints, std::vector<cv::RotatedRect>& boundingRects);
+
+}
+#endif /* parsleyBitMask_hpp */
@@ -0,0 +1,396 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyCache.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyColor.hpp"
+#include "parsleyMetrics.hpp"
+#include "parsleyResults.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+static const char cacheEntryMagic[8] = {'P', 'R', 'S', 'L', 'C', 'A', 'C', '1'};
+static const char* const cacheEntryExtension = ".prc";
+static const uint64_t noImageOutput = UINT64_MAX; // image size of the entries of images without output by design (clean frames)
+
+static const uint64_t prime1 = 11400714785074694791ULL;
+static const uint64_t prime2 = 14029467366897019727ULL;
+static const uint64_t prime3 = 1609587929392839161ULL;
+static const uint64_t prime4 = 9650029242287828579ULL;
+static const uint64_t prime5 = 2870177450012600261ULL;
+
+static inline uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+// Unaligned little endian reads (x86 and ARM hosts)
+static inline uint64_t read64(const uchar* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+static inline uint32_t read32(const uchar* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+static inline uint64_t hashRound(uint64_t accumulator, uint64_t input)
+{
+    return rotateLeft(accumulator + input * prime2, 31) * prime1;
+}
+
+
+static inline uint64_t mergeRound(uint64_t hash, uint64_t accumulator)
+{
+    return (hash ^ hashRound(0, accumulator)) * prime1 + prime4;
+}
+
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const uchar* p = (const uchar*)data;
+    const uchar* end = p + size;
+    uint64_t hash;
+
+    if(size >= 32)
+    {
+        // four independent lanes over 32 byte stripes
+        uint64_t v1 = seed + prime1 + prime2, v2 = seed + prime2, v3 = seed, v4 = seed - prime1;
+        for( ; p<=end-32; p+=32)
+        {
+            v1 = hashRound(v1, read64(p));
+            v2 = hashRound(v2, read64(p + 8));
+            v3 = hashRound(v3, read64(p + 16));
+            v4 = hashRound(v4, read64(p + 24));
+        }
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    }
+    else
+        hash = seed + prime5;
+    hash += (uint64_t)size;
+
+    for( ; p+8<=end; p+=8)
+        hash = rotateLeft(hash ^ hashRound(0, read64(p)), 27) * prime1 + prime4;
+    if(p+4 <= end)
+    {
+        hash = rotateLeft(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for( ; p<end; ++p)
+        hash = rotateLeft(hash ^ (*p * prime5), 11) * prime1;
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+bool hashFile(const string& path, uint64_t& hash)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    bool hashed = false;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        if(info.st_size == 0)
+        {
+            hash = hashBytes(nullptr, 0);
+            hashed = true;
+        }
+        else
+        {
+            void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED)
+            {
+                madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+                hash = hashBytes(data, (size_t)info.st_size);
+                munmap(data, (size_t)info.st_size);
+                hashed = true;
+            }
+        }
+    }
+    ::close(fd);
+    return hashed;
+}
+
+
+uint64_t detectionParametersHash(const PipelineSettings& settings, double cleanFrameMargin, const ColorClassifier* classifier, int imageCompression)
+{
+    const SimpleBlobDetector::Params blobParams = instantiateBlobParams();
+    const double values[] = {
+        1, // entry format version
+        settings.gamma, settings.minArea, (double)settings.engine,
+        (double)settings.trackThreshold, settings.trackThreshold ? settings.driftBound : 0.0,
+        (double)settings.coarseLevels, settings.cleanFrameMargin, cleanFrameMargin, (double)settings.cleanFrameStride,
+        adaptiveThresholdingSlope, (double)adaptiveThresholdingWindow,
+        blobParams.thresholdStep, blobParams.minThreshold, blobParams.maxThreshold, (double)blobParams.minRepeatability, blobParams.minDistBetweenBlobs,
+        (double)blobParams.filterByColor, (double)blobParams.blobColor,
+        (double)blobParams.filterByArea, blobParams.maxArea,
+        (double)blobParams.filterByCircularity, blobParams.minCircularity, blobParams.maxCircularity,
+        (double)blobParams.filterByInertia, blobParams.minInertiaRatio, blobParams.maxInertiaRatio,
+        (double)blobParams.filterByConvexity, blobParams.minConvexity, blobParams.maxConvexity,
+        (double)imageCompression};
+    return hashBytes(values, sizeof(values), classifier ? classifier->fingerprint() : 0);
+}
+
+
+// Entry file name: the two hashes in hexadecimal
+static string entryName(const ResultCacheKey& key)
+{
+    char name[33];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long)key.content, (unsigned long long)key.parameters);
+    return name;
+}
+
+
+static bool hasEntryExtension(const string& fileName)
+{
+    const size_t extensionLength = strlen(cacheEntryExtension);
+    return fileName.size() > extensionLength && fileName.compare(fileName.size() - extensionLength, extensionLength, cacheEntryExtension) == 0;
+}
+
+
+ResultCache::ResultCache()
+    : maxBytes(0)
+{
+}
+
+
+string ResultCache::entryPath(const string& name) const
+{
+    return directory + "/" + name + cacheEntryExtension;
+}
+
+
+bool ResultCache::open(const string& cacheDirectory, size_t cacheMaxBytes)
+{
+    if(mkdir(cacheDirectory.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+    DIR* listing = opendir(cacheDirectory.c_str());
+    if(!listing)
+        return false;
+
+    // entries of previous runs, oldest use first
+    vector<pair<int64, pair<string, size_t>>> found;
+    while(dirent* file = readdir(listing))
+    {
+        string fileName = file->d_name;
+        struct stat info;
+        if(!hasEntryExtension(fileName) || stat((cacheDirectory + "/" + fileName).c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        int64 lastUse = (int64)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        found.push_back(make_pair(lastUse, make_pair(fileName.substr(0, fileName.size() - strlen(cacheEntryExtension)), (size_t)info.st_size)));
+    }
+    closedir(listing);
+    sort(found.begin(), found.end());
+
+    lock_guard<mutex> lock(cacheMutex);
+    directory = cacheDirectory;
+    maxBytes = cacheMaxBytes;
+    entries.clear();
+    recentNames.clear();
+    counts = ResultCacheStats();
+    for(int i=0; i<found.size(); ++i)
+    {
+        recentNames.push_front(found[i].second.first);
+        Entry& entry = entries[found[i].second.first];
+        entry.bytes = found[i].second.second;
+        entry.recency = recentNames.begin();
+        counts.bytes += entry.bytes;
+    }
+    evict();
+    return true;
+}
+
+
+bool ResultCache::lookup(const ResultCacheKey& key, DetectionResult& result, vector<uchar>* annotatedImage)
+{
+    const string name = entryName(key);
+    bool hit = false;
+    size_t entryBytes = 0;
+
+    // not only the indexed entries: another process sharing the directory may have added it
+    int fd = ::open(entryPath(name).c_str(), O_RDONLY);
+    struct stat info;
+    if(fd >= 0 && fstat(fd, &info) == 0 && info.st_size >= (off_t)(sizeof(cacheEntryMagic) + 8))
+    {
+        entryBytes = (size_t)info.st_size;
+        void* mapped = mmap(nullptr, entryBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped != MAP_FAILED)
+        {
+            const uchar* data = (const uchar*)mapped;
+            ResultRecord record;
+            size_t recordSize = (memcmp(data, cacheEntryMagic, sizeof(cacheEntryMagic)) == 0) ? decodeResultRecord(data + sizeof(cacheEntryMagic), entryBytes - sizeof(cacheEntryMagic), record) : 0;
+            size_t offset = sizeof(cacheEntryMagic) + recordSize;
+            if(recordSize > 0 && entryBytes - offset >= 8)
+            {
+                uint64_t imageBytes = 0;
+                for(int i=0; i<8; ++i)
+                    imageBytes |= (uint64_t)data[offset + i] << (8 * i);
+                offset += 8;
+                if(imageBytes == noImageOutput)
+                {
+                    hit = (entryBytes == offset);
+                    if(hit && annotatedImage)
+                        annotatedImage->clear();
+                }
+                else
+                {
+                    hit = (entryBytes - offset == imageBytes) && (!annotatedImage || imageBytes > 0);
+                    if(hit && annotatedImage)
+                        annotatedImage->assign(data + offset, data + entryBytes);
+                }
+            }
+            if(hit)
+                result = std::move(record.result);
+            munmap(mapped, entryBytes);
+        }
+    }
+    if(fd >= 0)
+        ::close(fd);
+
+    if(hit)
+        utimensat(AT_FDCWD, entryPath(name).c_str(), nullptr, 0); // the recency of the next runs
+    countEvent(hit ? PipelineCounter::CACHE_HITS : PipelineCounter::CACHE_MISSES);
+
+    lock_guard<mutex> lock(cacheMutex);
+    if(hit)
+    {
+        ++counts.hits;
+        touch(name);
+        Entry& entry = entries[name];
+        counts.bytes += entryBytes - entry.bytes;
+        entry.bytes = entryBytes;
+    }
+    else
+    {
+        ++counts.misses;
+        unordered_map<string, Entry>::iterator entry = entries.find(name);
+        if(fd < 0 && entry != entries.end()) // deleted by another process sharing the directory
+        {
+            counts.bytes -= entry->second.bytes;
+            recentNames.erase(entry->second.recency);
+            entries.erase(entry);
+        }
+    }
+    return hit;
+}
+
+
+bool ResultCache::store(const ResultCacheKey& key, const DetectionResult& result, const vector<uchar>* annotatedImage, bool noImage)
+{
+    const string name = entryName(key);
+    thread_local vector<uchar> record;
+    encodeResultRecord(0, result, record);
+    uint64_t imageBytes = (annotatedImage && !noImage) ? annotatedImage->size() : 0;
+    const uint64_t imageSizeField = noImage ? noImageOutput : imageBytes;
+    uchar imageSize[8];
+    for(int i=0; i<8; ++i)
+        imageSize[i] = (uchar)(imageSizeField >> (8 * i));
+
+    // written aside and renamed: a reader never maps a half written entry
+    string temporaryPath = entryPath(name) + ".XXXXXX";
+    int fd = mkstemp(&temporaryPath[0]);
+    if(fd < 0)
+        return false;
+    fchmod(fd, 0644); // mkstemp gives 0600, the directory may be shared
+    FILE* file = fdopen(fd, "wb");
+    if(!file)
+    {
+        ::close(fd);
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+    bool written = fwrite(cacheEntryMagic, 1, sizeof(cacheEntryMagic), file) == sizeof(cacheEntryMagic);
+    written = written && fwrite(record.data(), 1, record.size(), file) == record.size();
+    written = written && fwrite(imageSize, 1, sizeof(imageSize), file) == sizeof(imageSize);
+    written = written && (imageBytes == 0 || fwrite(annotatedImage->data(), 1, imageBytes, file) == imageBytes);
+    written = (fclose(file) == 0) && written;
+    if(!written || rename(temporaryPath.c_str(), entryPath(name).c_str()) != 0)
+    {
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    lock_guard<mutex> lock(cacheMutex);
+    const size_t entryBytes = sizeof(cacheEntryMagic) + record.size() + sizeof(imageSize) + imageBytes;
+    touch(name);
+    Entry& entry = entries[name];
+    counts.bytes += entryBytes - entry.bytes;
+    entry.bytes = entryBytes;
+    ++counts.stores;
+    evict();
+    return true;
+}
+
+
+void ResultCache::touch(const string& name)
+{
+    unordered_map<string, Entry>::iterator entry = entries.find(name);
+    if(entry == entries.end())
+    {
+        recentNames.push_front(name);
+        entries[name].recency = recentNames.begin();
+    }
+    else
+        recentNames.splice(recentNames.begin(), recentNames, entry->second.recency);
+}
+
+
+void ResultCache::evict()
+{
+    // the most recently used entry is always kept, even if alone over the budget
+    while(counts.bytes > maxBytes && recentNames.size() > 1)
+    {
+        const string& name = recentNames.back();
+        unlink(entryPath(name).c_str());
+        counts.bytes -= entries[name].bytes;
+        entries.erase(name);
+        recentNames.pop_back();
+        ++counts.evictions;
+    }
+}
+
+
+ResultCacheStats ResultCache::stats() const
+{
+    lock_guard<mutex> lock(cacheMutex);
+    ResultCacheStats current = counts;
+    current.entries = entries.size();
+    return current;
+}
+
+}
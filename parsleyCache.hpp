@@ -0,0 +1,144 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyCache_hpp
+#define parsleyCache_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "parsleyPipeline.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ 64 bit hash of a block of bytes (XXH64), several GB per second: fast enough to hash whole image files.
+
+ @param data the bytes to hash
+ @param size number of bytes
+ @param seed a different seed gives an unrelated hash
+ @return the hash
+ */
+std::uint64_t hashBytes(const void* data, std::size_t size, std::uint64_t seed = 0);
+
+
+/**
+ Hashes the bytes of a file, mapping it in memory.
+
+ @param path the file to hash
+ @param hash where to save the hash
+ @return false if the file can not be read
+ */
+bool hashFile(const std::string& path, std::uint64_t& hash);
+
+
+/**
+ Hash of everything that changes the detections of an image: pipeline settings, instantiateBlobParams values, the getAdaptiveThreshValue constants, the clean frame margin and the color lookup table. The compression of the cached annotated image is part of it as well.
+
+ @param settings the settings of the pipeline processing the image
+ @param cleanFrameMargin see processImage
+ @param classifier the color lookup table, null if not used
+ @param imageCompression TIFF compression of the annotated image kept with the detections (the libtiff value), 0 if none is kept or it has the OpenCV default one
+ @return the hash
+ */
+std::uint64_t detectionParametersHash(const PipelineSettings& settings, double cleanFrameMargin = 0, const ColorClassifier* classifier = nullptr, int imageCompression = 0);
+
+
+/**
+ Key of a ResultCache entry: the image file contents and the detection parameters.
+ */
+struct ResultCacheKey
+{
+    std::uint64_t content = 0;
+    std::uint64_t parameters = 0;
+};
+
+
+/**
+ Hit and miss counts of a ResultCache.
+ */
+struct ResultCacheStats
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t stores = 0;
+    std::size_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;  // size of all the entries
+};
+
+
+/**
+ On disk cache of detection results, content addressed: an image processed again with the same parameters (a rerun of an archive, or of a batch stopped by a crash) is answered without decoding it.
+
+ Each entry is a file named after its key, holding the detections as a BinaryResultSink record and optionally the encoded annotated image. Lookups map the entry in memory.
+ Entries are written to a temporary file and renamed, so that several processes (e.g. shard workers) can share the directory.
+ When the entries exceed the size budget the least recently used are deleted; the recency survives between runs as the modification time of the files.
+ Thread safe.
+ */
+class ResultCache
+{
+public:
+    ResultCache();
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    /**
+     Opens the cache directory, creating it if missing, and indexes its entries from the least to the most recently used.
+
+     @param directory where the entries are kept
+     @param maxBytes size budget of the entries
+     @return false if the directory can not be created or read
+     */
+    bool open(const std::string& directory, std::size_t maxBytes = (std::size_t)1 << 30);
+
+    /**
+     Looks up an entry, counting a hit or a miss, and marks it as the most recently used.
+
+     @param key the entry key
+     @param result where to save the cached detections
+     @param annotatedImage if not null the entry is a hit only if it holds an annotated image, saved here, or if the image has none by design (see store), left empty
+     @return true on a hit
+     */
+    bool lookup(const ResultCacheKey& key, DetectionResult& result, std::vector<uchar>* annotatedImage = nullptr);
+
+    /**
+     Adds or replaces an entry, then deletes the least recently used entries over the size budget.
+
+     @param key the entry key
+     @param result the detections
+     @param annotatedImage if not null the encoded annotated image to keep with them
+     @param noImage the image has no annotated output by design (a clean frame): the entry is a hit at every output level
+     @return false if the entry can not be written
+     */
+    bool store(const ResultCacheKey& key, const DetectionResult& result, const std::vector<uchar>* annotatedImage = nullptr, bool noImage = false);
+
+    ResultCacheStats stats() const;
+
+private:
+    struct Entry
+    {
+        std::size_t bytes = 0;
+        std::list<std::string>::iterator recency; // position in recentNames
+    };
+
+    std::string entryPath(const std::string& name) const;
+    void touch(const std::string& name);
+    void evict();
+
+    std::string directory;
+    std::size_t maxBytes;
+    mutable std::mutex cacheMutex;
+    std::unordered_map<std::string, Entry> entries; // guarded by cacheMutex
+    std::list<std::string> recentNames;              // most recently used first, guarded by cacheMutex
+    ResultCacheStats counts;                         // guarded by cacheMutex
+};
+
+}
+#endif /* parsleyCache_hpp */
@@ -0,0 +1,238 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "parsleyColor.hpp"
+#include "parsleyCache.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+ColorClassifier::ColorClassifier(int bitsPerChannel)
+    : bits(min(max(bitsPerChannel, 1), 5)) // 3*5 bits: the table index fits an unsigned short
+{
+}
+
+
+// Table cell of a BGR pixel, blue in the most significant bits
+static inline int cellIndex(const uchar* pixel, int bits)
+{
+    const int shift = 8 - bits;
+    return ((pixel[0] >> shift) << (2 * bits)) | ((pixel[1] >> shift) << bits) | (pixel[2] >> shift);
+}
+
+
+void ColorClassifier::addSamples(const Mat& colorImage, const Mat& labels)
+{
+    CV_Assert(colorImage.type() == CV_8UC3 && labels.type() == CV_8UC1 && colorImage.size() == labels.size());
+    const size_t nCells = (size_t)1 << (3 * bits);
+    impurityCounts.resize(nCells, 0);
+    backgroundCounts.resize(nCells, 0);
+
+    for(int r=0; r<colorImage.rows; ++r)
+    {
+        const uchar* pixel = colorImage.ptr<uchar>(r);
+        const uchar* label = labels.ptr<uchar>(r);
+        for(int c=0; c<colorImage.cols; ++c, pixel+=3)
+        {
+            if(label[c] == 255)
+                ++impurityCounts[cellIndex(pixel, bits)];
+            else if(label[c] == 0)
+                ++backgroundCounts[cellIndex(pixel, bits)];
+        }
+    }
+}
+
+
+bool ColorClassifier::train(double impurityWeight)
+{
+    if(impurityCounts.empty())
+        return false;
+
+    const int side = 1 << bits;
+    table.assign(impurityCounts.size(), 0);
+    for(int b=0; b<side; ++b)
+        for(int g=0; g<side; ++g)
+            for(int r=0; r<side; ++r)
+            {
+                int cell = (b * side + g) * side + r;
+                double impurity = impurityWeight * impurityCounts[cell];
+                double background = backgroundCounts[cell];
+
+                // a color never seen in training: the samples of all its 26 neighbouring cells vote
+                if(impurity + background == 0)
+                {
+                    for(int db=-1; db<=1; ++db)
+                        for(int dg=-1; dg<=1; ++dg)
+                            for(int dr=-1; dr<=1; ++dr)
+                            {
+                                int nb = b + db, ng = g + dg, nr = r + dr;
+                                if(nb < 0 || ng < 0 || nr < 0 || nb >= side || ng >= side || nr >= side)
+                                    continue;
+                                int neighbour = (nb * side + ng) * side + nr;
+                                impurity += impurityWeight * impurityCounts[neighbour];
+                                background += backgroundCounts[neighbour];
+                            }
+                }
+                table[cell] = (impurity > background) ? 255 : 0;
+            }
+    return true;
+}
+
+
+// Classifies a row: the cell indices of 16 pixels at a time with SIMD, then the table lookups
+static void classifyRow(const uchar* src, uchar* dst, int cols, int bits, const uchar* table, ushort* indices)
+{
+    int c = 0;
+#if CV_SIMD128
+    const int shift = 8 - bits;
+    for( ; c<=cols-16; c+=16)
+    {
+        v_uint8x16 b, g, r;
+        v_load_deinterleave(src + 3 * c, b, g, r);
+        v_uint16x8 b0, b1, g0, g1, r0, r1;
+        v_expand(b, b0, b1);
+        v_expand(g, g0, g1);
+        v_expand(r, r0, r1);
+        v_store(indices + c, ((b0 >> shift) << (2 * bits)) | ((g0 >> shift) << bits) | (r0 >> shift));
+        v_store(indices + c + 8, ((b1 >> shift) << (2 * bits)) | ((g1 >> shift) << bits) | (r1 >> shift));
+    }
+#endif
+    for( ; c<cols; ++c)
+        indices[c] = (ushort)cellIndex(src + 3 * c, bits);
+    for(c=0; c<cols; ++c)
+        dst[c] = table[indices[c]];
+}
+
+
+void ColorClassifier::classify(const Mat& colorImage, Mat& binaryImage) const
+{
+    CV_Assert(colorImage.type() == CV_8UC3 && !table.empty());
+    binaryImage.create(colorImage.size(), CV_8U);
+
+    const int nStripes = max(1, min(colorImage.rows, getNumThreads() * 4));
+    parallel_for_(Range(0, nStripes), [&](const Range& range)
+    {
+        AutoBuffer<ushort> indices(colorImage.cols); // cell indices of a row, once per stripe range
+        for(int s=range.start; s<range.end; ++s)
+        {
+            int rowEnd = (int)((int64)colorImage.rows * (s + 1) / nStripes);
+            for(int r=(int)((int64)colorImage.rows * s / nStripes); r<rowEnd; ++r)
+                classifyRow(colorImage.ptr<uchar>(r), binaryImage.ptr<uchar>(r), colorImage.cols, bits, table.data(), indices.data());
+        }
+    }, nStripes);
+}
+
+
+bool ColorClassifier::save(const string& path) const
+{
+    if(table.empty())
+        return false;
+    FileStorage fs(path, FileStorage::WRITE);
+    if(!fs.isOpened())
+        return false;
+    fs << "bitsPerChannel" << bits;
+    fs << "table" << Mat(1, (int)table.size(), CV_8U, (void*)table.data());
+    return true;
+}
+
+
+bool ColorClassifier::load(const string& path)
+{
+    FileStorage fs(path, FileStorage::READ);
+    if(!fs.isOpened())
+        return false;
+    int storedBits = 0;
+    Mat storedTable;
+    fs["bitsPerChannel"] >> storedBits;
+    fs["table"] >> storedTable;
+    if(storedBits < 1 || storedBits > 5 || storedTable.type() != CV_8U || storedTable.total() != ((size_t)1 << (3 * storedBits)))
+        return false;
+
+    bits = storedBits;
+    table.assign(storedTable.ptr<uchar>(), storedTable.ptr<uchar>() + storedTable.total());
+    impurityCounts.clear();
+    backgroundCounts.clear();
+    return true;
+}
+
+
+bool ColorClassifier::empty() const
+{
+    return table.empty();
+}
+
+
+int ColorClassifier::bitsPerChannel() const
+{
+    return bits;
+}
+
+
+uint64_t ColorClassifier::fingerprint() const
+{
+    return hashBytes(table.data(), table.size(), (uint64_t)bits);
+}
+
+
+double ColorClassifier::impurityFraction() const
+{
+    size_t impurityCells = 0;
+    for(int i=0; i<table.size(); ++i)
+        impurityCells += table[i] ? 1 : 0;
+    return table.empty() ? 0.0 : (double)impurityCells / table.size();
+}
+
+
+bool trainColorClassifier(const string& manifestPath, const string& tablePath, int bitsPerChannel, double impurityWeight)
+{
+    ifstream manifest(manifestPath);
+    if(!manifest.is_open())
+    {
+        cerr << "Unable to open training manifest: " << manifestPath << endl;
+        return false;
+    }
+
+    ColorClassifier classifier(bitsPerChannel);
+    size_t images = 0;
+    string line;
+    while(getline(manifest, line))
+    {
+        if(line.find_first_not_of(" \t\r") == string::npos || line[0] == '#')
+            continue;
+        string imagePath, labelsPath;
+        istringstream fields(line);
+        fields >> imagePath >> labelsPath;
+        Mat colorImage = imread(imagePath, IMREAD_COLOR);
+        Mat labels = imread(labelsPath, IMREAD_GRAYSCALE);
+        if(colorImage.empty() || labels.empty() || colorImage.size() != labels.size())
+        {
+            cerr << "Unable to read the sample: " << imagePath << " " << labelsPath << endl;
+            return false;
+        }
+        classifier.addSamples(colorImage, labels);
+        ++images;
+    }
+
+    if(!classifier.train(impurityWeight))
+    {
+        cerr << "No samples in: " << manifestPath << endl;
+        return false;
+    }
+    if(!classifier.save(tablePath))
+    {
+        cerr << "Unable to write: " << tablePath << endl;
+        return false;
+    }
+    cout << images << " sample images, " << classifier.bitsPerChannel() << " bits per channel, " << classifier.impurityFraction() * 100 << "% of the colors classified as impurity" << endl;
+    return true;
+}
+
+}
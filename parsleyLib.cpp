@@ -5,114 +5,259 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 
 #include "parsleyLib.hpp"
+#include "parsleyMetrics.hpp"
+#include "parsleyPipeline.hpp"
+#include "parsleyResults.hpp"
+#include "parsleyCache.hpp"
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <climits>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace cv;
 
 namespace parsleyLib {
 
-void processImage(string inputImgPath, string outputImgPath)
+// Settings of processImage, for the given engine
+static PipelineSettings processImageSettings(DetectorEngine engine)
+{
+    PipelineSettings settings; // gamma 1.5 is sperimentally choosen, minArea 1500 is the default value
+    settings.engine = engine;
+    return settings;
+}
+
+
+// One pipeline per thread and engine: consecutive images (e.g. the ones of a batch worker) reuse its detector and buffers
+static Pipeline& threadPipeline(DetectorEngine engine)
+{
+    // each built on its first use only
+    switch(engine)
+    {
+        case DetectorEngine::CONNECTED_COMPONENTS:
+        {
+            thread_local Pipeline componentsPipeline(processImageSettings(DetectorEngine::CONNECTED_COMPONENTS));
+            return componentsPipeline;
+        }
+        case DetectorEngine::BIT_MASK:
+        {
+            thread_local Pipeline bitMaskPipeline(processImageSettings(DetectorEngine::BIT_MASK));
+            return bitMaskPipeline;
+        }
+        default:
+        {
+            thread_local Pipeline blobPipeline(processImageSettings(DetectorEngine::SIMPLE_BLOB));
+            return blobPipeline;
+        }
+    }
+}
+
+
+size_t processImage(string inputImgPath, string outputImgPath, string outputFileName, bool verbose, OutputLevel outputLevel, AsyncImageWriter* writer, DetectorEngine engine, ResultSink* sink, uint64_t frameId, const ColorClassifier* classifier, double cleanFrameMargin, ResultCache* cache)
 {
     // Starts calculating time to have an idea of processing time
     double ticks = (double) getTickCount();
+    StageClock stageClock; // latency of each stage, for the metrics
+    
+    // intermediate images (histograms, gamma and binary images) are rendered only for the debug stack
+    const bool fullDebug = (outputLevel == OutputLevel::FULL_DEBUG);
     
     // a vector where to save all processed images
     vector<Mat> processedImages;
+    
+    // Result cache: the same file bytes with the same parameters give the same detections, a hit is answered without decoding the image
+    // the debug stack needs every intermediate image: at that level the cache is only filled
+    Pipeline& pipeline = threadPipeline(engine);
+    thread_local DetectionResult result;
+    thread_local vector<uchar> annotatedBytes; // encoded annotated image, for the cache
+    const bool cacheAnnotated = (outputLevel == OutputLevel::ANNOTATED);
+    ResultCacheKey cacheKey;
+    const bool cacheable = cache && hashFile(inputImgPath, cacheKey.content);
+    if(cacheable)
+    {
+        // the annotated image is cached as written: with the writer compression, or the imwrite default one
+        cacheKey.parameters = detectionParametersHash(pipeline.settings(), cleanFrameMargin, classifier, (cacheAnnotated && writer) ? (int)writer->compression() : 0);
+        if(!fullDebug && cache->lookup(cacheKey, result, cacheAnnotated ? &annotatedBytes : nullptr))
+        {
+            stageClock.lap(PipelineStage::DECODE);
+            string outputPath = outputImgPath + "/" + outputFileName;
+            if(cacheAnnotated && !annotatedBytes.empty()) // empty for the images without output, i.e. clean frames
+            {
+                if(writer)
+                    writer->writeEncoded(outputPath, annotatedBytes);
+                else if(!writeFileBytes(outputPath, annotatedBytes))
+                    countEvent(PipelineCounter::WRITE_FAILURES);
+            }
+            if(sink)
+                sink->write(frameId, inputImgPath, result);
+            if(verbose)
+                cout << "Number of detected objects for: "  << inputImgPath << ": " << result.centers.size() << " (cached)" << endl;
+            countEvent(PipelineCounter::IMAGES_PROCESSED);
+            return result.centers.size();
+        }
+    }
+    
     // Reads the image and saves it into img, an istance of OpenCV::Mat class
-    Mat img = imread(inputImgPath, IMREAD_GRAYSCALE);
+    // the file is decoded once: the color image (to draw bounding boxes on the original image) is kept only if annotated output or the color classifier needs it
+    Mat img, colorImg;
+    if(!parsleyLib::decodeInputImage(inputImgPath, outputLevel != OutputLevel::RESULTS_ONLY || classifier, img, colorImg))
+        CV_Error(Error::StsError, "Unable to read: " + inputImgPath);
+    stageClock.lap(PipelineStage::DECODE);
+    
+    // Clean frame fast path: a sampled histogram with no room for an impurity, nothing else runs
+    double sampledValue = -1;
+    if(!classifier && cleanFrameMargin > 0 && isCleanFrame(img, pipeline.settings().gamma, pipeline.settings().minArea, cleanFrameMargin, pipeline.settings().cleanFrameStride, &sampledValue))
+    {
+        stageClock.lap(PipelineStage::THRESHOLD);
+        result.clear();
+        result.thresholdingValue = sampledValue;
+        if(cacheable)
+            cache->store(cacheKey, result, nullptr, true); // a hit at every output level: there is nothing to save
+        if(sink)
+            sink->write(frameId, inputImgPath, result);
+        if(verbose)
+            cout << "Number of detected objects for: "  << inputImgPath << ": 0 (clean frame, nothing saved)" << endl;
+        countEvent(PipelineCounter::IMAGES_PROCESSED);
+        return 0;
+    }
     
     // Creates a named window in which to display the loaded image to be further processed
     //namedWindow("Displaying original image: ", WINDOW_AUTOSIZE);
     //imshow("Displaying original image: ", img);
     
     // adds original image to processed images
-    processedImages.push_back(img);
-    
-    
-    // Computes the image histogram and displays it in a new window
-    Mat imgHistogram;
-    parsleyLib::calculateCV_8UHistogram(img, imgHistogram);
-    //imshow("Original image histogram: ", imgHistogram);
-    processedImages.push_back(imgHistogram);
-    
+    if(fullDebug)
+        processedImages.push_back(classifier ? colorImg.clone() : img); // the color image is drawn on below
     
-    // Applies gamma correction to the image
-    double gamma = 1.5; // needs to be a double, a value between 1.0 and 3.0 is recommended. 1.5 is sperimentally choosen
-    Mat gammaImage = img.clone();
-    parsleyLib::applyGammaCorrection(gammaImage, gamma);
-    //imshow("Image after Gamma Correction: ", img);
     
-    // Computes new histogram after gamma correction
-    Mat gammaImgHist; // image where to display gamma image histogram
-    parsleyLib::calculateCV_8UHistogram(gammaImage, gammaImgHist);
-    //imshow("New Histogram on Gamma Corrected img: ", gammaImgHist);
-        
-    // adds them to processed images
-    processedImages.push_back(gammaImage);
-    
-    // Applies thresholding to get a Binary Image
-    double thresholdingValue = parsleyLib::getAdaptiveThreshValue(gammaImage);
-    // draws a thresholding vertical line on gammaImgHist at the calculated thresholdingValue by parsleyLib::getAdaptiveThreshValue // for debugging purposes
-    int col = static_cast<int>(thresholdingValue*gammaImgHist.cols/256); // scales the thresholding value to the window size
-    line(gammaImgHist, Point(col, 0), Point(col, gammaImgHist.rows-1), Scalar(0), 2, LINE_8, 0); // is not possible to draw a colored line on a CV_8U image
-    //imshow("Thresholding value line on gamma img hist: ", gammaImgHist);
-    processedImages.push_back(gammaImgHist);
-    
-    Mat binaryImage = gammaImage.clone();
-    parsleyLib::toBinaryImage(binaryImage, thresholdingValue);
-    //imshow("Binary Image: ", img);
-    // adds binary image to processed images
-    processedImages.push_back(binaryImage);
-    
-
-    // Blob detector and rotated bounding boxes steps:
-    
-    // The following code is needed in order to create an istance of a SimpleBlobDetector
-    SimpleBlobDetector::Params parameters = parsleyLib::instantiateBlobParams(); // only one instance is needed
-    float minArea = 1500; // default value
-    Ptr<SimpleBlobDetector> blobDetector;
-    
-    Mat imgWithKeypoints; // no needs for inizialization
-    //Mat imgWithBoundingBoxes = Mat(img.size(), CV_8UC3, Scalar::all(255)); // to draw bounding boxes on a white image
-    Mat imgWithBoundingBoxes;
-    vector<KeyPoint> keypoints;
+    // Gamma correction (with the histograms before and after it), adaptive thresholding, binarization and detection, see Pipeline::process
+    // or, with a color classifier, lookup of each color pixel and detection, see Pipeline::processColor
+    Mat gammaImage;
+    if(classifier)
+        pipeline.processColor(colorImg, *classifier, result);
+    else
+        pipeline.process(img, result, fullDebug ? &gammaImage : nullptr);
+    stageClock.skip(); // the pipeline measures its own stages
+    double thresholdingValue = result.thresholdingValue;
     
-    blobDetector = parsleyLib::getBlobDetectorInstance(&parameters, minArea); // it is possible to change minArea filtering parameter at run time simply by calling getBlobDetectorInstance
-    imgWithBoundingBoxes = imread(inputImgPath, IMREAD_COLOR); // to draw bounding boxes on the original image (to use different colors it needs to be read in IMREAD_COLOR MODE)
-    //imgWithBoundingBoxes = binaryImage; // for drawing boxes on binary image
-    //cvtColor(binaryImage, imgWithBoundingBoxes, COLOR_GRAY2BGR);
+    if(fullDebug && !classifier)
+    {
+        // Displays the image histogram in a new window
+        Mat imgHistogram;
+        parsleyLib::drawCV_8UHistogram(pipeline.imageHistogram(), imgHistogram);
+        //imshow("Original image histogram: ", imgHistogram);
+        processedImages.push_back(imgHistogram);
         
-    keypoints = parsleyLib::boundingBlobDetect(blobDetector, binaryImage, imgWithKeypoints, imgWithBoundingBoxes);
+        // Displays new histogram after gamma correction
+        Mat gammaImgHist; // image where to display gamma image histogram
+        parsleyLib::drawCV_8UHistogram(pipeline.gammaHistogram(), gammaImgHist);
+        //imshow("New Histogram on Gamma Corrected img: ", gammaImgHist);
         
-    cout << "Number of detected objects for: "  << inputImgPath << ": " << keypoints.size() << endl;
+        // adds them to processed images
+        processedImages.push_back(gammaImage);
         
-    //imshow("Img with blob detected keypoints: ", imgWithKeypoints);
-    //imshow("Img showing drawn bounding boxes: ", imgWithBoundingBoxes);
+        // draws a thresholding vertical line on gammaImgHist at the calculated thresholdingValue by parsleyLib::getAdaptiveThreshValue // for debugging purposes
+        int col = static_cast<int>(thresholdingValue*gammaImgHist.cols/256); // scales the thresholding value to the window size
+        line(gammaImgHist, Point(col, 0), Point(col, gammaImgHist.rows-1), Scalar(0), 2, LINE_8, 0); // is not possible to draw a colored line on a CV_8U image
+        //imshow("Thresholding value line on gamma img hist: ", gammaImgHist);
+        processedImages.push_back(gammaImgHist);
+    }
+    
+    if(fullDebug)
+    {
+        // adds binary image to processed images, a copy: the pipeline reuses its buffer at the next image while the writer may still be encoding this one
+        if(pipeline.binaryImage().empty()) // bit mask engine
+        {
+            Mat unpackedMask;
+            pipeline.bitMask().toMat(unpackedMask);
+            processedImages.push_back(unpackedMask);
+        }
+        else
+            processedImages.push_back(pipeline.binaryImage().clone());
+        stageClock.skip(); // debug images are not part of any stage
+    }
         
-    // added to processed images
-    processedImages.push_back(imgWithBoundingBoxes);
+    if(sink)
+        sink->write(frameId, inputImgPath, result);
+    if(verbose)
+        cout << "Number of detected objects for: "  << inputImgPath << ": " << result.centers.size() << endl;
     
-    // list of coordinates of all blob detected keypoints
-    vector<Point2f> points2f;
-    KeyPoint::convert(keypoints, points2f);
-    cout << "The detected objects have centers at the following coordinates (pixelCol, pixelRow): " << endl;
-    for(int i=0; i<points2f.size();++i)
+    bool storeEntry = cacheable; // false if the writer thread adds the cache entry, or the output could not be written
+    if(outputLevel != OutputLevel::RESULTS_ONLY)
     {
-        cout << "Object " << i << " : (" << (int)points2f[i].x << ", " << (int)points2f[i].y << ")" << endl; // float type values where (x,y) x is number of column, y number of row, from top left corner
+        //Mat imgWithBoundingBoxes = Mat(img.size(), CV_8UC3, Scalar::all(255)); // to draw bounding boxes on a white image
+        Mat imgWithBoundingBoxes = colorImg; // to draw bounding boxes on the original image (to use different colors it needs to be decoded in IMREAD_COLOR MODE)
+        //cvtColor(binaryImage, imgWithBoundingBoxes, COLOR_GRAY2BGR); // for drawing boxes on binary image
+        parsleyLib::drawRotatedBoundingBoxes(imgWithBoundingBoxes, result.boxes);
+        //imshow("Img showing drawn bounding boxes: ", imgWithBoundingBoxes);
+        countEvent(PipelineCounter::RECTANGLES_DRAWN, result.boxes.size());
+        stageClock.lap(PipelineStage::DRAW);
+        
+        // added to processed images
+        processedImages.push_back(imgWithBoundingBoxes);
+        
+        // encoding is left to the writer thread when there is one (which then measures the write stage)
+        string outputPath = outputImgPath + "/" + outputFileName;
+        if(cacheable && cacheAnnotated && writer)
+        {
+            // encoded by the writer thread, once for both the output file and the cache entry, stored only once written
+            writer->write(outputPath, imgWithBoundingBoxes, [cache, cacheKey, cachedResult = result](const vector<uchar>& encoded) { cache->store(cacheKey, cachedResult, &encoded); });
+            storeEntry = false;
+        }
+        else if(cacheable && cacheAnnotated)
+        {
+            // encoded here, once for both the output file and the cache entry
+            if(!imencode(".tiff", imgWithBoundingBoxes, annotatedBytes) || !writeFileBytes(outputPath, annotatedBytes))
+            {
+                storeEntry = false;
+                countEvent(PipelineCounter::WRITE_FAILURES);
+            }
+            stageClock.lap(PipelineStage::WRITE);
+        }
+        else if(writer)
+            writer->write(outputPath, processedImages);
+        else
+        {
+            if(!imwrite(outputPath, processedImages))
+            {
+                storeEntry = false;
+                countEvent(PipelineCounter::WRITE_FAILURES);
+            }
+            stageClock.lap(PipelineStage::WRITE);
+        }
     }
+    countEvent(PipelineCounter::IMAGES_PROCESSED);
+    if(storeEntry)
+        cache->store(cacheKey, result, cacheAnnotated ? &annotatedBytes : nullptr);
     
-    string outputPath = outputImgPath + "/processedImages.tiff";
-    imwrite(outputPath, processedImages);
+    // list of coordinates of all detected objects
+    if(verbose)
+    {
+        cout << "The detected objects have centers at the following coordinates (pixelCol, pixelRow): " << endl;
+        for(int i=0; i<result.centers.size();++i)
+        {
+            cout << "Object " << i << " : (" << (int)result.centers[i].x << ", " << (int)result.centers[i].y << ")" << '\n'; // no flush per object, endl below flushes; float type values where (x,y) x is number of column, y number of row, from top left corner
+        }
+    }
     
     
     // Stops the chrono and shows the elapsed time to process the image
     double elapsedTime = ((double)getTickCount() - ticks) / getTickFrequency();
-    cout << "Single image execution time: " << elapsedTime << " seconds" << endl;
-    
+    if(verbose)
+        cout << "Single image execution time: " << elapsedTime << " seconds" << endl;
     
+    return result.centers.size();
 }
 
 
@@ -130,6 +275,18 @@ void calculateCV_8UHistogram(const Mat& image, Mat& imageToDisplayWhere)
     Mat imgDataHist;
     calcHist(&image, 1, 0, Mat(), imgDataHist, 1, &histSize, &histRange, uniform, accumulate);
     
+    vector<float> histogram(imgDataHist.begin<float>(), imgDataHist.end<float>()); // calcHist fills a 256x1 Mat of float elements
+    drawCV_8UHistogram(histogram, imageToDisplayWhere);
+}
+
+
+void drawCV_8UHistogram(const vector<float>& histogram, Mat& imageToDisplayWhere)
+{
+    const int histSize = 256;
+    
+    Mat imgDataHist;
+    Mat(histogram).copyTo(imgDataHist); // 256x1 float Mat, copied as it will be normalized below
+    
     // creates new Mat type image in which to display the hist given the calculated imgDataHist
     int histHeight = 3024;
     int histWidth = 3024;
@@ -152,20 +309,297 @@ void calculateCV_8UHistogram(const Mat& image, Mat& imageToDisplayWhere)
 }
 
 
-void applyGammaCorrection(Mat& image, double gamma)
+// Fills the 256 entries gamma correction lookup table
+static void buildGammaLookUpTable(double gamma, uchar* p)
 {
-    // 1x256 image used as lookUpTable vector, static so it fill be inizialez only once ?!
-    static Mat lookUpTable(1, 256, CV_8U);
-    uchar* p = lookUpTable.ptr();
-    
     for(int i=0; i<256; ++i)
     {
         p[i] = saturate_cast<uchar>(pow(i/255.0, gamma) * 255.0); // saturate_cast ensures that the calculated value is in the 0-255 char range
     }
+}
+
+
+// Compile time versions of log and exp (std::pow is not constexpr), accurate to a few ulps on the values used by the gamma tables
+static constexpr double ln2 = 0.69314718055994530942;
+
+static constexpr double constexprLog(double x)
+{
+    // x = m * 2^exponent with m in [0.5, 1[, then ln(m) = 2*atanh((m-1)/(m+1)) whose series converges fast as |(m-1)/(m+1)| <= 1/3
+    int exponent = 0;
+    while(x < 0.5) { x *= 2.0; --exponent; }
+    while(x >= 1.0) { x *= 0.5; ++exponent; }
+    double z = (x - 1.0) / (x + 1.0);
+    double term = z;
+    double sum = 0.0;
+    for(int n=0; n<20; ++n)
+    {
+        sum += term / (2*n + 1);
+        term *= z * z;
+    }
+    return 2.0 * sum + exponent * ln2;
+}
+
+static constexpr double constexprExp(double y)
+{
+    // y = k*ln2 + r with |r| <= ln2/2, then e^y = 2^k * e^r with e^r from its Taylor series
+    int k = 0;
+    while(y < -0.5 * ln2) { y += ln2; --k; }
+    while(y > 0.5 * ln2) { y -= ln2; ++k; }
+    double term = 1.0;
+    double sum = 1.0;
+    for(int n=1; n<20; ++n)
+    {
+        term *= y / n;
+        sum += term;
+    }
+    for( ; k<0; ++k) sum *= 0.5;
+    for( ; k>0; --k) sum *= 2.0;
+    return sum;
+}
+
+// Same value as buildGammaLookUpTable for gamma > 0 (none of the standard table values lies close to a rounding tie)
+static constexpr uchar constexprGammaValue(int i, double gamma)
+{
+    if(i == 0)
+        return 0;
+    double value = constexprExp(gamma * constexprLog(i / 255.0)) * 255.0;
+    return value >= 255.0 ? 255 : (uchar)(int)(value + 0.5);
+}
+
+struct GammaTable
+{
+    uchar values[256];
+    constexpr explicit GammaTable(double gamma) : values{}
+    {
+        for(int i=0; i<256; ++i)
+            values[i] = constexprGammaValue(i, gamma);
+    }
+};
+
+// one constant expression per table, keeping each evaluation well below the compilers constexpr step limits
+template<int gammaTenths>
+constexpr GammaTable standardGammaTable = GammaTable(gammaTenths / 10.0);
+
+// standard settings: gamma from 1.0 to 3.0 in 0.1 steps
+static constexpr int firstStandardGammaTenths = 10;
+static constexpr int nStandardGammaTables = 21;
+
+struct StandardGammaTables
+{
+    const uchar* tables[nStandardGammaTables];
+};
+
+template<int... offsets>
+static constexpr StandardGammaTables makeStandardGammaTables(integer_sequence<int, offsets...>)
+{
+    return StandardGammaTables{ { standardGammaTable<firstStandardGammaTenths + offsets>.values... } };
+}
+
+static constexpr StandardGammaTables standardGammaTables = makeStandardGammaTables(make_integer_sequence<int, nStandardGammaTables>());
+
+
+const uchar* getGammaLookUpTable(double gamma)
+{
+    // standard settings: the table was generated at compile time, no lock and no computation
+    int index = cvRound(gamma * 10.0) - firstStandardGammaTenths;
+    if(index >= 0 && index < nStandardGammaTables && gamma == (index + firstStandardGammaTenths) / 10.0)
+        return standardGammaTables.tables[index];
+    
+    // any other gamma: computed on first use and kept for the whole program life (std::map nodes never move, so the pointer stays valid)
+    static mutex cacheMutex;
+    static map<double, array<uchar, 256>> cache;
+    lock_guard<mutex> lock(cacheMutex);
+    map<double, array<uchar, 256>>::iterator it = cache.find(gamma);
+    if(it == cache.end())
+    {
+        it = cache.insert(make_pair(gamma, array<uchar, 256>())).first;
+        buildGammaLookUpTable(gamma, it->second.data());
+    }
+    return it->second.data();
+}
+
+
+bool checkGammaLookUpTables()
+{
+    bool match = true;
+    uchar expected[256];
+    for(int t=0; t<nStandardGammaTables; ++t)
+    {
+        double gamma = (t + firstStandardGammaTenths) / 10.0;
+        buildGammaLookUpTable(gamma, expected);
+        for(int i=0; i<256; ++i)
+            if(standardGammaTables.tables[t][i] != expected[i])
+            {
+                match = false;
+                cerr << "Gamma " << gamma << " table differs from pow() at " << i << ": " << (int)standardGammaTables.tables[t][i] << " instead of " << (int)expected[i] << endl;
+            }
+    }
+    return match;
+}
+
+
+void applyGammaCorrection(Mat& image, double gamma)
+{
+    // 1x256 image header around the cached table, shared read only by concurrent calls
+    Mat lookUpTable(1, 256, CV_8U, (void*)getGammaLookUpTable(gamma));
     
     LUT(image, lookUpTable, image);
 }
 
+
+// Number of row stripes the fused kernels split an image in: a few per OpenCV thread to balance the load
+static int fusedKernelStripes(const Mat& image)
+{
+    return max(1, min(image.rows, getNumThreads() * 4));
+}
+
+
+// Counts the pixels of rows [rowStart, rowEnd[ into histogram, writing their gamma values to gammaImage if writeGamma
+template<bool writeGamma>
+static void gammaHistogramRows(const Mat& image, const uchar* lookUpTable, Mat* gammaImage, int rowStart, int rowEnd, int* histogram)
+{
+    // four sub-histograms: runs of equal pixels (the background) would otherwise increment the same counter back to back
+    int subHistograms[4][256] = {};
+    const int cols = image.cols;
+    
+    for(int r=rowStart; r<rowEnd; ++r)
+    {
+        const uchar* src = image.ptr<uchar>(r);
+        uchar* dst = writeGamma ? gammaImage->ptr<uchar>(r) : nullptr;
+        int c = 0;
+        for( ; c<=cols-4; c+=4)
+        {
+            uchar v0 = src[c], v1 = src[c+1], v2 = src[c+2], v3 = src[c+3];
+            ++subHistograms[0][v0];
+            ++subHistograms[1][v1];
+            ++subHistograms[2][v2];
+            ++subHistograms[3][v3];
+            if(writeGamma)
+            {
+                dst[c] = lookUpTable[v0];
+                dst[c+1] = lookUpTable[v1];
+                dst[c+2] = lookUpTable[v2];
+                dst[c+3] = lookUpTable[v3];
+            }
+        }
+        for( ; c<cols; ++c)
+        {
+            ++subHistograms[0][src[c]];
+            if(writeGamma)
+                dst[c] = lookUpTable[src[c]];
+        }
+    }
+    
+    for(int i=0; i<256; ++i)
+        histogram[i] = subHistograms[0][i] + subHistograms[1][i] + subHistograms[2][i] + subHistograms[3][i];
+}
+
+
+void fusedGammaHistogram(const Mat& image, double gamma, vector<float>& imageHistogram, vector<float>& gammaHistogram, Mat* gammaImage)
+{
+    CV_Assert(image.type() == CV_8UC1);
+    
+    const uchar* lookUpTable = getGammaLookUpTable(gamma);
+    if(gammaImage)
+        gammaImage->create(image.size(), CV_8U);
+    
+    // one histogram per stripe, so that stripes never write to shared counters
+    const int nStripes = fusedKernelStripes(image);
+    vector<int> stripeHistograms(nStripes * 256);
+    parallel_for_(Range(0, nStripes), [&](const Range& range)
+    {
+        for(int s=range.start; s<range.end; ++s)
+        {
+            int rowStart = (int)((int64)image.rows * s / nStripes);
+            int rowEnd = (int)((int64)image.rows * (s + 1) / nStripes);
+            if(gammaImage)
+                gammaHistogramRows<true>(image, lookUpTable, gammaImage, rowStart, rowEnd, &stripeHistograms[s * 256]);
+            else
+                gammaHistogramRows<false>(image, lookUpTable, gammaImage, rowStart, rowEnd, &stripeHistograms[s * 256]);
+        }
+    }, nStripes);
+    
+    // merges the stripes, integer counts are converted to float only at the end as cv::calcHist does
+    int imageCounts[256] = {};
+    int gammaCounts[256] = {};
+    for(int s=0; s<nStripes; ++s)
+        for(int i=0; i<256; ++i)
+            imageCounts[i] += stripeHistograms[s * 256 + i];
+    for(int i=0; i<256; ++i)
+        gammaCounts[lookUpTable[i]] += imageCounts[i]; // all the pixels of intensity i get intensity lookUpTable[i]
+    
+    imageHistogram.resize(256);
+    gammaHistogram.resize(256);
+    for(int i=0; i<256; ++i)
+    {
+        imageHistogram[i] = (float)imageCounts[i];
+        gammaHistogram[i] = (float)gammaCounts[i];
+    }
+}
+
+
+// Writes 255 where src > thresh, 0 elsewhere
+static void thresholdRow(const uchar* src, uchar* dst, int cols, uchar thresh)
+{
+    int c = 0;
+#if CV_SIMD
+    const v_uint8 vThresh = vx_setall_u8(thresh);
+    for( ; c<=cols-v_uint8::nlanes; c+=v_uint8::nlanes)
+        v_store(dst + c, vx_load(src + c) > vThresh); // comparison lanes are 0xFF when true
+    vx_cleanup();
+#endif
+    for( ; c<cols; ++c)
+        dst[c] = src[c] > thresh ? 255 : 0;
+}
+
+
+void gammaToBinaryImage(const Mat& image, double gamma, double thresholdingValue, Mat& binaryImage)
+{
+    CV_Assert(image.type() == CV_8UC1);
+    
+    const uchar* lookUpTable = getGammaLookUpTable(gamma);
+    
+    // cv::threshold (THRESH_BINARY) on a CV_8U image compares each pixel with the floor of the thresholding value
+    int intThreshold = cvFloor(thresholdingValue);
+    
+    // first original intensity whose gamma value is above the threshold (256 if none)
+    int firstAbove = 256;
+    while(firstAbove > 0 && lookUpTable[firstAbove-1] > intThreshold)
+        --firstAbove;
+    // all the intensities below firstAbove must be at or below the threshold, true for any non decreasing table (gamma >= 0)
+    bool monotonic = true;
+    for(int i=0; i<firstAbove; ++i)
+        monotonic = monotonic && lookUpTable[i] <= intThreshold;
+    
+    binaryImage.create(image.size(), CV_8U);
+    if(!monotonic)
+    {
+        // generic fallback: a lookup table straight from original intensity to binary value
+        Mat binaryTable(1, 256, CV_8U);
+        for(int i=0; i<256; ++i)
+            binaryTable.at<uchar>(i) = lookUpTable[i] > intThreshold ? 255 : 0;
+        LUT(image, binaryTable, binaryImage);
+        return;
+    }
+    if(firstAbove == 0 || firstAbove == 256)
+    {
+        binaryImage.setTo(Scalar(firstAbove == 0 ? 255 : 0));
+        return;
+    }
+    
+    const uchar originalThreshold = (uchar)(firstAbove - 1);
+    const int nStripes = fusedKernelStripes(image);
+    parallel_for_(Range(0, nStripes), [&](const Range& range)
+    {
+        for(int s=range.start; s<range.end; ++s)
+        {
+            int rowEnd = (int)((int64)image.rows * (s + 1) / nStripes);
+            for(int r=(int)((int64)image.rows * s / nStripes); r<rowEnd; ++r)
+                thresholdRow(image.ptr<uchar>(r), binaryImage.ptr<uchar>(r), image.cols, originalThreshold);
+        }
+    }, nStripes);
+}
+
 // Adapter like function
 void toBinaryImage(Mat& image, double thresholdingValue)
 {
@@ -210,33 +644,144 @@ Ptr<SimpleBlobDetector> getBlobDetectorInstance(SimpleBlobDetector::Params* para
 
 vector<KeyPoint> boundingBlobDetect(Ptr<SimpleBlobDetector> blobDetector, Mat& binaryImage, Mat& imgWithKeypoints, Mat& imgWithBoundingBoxes)
 {
-    // calling detect function of blobDetector
-    vector<KeyPoint> keypoints;
-    blobDetector -> detect(binaryImage, keypoints);
+    vector<RotatedRect> boundingRects;
+    vector<KeyPoint> keypoints = detectBoundingRects(blobDetector, binaryImage, boundingRects);
+    
     // draws red circles on detected keypoints
     drawKeypoints(binaryImage, keypoints, imgWithKeypoints, Scalar(0, 0, 255), DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
+    
+    drawRotatedBoundingBoxes(imgWithBoundingBoxes, boundingRects);
+    
+    //cout << "Total number of bounded pixels: " << totalPixels(boundingRects) << endl;
+    
+    return keypoints;
+}
+
+
+vector<KeyPoint> detectBoundingRects(Ptr<SimpleBlobDetector> blobDetector, Mat& binaryImage, vector<RotatedRect>& boundingRects)
+{
+    DetectionBuffers buffers;
+    vector<KeyPoint> keypoints;
+    detectBoundingRects(blobDetector, binaryImage, buffers, keypoints, boundingRects);
+    return keypoints;
+}
+
+
+void detectBoundingRects(Ptr<SimpleBlobDetector> blobDetector, const Mat& binaryImage, DetectionBuffers& buffers, vector<KeyPoint>& keypoints, vector<RotatedRect>& boundingRects)
+{
+    // calling detect function of blobDetector
+    keypoints.clear();
+    blobDetector -> detect(binaryImage, keypoints);
         
     // Uses cv::findContours method applied to the Binary Image, to locate all patches of white pixels
-    vector<vector<Point>> contoursSet; // a vector of patches, eatch patch of points it's in turn described by a vector of Point
+    vector<vector<Point>>& contoursSet = buffers.contours; // a vector of patches, eatch patch of points it's in turn described by a vector of Point
     findContours(binaryImage, contoursSet, RETR_EXTERNAL, CHAIN_APPROX_NONE); // RETR_EXTERNAL to reject inner contours
+    countEvent(PipelineCounter::CONTOURS_FOUND, contoursSet.size());
     
     // Given each patch creates the minimum rotated bounding rectangle which contains it
-    vector<RotatedRect> boundingRects(contoursSet.size());
+    vector<RotatedRect>& contoursRects = buffers.contoursRects;
+    contoursRects.resize(contoursSet.size());
     for(int i=0; i<contoursSet.size(); ++i)
     {
-        boundingRects[i] = minAreaRect(contoursSet[i]);
+        contoursRects[i] = minAreaRect(contoursSet[i]);
     }
     
+    // keeps only the rectangles also detected by the blob detector
+    boundingRects = selectBlobDetectedRects(keypoints, contoursRects);
+}
+
+
+// Oriented bounding box of the pixels labeled label inside box, aligned to their principal axes. Also gives their centroid.
+static RotatedRect componentOrientedBox(const Mat& labels, int label, const Rect& box, vector<Point>& extremePoints, Point2f& centroid)
+{
+    // single pass: moments and first/last pixel of each row, with coordinates relative to the box
+    PixelMoments moments;
+    extremePoints.clear();
+    for(int y=0; y<box.height; ++y)
+    {
+        const int* row = labels.ptr<int>(box.y + y) + box.x;
+        int first = -1, last = -1;
+        for(int x=0; x<box.width; ++x)
+        {
+            if(row[x] != label)
+                continue;
+            moments.add(x, y);
+            if(first < 0)
+                first = x;
+            last = x;
+        }
+        if(first >= 0)
+        {
+            extremePoints.push_back(Point(first, y));
+            extremePoints.push_back(Point(last, y));
+        }
+    }
+    return orientedBoxFromMoments(moments, extremePoints, box.tl(), centroid);
+}
+
+
+vector<KeyPoint> detectComponentRects(const Mat& binaryImage, const SimpleBlobDetector::Params& parameters, vector<RotatedRect>& boundingRects)
+{
+    DetectionBuffers buffers;
+    vector<KeyPoint> keypoints;
+    detectComponentRects(binaryImage, parameters, buffers, keypoints, boundingRects);
+    return keypoints;
+}
+
+
+void detectComponentRects(const Mat& binaryImage, const SimpleBlobDetector::Params& parameters, DetectionBuffers& buffers, vector<KeyPoint>& keypoints, vector<RotatedRect>& boundingRects)
+{
+    // one labeling of the white pixels gives every component with its area and bounding box
+    const Mat& labels = buffers.labels;
+    const Mat& stats = buffers.stats;
+    int nLabels = connectedComponentsWithStats(binaryImage, buffers.labels, buffers.stats, buffers.centroids, 8, CV_32S);
+    countEvent(PipelineCounter::CONTOURS_FOUND, nLabels - 1);
     
-    vector<RotatedRect> boundingRectsCopy(boundingRects); // clones boundingRects vector before vector difference
-    eliminateBlobDetectedRect(keypoints, boundingRectsCopy); // vectors of non blob detected bounding rectangles
-    vectorsDifference(boundingRects, boundingRectsCopy); // vectors of only blob detected bounding rectangles
-    
-    drawRotatedBoundingBoxes(imgWithBoundingBoxes, boundingRects);
-    
-    //cout << "Total number of bounded pixels: " << totalPixels(boundingRects) << endl;
+    // kept components sorted in raster order of their first pixel: the labeling scans 2x2 blocks, so its label order is not raster order
+    vector<int64>& firstPixels = buffers.firstPixels;
+    firstPixels.clear();
+    for(int label=1; label<nLabels; ++label) // label 0 is the background
+    {
+        int area = stats.at<int>(label, CC_STAT_AREA);
+        // same bounds as SimpleBlobDetector: minArea included, maxArea excluded
+        if(parameters.filterByArea && (area < parameters.minArea || area >= parameters.maxArea))
+            continue;
+        int top = stats.at<int>(label, CC_STAT_TOP);
+        const int* row = labels.ptr<int>(top);
+        int x = stats.at<int>(label, CC_STAT_LEFT);
+        while(row[x] != label)
+            ++x;
+        firstPixels.push_back((int64)top * labels.cols + x);
+    }
+    sort(firstPixels.begin(), firstPixels.end());
     
-    return keypoints;
+    keypoints.clear();
+    boundingRects.clear();
+    for(int i=0; i<firstPixels.size(); ++i)
+    {
+        int label = labels.ptr<int>((int)(firstPixels[i] / labels.cols))[firstPixels[i] % labels.cols];
+        int area = stats.at<int>(label, CC_STAT_AREA);
+        
+        // moments are computed only for the kept components, scanning just their bounding box
+        Rect box(stats.at<int>(label, CC_STAT_LEFT), stats.at<int>(label, CC_STAT_TOP), stats.at<int>(label, CC_STAT_WIDTH), stats.at<int>(label, CC_STAT_HEIGHT));
+        Point2f centroid;
+        boundingRects.push_back(componentOrientedBox(labels, label, box, buffers.extremePoints, centroid));
+        keypoints.push_back(KeyPoint(centroid, (float)(2 * sqrt(area / CV_PI))));
+    }
+}
+
+
+bool parseDetectorEngine(const string& name, DetectorEngine& engine)
+{
+    if(name == "blob")
+        engine = DetectorEngine::SIMPLE_BLOB;
+    else if(name == "components")
+        engine = DetectorEngine::CONNECTED_COMPONENTS;
+    else if(name == "bitmask")
+        engine = DetectorEngine::BIT_MASK;
+    else
+        return false;
+    return true;
 }
 
 
@@ -271,6 +816,12 @@ double getAdaptiveThreshValue(const cv::Mat& image)
         intensities.push_back(*it);
     }
     
+    return getAdaptiveThreshValue(intensities);
+}
+
+
+double getAdaptiveThreshValue(const vector<float>& intensities)
+{
     // Prints intensity values // Just for debugging purposes
     /*
     cout << "Number of intensities: " << intensities.size() << endl;
@@ -285,8 +836,8 @@ double getAdaptiveThreshValue(const cv::Mat& image)
     double m = 0.0; // slope
     // max slope over which the algotithm ends, returning the thresholding value equal to the i position reached
     // experimental value founded by analyzing histograms of some gamma corrected images, seeing that all hists present this thresholding slope where impurities intensities end and parsley/background intensities start
-    double thresholdingSlope = 1000000;
-    int window = 2; // due to the gamma image histogram irregolarity, calculates the mean of 2 points instead of 1, to eventually calculate the slope by (y2-y1)/window
+    double thresholdingSlope = adaptiveThresholdingSlope;
+    int window = adaptiveThresholdingWindow; // due to the gamma image histogram irregolarity, calculates the mean of 2 points instead of 1, to eventually calculate the slope by (y2-y1)/window
     
     // i acts as an iterator over the vector, scanning it from right to left, calculating for each iteration the slope of the gamma histogram at that point
     // y1 represents the mean of the intensities at positions i and i+1    [i to i+window[ if window > 2
@@ -323,6 +874,163 @@ double getAdaptiveThreshValue(const cv::Mat& image)
 }
 
 
+double otsuThreshValue(const vector<float>& intensities)
+{
+    double total = 0.0, weightedTotal = 0.0;
+    for(int i=0; i<intensities.size(); ++i)
+    {
+        total += intensities[i];
+        weightedTotal += i * (double)intensities[i];
+    }
+    
+    // background class: intensities up to t, foreground: above t
+    double backgroundWeight = 0.0, backgroundSum = 0.0, bestVariance = -1.0;
+    int bestThreshold = 0;
+    for(int t=0; t<intensities.size(); ++t)
+    {
+        backgroundWeight += intensities[t];
+        backgroundSum += t * (double)intensities[t];
+        double foregroundWeight = total - backgroundWeight;
+        if(backgroundWeight == 0)
+            continue;
+        if(foregroundWeight == 0)
+            break;
+        double meansDifference = backgroundSum / backgroundWeight - (weightedTotal - backgroundSum) / foregroundWeight;
+        double betweenVariance = backgroundWeight * foregroundWeight * meansDifference * meansDifference;
+        if(betweenVariance > bestVariance)
+        {
+            bestVariance = betweenVariance;
+            bestThreshold = t;
+        }
+    }
+    return bestThreshold;
+}
+
+
+bool decodeInputImage(const string& path, bool keepColor, Mat& grayImage, Mat& colorImage)
+{
+    const int flags = keepColor ? IMREAD_COLOR : IMREAD_GRAYSCALE;
+    Mat decoded;
+    
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size <= INT_MAX)
+    {
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL); // the decoder reads the file front to back
+            // a header over the mapped bytes: imdecode reads them in place
+            decoded = imdecode(Mat(1, (int)info.st_size, CV_8U, data), flags);
+            munmap(data, (size_t)info.st_size);
+        }
+    }
+    if(fd >= 0)
+        close(fd);
+    
+    if(decoded.empty())
+        decoded = imread(path, flags); // not mappable (e.g. special files) or not decodable from memory
+    if(decoded.empty())
+        return false;
+    
+    if(keepColor)
+    {
+        colorImage = decoded;
+        cvtColor(colorImage, grayImage, COLOR_BGR2GRAY);
+    }
+    else
+    {
+        grayImage = decoded;
+        colorImage.release();
+    }
+    return true;
+}
+
+
+bool isDirectory(const string& path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+
+void PixelMoments::add(int x, int y)
+{
+    n += 1;
+    sx += x;
+    sy += y;
+    sxx += (int64)x * x;
+    sxy += (int64)x * y;
+    syy += (int64)y * y;
+}
+
+
+void PixelMoments::add(const PixelMoments& other, int dx, int dy)
+{
+    // sums of (x+dx), (x+dx)^2, (x+dx)(y+dy)... expanded, all exact in integer arithmetic
+    sxx += other.sxx + 2 * dx * other.sx + (int64)dx * dx * other.n;
+    syy += other.syy + 2 * dy * other.sy + (int64)dy * dy * other.n;
+    sxy += other.sxy + dy * other.sx + dx * other.sy + (int64)dx * dy * other.n;
+    sx += other.sx + dx * other.n;
+    sy += other.sy + dy * other.n;
+    n += other.n;
+}
+
+
+// Sum of the squares from 0 to k, 0 for k = -1
+static inline int64 sumOfSquares(int64 k)
+{
+    return k * (k + 1) * (2 * k + 1) / 6;
+}
+
+
+void PixelMoments::addRun(int xStart, int xEnd, int y)
+{
+    int64 length = xEnd - xStart;
+    int64 runSx = length * (xStart + xEnd - 1) / 2; // length and (xStart + xEnd - 1) never both odd
+    n += length;
+    sx += runSx;
+    sy += (int64)y * length;
+    sxx += sumOfSquares(xEnd - 1) - sumOfSquares(xStart - 1);
+    sxy += (int64)y * runSx;
+    syy += (int64)y * y * length;
+}
+
+
+RotatedRect orientedBoxFromMoments(const PixelMoments& moments, const vector<Point>& extremePoints, Point origin, Point2f& centroid)
+{
+    double n = (double)moments.n;
+    double mx = moments.sx / n;
+    double my = moments.sy / n;
+    double mu20 = moments.sxx / n - mx * mx;
+    double mu02 = moments.syy / n - my * my;
+    double mu11 = moments.sxy / n - mx * my;
+    double theta = 0.5 * atan2(2 * mu11, mu20 - mu02); // principal axis orientation
+    double c = cos(theta);
+    double s = sin(theta);
+    
+    // extent of the pixel centers along the principal axes (minAreaRect as well works on pixel coordinates)
+    double minU = DBL_MAX, maxU = -DBL_MAX, minV = DBL_MAX, maxV = -DBL_MAX;
+    for(int i=0; i<extremePoints.size(); ++i)
+    {
+        double dx = extremePoints[i].x - mx;
+        double dy = extremePoints[i].y - my;
+        double u = dx * c + dy * s;
+        double v = -dx * s + dy * c;
+        minU = min(minU, u);
+        maxU = max(maxU, u);
+        minV = min(minV, v);
+        maxV = max(maxV, v);
+    }
+    double midU = (minU + maxU) / 2;
+    double midV = (minV + maxV) / 2;
+    
+    centroid = Point2f((float)(origin.x + mx), (float)(origin.y + my));
+    Point2f center((float)(origin.x + mx + midU * c - midV * s), (float)(origin.y + my + midU * s + midV * c));
+    return RotatedRect(center, Size2f((float)(maxU - minU), (float)(maxV - minV)), (float)(theta * 180 / CV_PI));
+}
+
+
 bool pointBelongsToRect(const RotatedRect& rect, Point2f point)
 {
     Rect minBoundingRect = rect.boundingRect(); // gets the best non rotated rectangle which contains rect
@@ -330,6 +1038,77 @@ bool pointBelongsToRect(const RotatedRect& rect, Point2f point)
 }
 
 
+RectGridIndex::RectGridIndex(const vector<RotatedRect>& rotRects)
+{
+    if(rotRects.empty())
+        return;
+    
+    boundingBoxes.resize(rotRects.size());
+    Rect extent;
+    double meanSide = 0;
+    for(int i=0; i<rotRects.size(); ++i)
+    {
+        boundingBoxes[i] = rotRects[i].boundingRect();
+        extent = (i == 0) ? boundingBoxes[i] : (extent | boundingBoxes[i]);
+        meanSide += max(boundingBoxes[i].width, boundingBoxes[i].height);
+    }
+    meanSide /= rotRects.size();
+    
+    // cells about as big as a rectangle, but never more cells than 4 per rectangle (memory bound when rectangles are tiny and spread)
+    cellSide = max(1, (int)ceil(meanSide));
+    double maxCells = 4.0 * rotRects.size() + 16;
+    while((double)(extent.width / cellSide + 1) * (extent.height / cellSide + 1) > maxCells)
+        cellSide *= 2;
+    origin = extent.tl();
+    nCellsX = extent.width / cellSide + 1;
+    nCellsY = extent.height / cellSide + 1;
+    
+    // first pass counts the rectangles of each cell, second pass fills them in
+    cellOffsets.assign(nCellsX * nCellsY + 1, 0);
+    for(int pass=0; pass<2; ++pass)
+    {
+        vector<int> cursor;
+        if(pass == 1)
+        {
+            for(int c=0; c<nCellsX*nCellsY; ++c)
+                cellOffsets[c+1] += cellOffsets[c];
+            cellRects.resize(cellOffsets.back());
+            cursor.assign(cellOffsets.begin(), cellOffsets.end() - 1);
+        }
+        for(int i=0; i<boundingBoxes.size(); ++i)
+        {
+            const Rect& box = boundingBoxes[i];
+            int firstX = (box.x - origin.x) / cellSide, lastX = (box.x + box.width - 1 - origin.x) / cellSide;
+            int firstY = (box.y - origin.y) / cellSide, lastY = (box.y + box.height - 1 - origin.y) / cellSide;
+            for(int cellY=firstY; cellY<=lastY; ++cellY)
+                for(int cellX=firstX; cellX<=lastX; ++cellX)
+                {
+                    int cell = cellY * nCellsX + cellX;
+                    if(pass == 0)
+                        ++cellOffsets[cell + 1];
+                    else
+                        cellRects[cursor[cell]++] = i;
+                }
+        }
+    }
+}
+
+
+vector<RotatedRect> selectBlobDetectedRects(const vector<KeyPoint>& keypoints, const vector<RotatedRect>& rotRects)
+{
+    RectGridIndex index(rotRects);
+    vector<char> matched(rotRects.size(), 0);
+    for(int i=0; i<keypoints.size(); ++i)
+        index.forEachContaining(keypoints[i].pt, [&matched](int r){ matched[r] = 1; });
+    
+    vector<RotatedRect> selected;
+    for(int r=0; r<rotRects.size(); ++r)
+        if(matched[r])
+            selected.push_back(rotRects[r]);
+    return selected;
+}
+
+
 void eliminateBlobDetectedRect(const vector<KeyPoint>& keypoints, vector<RotatedRect>& rotRects)
 {
     for(int i=0; i<keypoints.size(); ++i)
@@ -4,22 +4,51 @@
 #define parsleyLib_hpp
 
 #include <stdio.h>
+#include <cstdint>
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
+#include "parsleyOutput.hpp"
 
 
 namespace parsleyLib{
 
 
+class ResultSink;      // see parsleyResults.hpp
+class ColorClassifier; // see parsleyColor.hpp
+class ResultCache;     // see parsleyCache.hpp
+
+
+/**
+ Algorithm used to extract the impurities from the binary image.
+ */
+enum class DetectorEngine
+{
+    SIMPLE_BLOB,          // SimpleBlobDetector keypoints matched with findContours rotated rectangles
+    CONNECTED_COMPONENTS, // a single connected components labeling, see detectComponentRects
+    BIT_MASK              // same detections of CONNECTED_COMPONENTS from a bit packed mask labeled on runs, see detectBitMaskRects
+};
+
+
 /**
  Process a single image.
  Loads the image at the specified path, applies Gamma Correction, Image Segmentation and Feature Extraction and saves each step image in a .tiff image in the output path. Prints to console detected objects list as pair (pixelColumn, pixelRow).
  
  @param inputImgPath input image path
  @param outputImgPath output path to save all images for each step
+ @param outputFileName name of the .tiff file created in outputImgPath (batch mode uses one file per input image)
+ @param verbose if false nothing is printed to console (batch mode prints its own per image summary)
+ @param outputLevel which images to save: none, only the annotated image or the full stack of every step (histograms are not even computed unless requested)
+ @param writer if not null the output file is encoded and written on its background thread, otherwise synchronously
+ @param engine the algorithm used to extract the impurities from the binary image
+ @param sink if not null where to save the detections
+ @param frameId position of the image in its batch, saved with the detections
+ @param classifier if not null the image is decoded in color and its pixels classified by this color lookup table instead of gamma correction and thresholding (the debug stack then has no histograms)
+ @param cleanFrameMargin if above 0 an image passing the sampled clean frame check with this margin (see isCleanFrame) is reported without detections and nothing is drawn nor saved for it
+ @param cache if not null the detections (and, with annotated output, the encoded annotated image) of an image already processed with the same parameters are taken from it without decoding the image; with full debug output the cache is only filled
+ @return the number of detected objects
  
  */
-void processImage(std::string inputImgPath, std::string outputImgPath);
+std::size_t processImage(std::string inputImgPath, std::string outputImgPath, std::string outputFileName = "processedImages.tiff", bool verbose = true, OutputLevel outputLevel = OutputLevel::FULL_DEBUG, AsyncImageWriter* writer = nullptr, DetectorEngine engine = DetectorEngine::SIMPLE_BLOB, ResultSink* sink = nullptr, std::uint64_t frameId = 0, const ColorClassifier* classifier = nullptr, double cleanFrameMargin = 0, ResultCache* cache = nullptr);
 
 
 /**
@@ -31,6 +60,34 @@ void processImage(std::string inputImgPath, std::string outputImgPath);
 void calculateCV_8UHistogram(const cv::Mat& image, cv::Mat& imageToDisplayWhere);
 
 
+/**
+ Draws an already computed 256 bins histogram and saves the ready to display data in the image passed.
+ 
+ @param histogram the number of pixels of each intensity
+ @param imageToDisplayWhere the image in which to save the ready to display hist data
+ */
+void drawCV_8UHistogram(const std::vector<float>& histogram, cv::Mat& imageToDisplayWhere);
+
+
+/**
+ Gets the gamma correction lookup table for the given gamma value.
+ 
+ Tables of the standard settings (gamma from 1.0 to 3.0 in 0.1 steps) are generated at compile time, any other table is computed on its first use and cached. Safe to call from many threads.
+ 
+ @param gamma gamma value of the correction
+ @return the 256 entries table, valid until the program ends
+ */
+const uchar* getGammaLookUpTable(double gamma);
+
+
+/**
+ Compares the compile time gamma tables of the standard settings with the ones computed at run time by pow(), printing to console every entry that differs.
+ 
+ @return true if all the entries are equal
+ */
+bool checkGammaLookUpTables();
+
+
 /**
  Applies  gamma correction to the passed image.
  
@@ -49,6 +106,33 @@ void applyGammaCorrection(cv::Mat& image, double gamma);
 void toBinaryImage(cv::Mat& image, double thresholdingValue);
 
 
+/**
+ Computes in a single pass over the pixels the histogram of the image and the histogram the image would have after gamma correction, optionally writing the gamma corrected image.
+ 
+ Rows are split in stripes processed in parallel, each with its own sub-histograms merged at the end. The gamma histogram is obtained by moving each bin through the gamma lookup table, so it is identical to the one of applyGammaCorrection + calcHist without ever reading the gamma image.
+ 
+ @param image the CV_8U image to process, it is not modified
+ @param gamma gamma value of the correction
+ @param imageHistogram where to save the histogram of image (256 bins)
+ @param gammaHistogram where to save the histogram of the gamma corrected image (256 bins)
+ @param gammaImage if not null, where to save the gamma corrected image
+ */
+void fusedGammaHistogram(const cv::Mat& image, double gamma, std::vector<float>& imageHistogram, std::vector<float>& gammaHistogram, cv::Mat* gammaImage = nullptr);
+
+
+/**
+ Gets the binary image of the gamma corrected image directly from the original image, in a single vectorized pass.
+ 
+ The result is identical to applyGammaCorrection followed by toBinaryImage: being the gamma lookup table non decreasing, a gamma value above the threshold corresponds to an original value above a transformed threshold.
+ 
+ @param image the CV_8U image to process, it is not modified
+ @param gamma gamma value of the correction
+ @param thresholdingValue the threshold value, referred to the gamma corrected image
+ @param binaryImage where to save the binary image
+ */
+void gammaToBinaryImage(const cv::Mat& image, double gamma, double thresholdingValue, cv::Mat& binaryImage);
+
+
 /**
  Use this function to create an instance of SimpleBlobDetector::Params type, with alredy all parameters setted for this specific application.
  */
@@ -80,6 +164,81 @@ cv::Ptr<cv::SimpleBlobDetector> getBlobDetectorInstance(cv::SimpleBlobDetector::
 std::vector<cv::KeyPoint> boundingBlobDetect(cv::Ptr<cv::SimpleBlobDetector> blobDetector, cv::Mat& binaryImage, cv::Mat& imgWithKeypoints, cv::Mat& imgWithBoundingBoxes);
 
 
+/**
+ Same detection of boundingBlobDetect, without drawing anything: the blob detected rotated bounding rectangles are returned instead.
+ 
+ @param blobDetector an alredy instantiated and setted blobDetector
+ @param binaryImage the binary image to analyze
+ @param boundingRects where to save the rotated bounding rectangles of the blob detected objects
+ @return a vector of keypoint from which coordinates can be extracted
+ */
+std::vector<cv::KeyPoint> detectBoundingRects(cv::Ptr<cv::SimpleBlobDetector> blobDetector, cv::Mat& binaryImage, std::vector<cv::RotatedRect>& boundingRects);
+
+
+/**
+ Working buffers of detectBoundingRects and detectComponentRects. Kept by the caller (see Pipeline), their memory is reused from an image to the next.
+ */
+struct DetectionBuffers
+{
+    std::vector<std::vector<cv::Point>> contours; // blob engine
+    std::vector<cv::RotatedRect> contoursRects;
+    cv::Mat labels, stats, centroids;             // connected components engine
+    std::vector<cv::Point> extremePoints;
+    std::vector<std::int64_t> firstPixels;        // raster index of the first pixel of each kept component
+    cv::Mat coarseBinary, coarseLabels, coarseStats, coarseCentroids; // coarse to fine detection (see detectCoarseToFine)
+    std::vector<cv::Rect> regions;
+};
+
+
+/**
+ Same as detectBoundingRects, with caller owned buffers and output vectors.
+ 
+ @param blobDetector an alredy instantiated and setted blobDetector
+ @param binaryImage the binary image to analyze
+ @param buffers working buffers, reused across calls
+ @param keypoints where to save the blob detected keypoints
+ @param boundingRects where to save the rotated bounding rectangles of the blob detected objects
+ */
+void detectBoundingRects(cv::Ptr<cv::SimpleBlobDetector> blobDetector, const cv::Mat& binaryImage, DetectionBuffers& buffers, std::vector<cv::KeyPoint>& keypoints, std::vector<cv::RotatedRect>& boundingRects);
+
+
+/**
+ Alternative to detectBoundingRects segmenting the binary image only once, with a connected components labeling.
+ 
+ Area, centroid and oriented bounding box of each component are derived from its moments: the box is aligned to the component principal axes and spans its pixels along them.
+ Components are filtered with the minArea/maxArea parameters, applied to the pixel count. Keypoints are centered on the centroid, with the diameter of the circle of same area as size.
+ Components are returned in raster order of their first pixel (top row, then leftmost pixel on it), not in the label order of the labeling, which scans blocks of two rows.
+ 
+ @param binaryImage the binary image to analyze, white pixels are the impurities
+ @param parameters the detection parameters (see instantiateBlobParams), only the area filter is used
+ @param boundingRects where to save the oriented bounding rectangles of the kept components
+ @return a keypoint for each kept component, in the same order as boundingRects
+ */
+std::vector<cv::KeyPoint> detectComponentRects(const cv::Mat& binaryImage, const cv::SimpleBlobDetector::Params& parameters, std::vector<cv::RotatedRect>& boundingRects);
+
+
+/**
+ Same as detectComponentRects, with caller owned buffers and output vectors.
+ 
+ @param binaryImage the binary image to analyze, white pixels are the impurities
+ @param parameters the detection parameters (see instantiateBlobParams), only the area filter is used
+ @param buffers working buffers, reused across calls
+ @param keypoints where to save a keypoint for each kept component
+ @param boundingRects where to save the oriented bounding rectangles of the kept components, in the same order as keypoints
+ */
+void detectComponentRects(const cv::Mat& binaryImage, const cv::SimpleBlobDetector::Params& parameters, DetectionBuffers& buffers, std::vector<cv::KeyPoint>& keypoints, std::vector<cv::RotatedRect>& boundingRects);
+
+
+/**
+ Parses a detector engine name: "blob", "components" or "bitmask".
+ 
+ @param name the name to parse
+ @param engine where to save the parsed engine
+ @return false if the name is unknown
+ */
+bool parseDetectorEngine(const std::string& name, DetectorEngine& engine);
+
+
 
 
 
@@ -91,6 +250,13 @@ std::vector<cv::KeyPoint> boundingBlobDetect(cv::Ptr<cv::SimpleBlobDetector> blo
 
 
 
+/**
+ Slope (in percent) of the gamma histogram over which getAdaptiveThreshValue stops, and the histogram bins averaged on each side of it.
+ Any change to them changes the detections: they are part of the ResultCache parameters key.
+ */
+const double adaptiveThresholdingSlope = 1000000;
+const int adaptiveThresholdingWindow = 2;
+
 /**
  Automatically computes a thresholding value on the given image.
  
@@ -98,6 +264,83 @@ std::vector<cv::KeyPoint> boundingBlobDetect(cv::Ptr<cv::SimpleBlobDetector> blo
  */
 double getAdaptiveThreshValue(const cv::Mat& image);
 
+/**
+ Same as getAdaptiveThreshValue(const cv::Mat&) on an already computed histogram.
+ 
+ @param intensities the number of pixels of each intensity (256 bins)
+ @return the thresholding value, -1 if no slope is big enough
+ */
+double getAdaptiveThreshValue(const std::vector<float>& intensities);
+
+/**
+ Otsu thresholding value of an already computed histogram: the one maximizing the variance between the two classes.
+ Used as fallback when getAdaptiveThreshValue finds no slope big enough.
+ 
+ @param intensities the number of pixels of each intensity (256 bins)
+ @return the thresholding value (pixels above it are white)
+ */
+double otsuThreshValue(const std::vector<float>& intensities);
+
+
+/**
+ Raw moments of a set of pixels (count, sums of x, y, x^2, xy, y^2).
+ 
+ Sums are integers, so moments of parts of a component (e.g. the pieces of a blob split by image tiles) merge exactly.
+ */
+struct PixelMoments
+{
+    int64 n = 0;
+    int64 sx = 0;
+    int64 sy = 0;
+    int64 sxx = 0;
+    int64 sxy = 0;
+    int64 syy = 0;
+    
+    /** Adds the pixel (x, y). */
+    void add(int x, int y);
+    
+    /** Adds the moments of other, whose pixel coordinates are shifted by (dx, dy) to this coordinate system. */
+    void add(const PixelMoments& other, int dx, int dy);
+    
+    /** Adds the pixels from (xStart, y) to (xEnd - 1, y), with the sums in closed form. Coordinates must not be negative. */
+    void addRun(int xStart, int xEnd, int y);
+};
+
+
+/**
+ Oriented bounding box of a component (used by detectComponentRects): aligned to the principal axes given by its moments, spanning its pixels along them.
+ 
+ @param moments the component moments, with coordinates relative to origin
+ @param extremePoints pixels of the component including at least its first and last pixel of every row (any linear function of the pixel coordinates reaches its extremes on them), relative to origin
+ @param origin image coordinates of the moments coordinate system origin
+ @param centroid where to save the component centroid, in image coordinates
+ @return the oriented bounding box, in image coordinates
+ */
+cv::RotatedRect orientedBoxFromMoments(const PixelMoments& moments, const std::vector<cv::Point>& extremePoints, cv::Point origin, cv::Point2f& centroid);
+
+
+/**
+ Decodes an image file once, reading it through a memory mapping (no intermediate copy of the encoded bytes).
+ 
+ The grayscale plane is derived from the same decode as the color one, which is produced only when requested (annotated output), so each input is read and decoded a single time.
+ Falls back to imread when the file can not be mapped.
+ 
+ @param path the image file path
+ @param keepColor if true colorImage is also filled, with the BGR decode
+ @param grayImage where to save the CV_8U grayscale image
+ @param colorImage where to save the CV_8UC3 image, left empty if keepColor is false
+ @return false if the file can not be read or decoded
+ */
+bool decodeInputImage(const std::string& path, bool keepColor, cv::Mat& grayImage, cv::Mat& colorImage);
+
+
+/**
+ Checks if the given path is an existing directory.
+ 
+ (Used by batch and stream modes to tell a directory of images from a manifest or a video file).
+ */
+bool isDirectory(const std::string& path);
+
 
 /**
  Checks if a given point belongs to a given rotated rectangle.
@@ -109,6 +352,67 @@ double getAdaptiveThreshValue(const cv::Mat& image);
  */
 bool pointBelongsToRect(const cv::RotatedRect& rect, cv::Point2f point);
 
+/**
+ A uniform grid over the (non rotated) bounding boxes of a set of rotated rectangles, to find the rectangles containing a point without testing all of them.
+ 
+ Each rectangle is registered in every cell its bounding box overlaps; cells are stored contiguously (one offsets array, one indices array).
+ */
+class RectGridIndex
+{
+public:
+    /**
+     Builds the index. The cell side is chosen from the mean bounding box size, so each rectangle overlaps a few cells.
+     
+     @param rotRects the rectangles to index
+     */
+    explicit RectGridIndex(const std::vector<cv::RotatedRect>& rotRects);
+    
+    /**
+     Calls visit(i) for each rectangle i whose bounding box contains point (same test as pointBelongsToRect).
+     */
+    template<typename Visitor>
+    void forEachContaining(cv::Point2f point, Visitor visit) const
+    {
+        // rounded once, as contains() rounds it: a point within half a pixel of a cell edge is looked up in the cell of its rounded position
+        const cv::Point p = point;
+        if(cellOffsets.empty() || p.x < origin.x || p.y < origin.y)
+            return;
+        int cellX = (p.x - origin.x) / cellSide;
+        int cellY = (p.y - origin.y) / cellSide;
+        if(cellX >= nCellsX || cellY >= nCellsY)
+            return;
+        int cell = cellY * nCellsX + cellX;
+        for(int k=cellOffsets[cell]; k<cellOffsets[cell+1]; ++k)
+        {
+            int i = cellRects[k];
+            if(boundingBoxes[i].contains(p))
+                visit(i);
+        }
+    }
+    
+private:
+    std::vector<cv::Rect> boundingBoxes; // boundingRect() of each rectangle, computed once
+    cv::Point origin;                    // top left corner of the grid
+    int cellSide = 1;
+    int nCellsX = 0;
+    int nCellsY = 0;
+    std::vector<int> cellOffsets; // rectangles of cell c are cellRects[cellOffsets[c]] .. cellRects[cellOffsets[c+1]-1]
+    std::vector<int> cellRects;
+};
+
+
+/**
+ Selects the rotated rectangles whose bounding box contains at least one keypoint, in one pass over the keypoints using a RectGridIndex.
+ 
+ Gives the same rectangles, in the same order, as eliminateBlobDetectedRect followed by vectorsDifference, without their O(keypoints x rectangles) comparisons and erasures.
+ 
+ @param keypoints a vector of keypoints obtained from a Blob detection
+ @param rotRects a vector of rotRects obtained from findContours function
+ @return the rectangles matched by at least one keypoint
+ */
+std::vector<cv::RotatedRect> selectBlobDetectedRects(const std::vector<cv::KeyPoint>& keypoints, const std::vector<cv::RotatedRect>& rotRects);
+
+
 /**
  Eliminates from the vector of RotatedRect elements all the ones that where also detected by the BlobDetector.
  
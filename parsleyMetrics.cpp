@@ -0,0 +1,195 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+
+#include "parsleyMetrics.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+const double LatencyHistogram::bucketBounds[LatencyHistogram::nBuckets] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+// names used by both exports, in enum order
+static const char* const stageNames[nPipelineStages] = {"decode", "gamma_histogram", "threshold", "binarize", "detect", "draw", "write"};
+static const char* const counterNames[nPipelineCounters] = {"images_processed", "contours_found", "keypoints_found", "rectangles_drawn", "threshold_search_failures", "write_failures", "clean_frames_skipped", "clean_checks_escalated", "cache_hits", "cache_misses"};
+static const char* const counterHelps[nPipelineCounters] = {"Images processed.", "Contours or connected components found in the binary images.", "Detected objects.", "Bounding boxes drawn on the annotated images.", "Images whose thresholding value search failed.", "Output files which could not be written.", "Frames reported clean by the sampled histogram check, without further processing.", "Frames the sampled histogram check passed on to the whole pipeline.", "Images whose detections were read from the result cache.", "Images looked up in the result cache and processed."};
+
+// the process wide metrics, updated from every thread
+static atomic<uint64_t> counters[nPipelineCounters];
+static LatencyHistogram stageHistograms[nPipelineStages];
+
+
+LatencyHistogram::LatencyHistogram()
+{
+    for(int i=0; i<=nBuckets; ++i)
+        buckets[i] = 0;
+    sumMicroseconds = 0;
+}
+
+
+void LatencyHistogram::observe(double seconds)
+{
+    int bucket = 0;
+    while(bucket < nBuckets && seconds > bucketBounds[bucket])
+        ++bucket;
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+    sumMicroseconds.fetch_add((uint64_t)(seconds * 1e6), memory_order_relaxed);
+}
+
+
+uint64_t LatencyHistogram::snapshot(uint64_t counts[nBuckets + 1], double& sumSeconds) const
+{
+    uint64_t count = 0;
+    for(int i=0; i<=nBuckets; ++i)
+    {
+        counts[i] = buckets[i].load(memory_order_relaxed);
+        count += counts[i];
+    }
+    sumSeconds = sumMicroseconds.load(memory_order_relaxed) / 1e6;
+    return count;
+}
+
+
+void countEvent(PipelineCounter counter, uint64_t amount)
+{
+    counters[(int)counter].fetch_add(amount, memory_order_relaxed);
+}
+
+
+void observeStage(PipelineStage stage, double seconds)
+{
+    stageHistograms[(int)stage].observe(seconds);
+}
+
+
+StageClock::StageClock() : ticks(getTickCount())
+{
+}
+
+
+void StageClock::lap(PipelineStage stage)
+{
+    int64 now = getTickCount();
+    observeStage(stage, (double)(now - ticks) / getTickFrequency());
+    ticks = now;
+}
+
+
+void StageClock::skip()
+{
+    ticks = getTickCount();
+}
+
+
+string metricsPrometheusText()
+{
+    ostringstream text;
+    for(int c=0; c<nPipelineCounters; ++c)
+    {
+        text << "# HELP apparsley_" << counterNames[c] << "_total " << counterHelps[c] << "\n";
+        text << "# TYPE apparsley_" << counterNames[c] << "_total counter\n";
+        text << "apparsley_" << counterNames[c] << "_total " << counters[c].load(memory_order_relaxed) << "\n";
+    }
+
+    text << "# HELP apparsley_stage_duration_seconds Duration of each pipeline stage.\n";
+    text << "# TYPE apparsley_stage_duration_seconds histogram\n";
+    for(int s=0; s<nPipelineStages; ++s)
+    {
+        uint64_t counts[LatencyHistogram::nBuckets + 1];
+        double sumSeconds;
+        uint64_t count = stageHistograms[s].snapshot(counts, sumSeconds);
+        uint64_t cumulative = 0;
+        for(int b=0; b<LatencyHistogram::nBuckets; ++b)
+        {
+            cumulative += counts[b];
+            text << "apparsley_stage_duration_seconds_bucket{stage=\"" << stageNames[s] << "\",le=\"" << LatencyHistogram::bucketBounds[b] << "\"} " << cumulative << "\n";
+        }
+        text << "apparsley_stage_duration_seconds_bucket{stage=\"" << stageNames[s] << "\",le=\"+Inf\"} " << count << "\n";
+        text << "apparsley_stage_duration_seconds_sum{stage=\"" << stageNames[s] << "\"} " << sumSeconds << "\n";
+        text << "apparsley_stage_duration_seconds_count{stage=\"" << stageNames[s] << "\"} " << count << "\n";
+    }
+    return text.str();
+}
+
+
+string metricsJson()
+{
+    ostringstream json;
+    json << "{\"counters\":{";
+    for(int c=0; c<nPipelineCounters; ++c)
+        json << (c ? "," : "") << "\"" << counterNames[c] << "\":" << counters[c].load(memory_order_relaxed);
+
+    json << "},\"stages\":{";
+    for(int s=0; s<nPipelineStages; ++s)
+    {
+        uint64_t counts[LatencyHistogram::nBuckets + 1];
+        double sumSeconds;
+        uint64_t count = stageHistograms[s].snapshot(counts, sumSeconds);
+        json << (s ? "," : "") << "\"" << stageNames[s] << "\":{\"count\":" << count << ",\"sum_seconds\":" << sumSeconds << ",\"buckets\":[";
+        for(int b=0; b<LatencyHistogram::nBuckets; ++b)
+            json << (b ? "," : "") << "{\"le\":" << LatencyHistogram::bucketBounds[b] << ",\"count\":" << counts[b] << "}";
+        json << ",{\"le\":\"+Inf\",\"count\":" << counts[LatencyHistogram::nBuckets] << "}]}";
+    }
+    json << "}}";
+    return json.str();
+}
+
+
+bool writeMetrics(const string& path)
+{
+    const string extension = ".json";
+    bool asJson = path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+
+    string temporaryPath = path + ".tmp";
+    {
+        ofstream file(temporaryPath);
+        if(!file)
+            return false;
+        file << (asJson ? metricsJson() : metricsPrometheusText());
+        if(!file)
+            return false;
+    }
+    return rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+
+PeriodicMetricsWriter::PeriodicMetricsWriter(const string& path, double intervalSeconds)
+    : path(path), intervalSeconds(intervalSeconds), stopping(false)
+{
+    // started last: the thread uses all the members above
+    writer = thread(&PeriodicMetricsWriter::writerLoop, this);
+}
+
+
+PeriodicMetricsWriter::~PeriodicMetricsWriter()
+{
+    {
+        lock_guard<mutex> lock(stateMutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    writer.join();
+    if(!writeMetrics(path)) // the final values
+        cerr << "Unable to write the metrics: " << path << endl;
+}
+
+
+void PeriodicMetricsWriter::writerLoop()
+{
+    unique_lock<mutex> lock(stateMutex);
+    while(!stopRequested.wait_for(lock, chrono::duration<double>(intervalSeconds), [this]() { return stopping; }))
+    {
+        lock.unlock();
+        writeMetrics(path);
+        lock.lock();
+    }
+}
+
+}
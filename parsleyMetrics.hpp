@@ -0,0 +1,176 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyMetrics_hpp
+#define parsleyMetrics_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+namespace parsleyLib{
+
+
+/**
+ Stages of the pipeline whose latency is measured.
+ */
+enum class PipelineStage
+{
+    DECODE,          // reading and decoding the input
+    GAMMA_HISTOGRAM, // gamma correction fused with the histograms
+    THRESHOLD,       // getAdaptiveThreshValue
+    BINARIZE,        // gammaToBinaryImage
+    DETECT,          // blob detection and rectangles matching, or connected components
+    DRAW,            // bounding boxes drawn on the annotated image
+    WRITE            // encoding and writing of the output file
+};
+const int nPipelineStages = 7;
+
+
+/**
+ Event counters of the pipeline.
+ */
+enum class PipelineCounter
+{
+    IMAGES_PROCESSED,
+    CONTOURS_FOUND,            // contours (blob engine) or connected components (components engine) found in the binary images
+    KEYPOINTS_FOUND,           // detected objects
+    RECTANGLES_DRAWN,
+    THRESHOLD_SEARCH_FAILURES, // getAdaptiveThreshValue found no thresholding slope (returned -1)
+    WRITE_FAILURES,
+    CLEAN_FRAMES_SKIPPED,      // frames reported without detections by the sampled clean frame check (see isCleanFrame)
+    CLEAN_CHECKS_ESCALATED,    // frames the clean frame check passed on to the whole pipeline
+    CACHE_HITS,                // images whose detections came from the ResultCache
+    CACHE_MISSES               // images looked up in the ResultCache and processed
+};
+const int nPipelineCounters = 10;
+
+
+/**
+ Latency histogram with fixed buckets, from 0.1 ms to 10 s. Can be updated by many threads at once: an observation is two relaxed atomic increments, no lock.
+ */
+class LatencyHistogram
+{
+public:
+    static const int nBuckets = 16;
+    static const double bucketBounds[nBuckets]; // upper bounds in seconds, a last bucket takes everything above
+
+    LatencyHistogram();
+
+    /**
+     Adds an observation.
+
+     @param seconds the measured latency
+     */
+    void observe(double seconds);
+
+    /**
+     Reads the histogram (each value atomically, not the whole histogram at once).
+
+     @param counts where to save the observations of each bucket, not cumulative, the last one is the overflow bucket
+     @param sumSeconds where to save the sum of all observations
+     @return the number of observations, the sum of counts
+     */
+    std::uint64_t snapshot(std::uint64_t counts[nBuckets + 1], double& sumSeconds) const;
+
+private:
+    std::atomic<std::uint64_t> buckets[nBuckets + 1];
+    std::atomic<std::uint64_t> sumMicroseconds;
+};
+
+
+/**
+ Increments a pipeline counter (a relaxed atomic add, cheap enough for the hot path).
+
+ @param counter the counter to increment
+ @param amount the increment
+ */
+void countEvent(PipelineCounter counter, std::uint64_t amount = 1);
+
+
+/**
+ Adds a latency observation to the histogram of a pipeline stage.
+
+ @param stage the measured stage
+ @param seconds the measured latency
+ */
+void observeStage(PipelineStage stage, double seconds);
+
+
+/**
+ Measures consecutive stages of the pipeline: each lap records the time elapsed since the previous lap (or the construction) into the histogram of a stage.
+ */
+class StageClock
+{
+public:
+    StageClock();
+
+    /**
+     Records the time since the last lap as a latency of stage.
+     */
+    void lap(PipelineStage stage);
+
+    /**
+     Restarts the clock without recording, to leave out work which belongs to no stage (e.g. debug images).
+     */
+    void skip();
+
+private:
+    std::int64_t ticks;
+};
+
+
+/**
+ All the counters and stage histograms in the Prometheus text exposition format.
+ */
+std::string metricsPrometheusText();
+
+
+/**
+ All the counters and stage histograms as a JSON object.
+ */
+std::string metricsJson();
+
+
+/**
+ Saves the metrics to a file, as JSON if its extension is .json, else in the Prometheus text format (e.g. for the node_exporter textfile collector).
+ The file is written aside and then renamed, so that readers never see it half written.
+
+ @param path the metrics file path
+ @return false if the file could not be written
+ */
+bool writeMetrics(const std::string& path);
+
+
+/**
+ Saves the metrics periodically on a background thread (see writeMetrics), and a last time when destroyed.
+ */
+class PeriodicMetricsWriter
+{
+public:
+    /**
+     @param path the metrics file path
+     @param intervalSeconds time between two writes
+     */
+    PeriodicMetricsWriter(const std::string& path, double intervalSeconds = 10);
+    ~PeriodicMetricsWriter();
+
+    PeriodicMetricsWriter(const PeriodicMetricsWriter&) = delete;
+    PeriodicMetricsWriter& operator=(const PeriodicMetricsWriter&) = delete;
+
+private:
+    void writerLoop();
+
+    std::string path;
+    double intervalSeconds;
+    std::mutex stateMutex;
+    std::condition_variable stopRequested;
+    bool stopping;
+    std::thread writer;
+};
+
+}
+#endif /* parsleyMetrics_hpp */
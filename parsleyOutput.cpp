@@ -0,0 +1,152 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "parsleyOutput.hpp"
+#include "parsleyMetrics.hpp"
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+bool parseOutputLevel(const string& name, OutputLevel& level)
+{
+    if(name == "results")
+        level = OutputLevel::RESULTS_ONLY;
+    else if(name == "annotated")
+        level = OutputLevel::ANNOTATED;
+    else if(name == "full")
+        level = OutputLevel::FULL_DEBUG;
+    else
+        return false;
+    return true;
+}
+
+
+bool parseTiffCompression(const string& name, TiffCompression& compression)
+{
+    if(name == "none")
+        compression = TiffCompression::NONE;
+    else if(name == "lzw")
+        compression = TiffCompression::LZW;
+    else if(name == "packbits")
+        compression = TiffCompression::PACKBITS;
+    else if(name == "deflate")
+        compression = TiffCompression::DEFLATE;
+    else
+        return false;
+    return true;
+}
+
+
+bool writeFileBytes(const string& path, const vector<uchar>& bytes)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if(!file)
+        return false;
+    bool written = bytes.empty() || fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return (fclose(file) == 0) && written;
+}
+
+
+AsyncImageWriter::AsyncImageWriter(TiffCompression compression, size_t maxPendingWrites)
+    : writeParams({IMWRITE_TIFF_COMPRESSION, (int)compression}), jobs(maxPendingWrites, FrameDropPolicy::BLOCK), failures(0)
+{
+    // started last: the thread uses all the members above
+    writer = thread(&AsyncImageWriter::writerLoop, this);
+}
+
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+    finish();
+}
+
+
+void AsyncImageWriter::finish()
+{
+    jobs.close(); // queued jobs are still written before the thread ends
+    if(writer.joinable())
+        writer.join();
+}
+
+
+void AsyncImageWriter::write(const string& path, vector<Mat> images)
+{
+    WriteJob job;
+    job.path = path;
+    job.images = std::move(images);
+    jobs.push(std::move(job));
+}
+
+
+void AsyncImageWriter::write(const string& path, Mat image, function<void(const vector<uchar>&)> onEncoded)
+{
+    WriteJob job;
+    job.path = path;
+    job.images.push_back(image);
+    job.onEncoded = std::move(onEncoded);
+    jobs.push(std::move(job));
+}
+
+
+void AsyncImageWriter::writeEncoded(const string& path, vector<uchar> encoded)
+{
+    WriteJob job;
+    job.path = path;
+    job.encoded = std::move(encoded);
+    jobs.push(std::move(job));
+}
+
+
+TiffCompression AsyncImageWriter::compression() const
+{
+    return (TiffCompression)writeParams[1];
+}
+
+
+size_t AsyncImageWriter::failedWrites() const
+{
+    return failures;
+}
+
+
+void AsyncImageWriter::writerLoop()
+{
+    WriteJob job;
+    while(jobs.pop(job))
+    {
+        bool written = false;
+        StageClock stageClock;
+        try
+        {
+            if(job.images.empty())
+                written = writeFileBytes(job.path, job.encoded);
+            else if(job.onEncoded)
+                written = imencode(".tiff", job.images.front(), job.encoded, writeParams) && writeFileBytes(job.path, job.encoded);
+            else
+                written = imwrite(job.path, job.images, writeParams);
+        }
+        catch(const cv::Exception& e)
+        {
+            cerr << e.what() << endl;
+        }
+        stageClock.lap(PipelineStage::WRITE);
+        if(!written)
+        {
+            ++failures;
+            countEvent(PipelineCounter::WRITE_FAILURES);
+            cerr << "Unable to write: " << job.path << endl;
+        }
+        else if(job.onEncoded)
+            job.onEncoded(job.encoded);
+        job.images.clear(); // releases the images now rather than at the next job
+        job.onEncoded = nullptr;
+    }
+}
+
+}
@@ -0,0 +1,153 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyOutput_hpp
+#define parsleyOutput_hpp
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "parsleyQueue.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ How many images processImage produces besides the detection results.
+ */
+enum class OutputLevel
+{
+    RESULTS_ONLY, // detections only: no image is rendered nor written
+    ANNOTATED,    // a single image: the original one with the bounding boxes drawn on it
+    FULL_DEBUG    // the six pages stack of every program step, histograms included
+};
+
+
+/**
+ TIFF compression schemes (values are the libtiff ones, passed to OpenCV as IMWRITE_TIFF_COMPRESSION).
+ */
+enum class TiffCompression
+{
+    NONE = 1,
+    LZW = 5,
+    PACKBITS = 32773,
+    DEFLATE = 32946
+};
+
+
+/**
+ Parses an output level name: "results", "annotated" or "full".
+
+ @param name the name to parse
+ @param level where to save the parsed level
+ @return false if the name is unknown
+ */
+bool parseOutputLevel(const std::string& name, OutputLevel& level);
+
+
+/**
+ Parses a TIFF compression name: "none", "lzw", "packbits" or "deflate".
+
+ @param name the name to parse
+ @param compression where to save the parsed compression
+ @return false if the name is unknown
+ */
+bool parseTiffCompression(const std::string& name, TiffCompression& compression);
+
+
+/**
+ Writes a whole file at once.
+
+ @param path the file to write
+ @param bytes the file contents
+ @return false if the file can not be written
+ */
+bool writeFileBytes(const std::string& path, const std::vector<uchar>& bytes);
+
+
+/**
+ Encodes and writes images on a background thread, so that the caller can go on with the next image.
+
+ Writes are queued in a BoundedQueue: when the encoder falls behind write() blocks, bounding the memory held by pending images.
+ */
+class AsyncImageWriter
+{
+public:
+    /**
+     Starts the writer thread.
+
+     @param compression compression of the written TIFF files
+     @param maxPendingWrites how many writes can be queued before write() blocks
+     */
+    explicit AsyncImageWriter(TiffCompression compression, std::size_t maxPendingWrites = 8);
+
+    /**
+     Calls finish().
+     */
+    ~AsyncImageWriter();
+
+    AsyncImageWriter(const AsyncImageWriter&) = delete;
+    AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+    /**
+     Queues a (multi-page if more than one image) TIFF write. The images are not copied: the caller must not modify them afterwards.
+
+     @param path the file to write
+     @param images the pages to write
+     */
+    void write(const std::string& path, std::vector<cv::Mat> images);
+
+    /**
+     Queues a single page TIFF write, then gives the encoded file to onEncoded on the writer thread, e.g. to keep it in a ResultCache. The image is not copied: the caller must not modify it afterwards.
+
+     @param path the file to write
+     @param image the image to write
+     @param onEncoded called with the file contents once written, not called if the image can not be encoded or written
+     */
+    void write(const std::string& path, cv::Mat image, std::function<void(const std::vector<uchar>&)> onEncoded);
+
+    /**
+     Queues the write of an already encoded file.
+
+     @param path the file to write
+     @param encoded the file contents
+     */
+    void writeEncoded(const std::string& path, std::vector<uchar> encoded);
+
+    /**
+     @return the compression of the written TIFF files
+     */
+    TiffCompression compression() const;
+
+    /**
+     Writes all the pending images and stops the writer thread, further writes are discarded.
+     */
+    void finish();
+
+    /**
+     @return the number of writes that failed so far
+     */
+    std::size_t failedWrites() const;
+
+private:
+    struct WriteJob
+    {
+        std::string path;
+        std::vector<cv::Mat> images;                              // empty if encoded holds the file contents
+        std::vector<uchar> encoded;
+        std::function<void(const std::vector<uchar>&)> onEncoded; // if set images holds a single page, encoded in memory
+    };
+
+    void writerLoop();
+
+    std::vector<int> writeParams;
+    BoundedQueue<WriteJob> jobs;
+    std::atomic<std::size_t> failures;
+    std::thread writer;
+};
+
+}
+#endif /* parsleyOutput_hpp */
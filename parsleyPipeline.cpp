@@ -0,0 +1,190 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyPipeline.hpp"
+#include "parsleyMetrics.hpp"
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+void DetectionResult::clear()
+{
+    centers.clear();
+    areas.clear();
+    boxes.clear();
+    thresholdingValue = -1;
+}
+
+
+Pipeline::Pipeline(const PipelineSettings& settings)
+    : pipelineSettings(settings), parameters(instantiateBlobParams()), thresholdEstimator(0.2, settings.driftBound)
+{
+    parameters.minArea = settings.minArea;
+    if(settings.engine == DetectorEngine::SIMPLE_BLOB)
+        blobDetector = getBlobDetectorInstance(&parameters, settings.minArea);
+}
+
+
+void Pipeline::process(const Mat& image, DetectionResult& result, Mat* gammaImage)
+{
+    StageClock stageClock;
+
+    // most frames hold no impurity: a strided sample of pixels can tell them before any full resolution pass
+    double sampledValue = -1;
+    lastClean = pipelineSettings.cleanFrameMargin > 0 && isCleanFrame(image, pipelineSettings.gamma, pipelineSettings.minArea, pipelineSettings.cleanFrameMargin, pipelineSettings.cleanFrameStride, &sampledValue);
+    if(lastClean)
+    {
+        result.clear();
+        result.thresholdingValue = sampledValue;
+        lastImageHistogram.clear();
+        lastGammaHistogram.clear();
+        lastBinaryImage.release();
+        stageClock.lap(PipelineStage::THRESHOLD);
+        return;
+    }
+
+    // gamma correction and histograms in a single pass, the gamma image is written only if requested
+    const bool coarseToFine = pipelineSettings.coarseLevels > 0;
+    if(coarseToFine)
+    {
+        // histograms of the downscaled image, as if taken on the full one
+        downscaleToLevel(image, pipelineSettings.coarseLevels, lastCoarseImage);
+        fusedGammaHistogram(lastCoarseImage, pipelineSettings.gamma, lastImageHistogram, lastGammaHistogram);
+        scaleHistogramToFullSize(lastImageHistogram, image.size(), lastCoarseImage.size());
+        scaleHistogramToFullSize(lastGammaHistogram, image.size(), lastCoarseImage.size());
+        if(gammaImage)
+        {
+            image.copyTo(*gammaImage);
+            applyGammaCorrection(*gammaImage, pipelineSettings.gamma);
+        }
+    }
+    else
+        fusedGammaHistogram(image, pipelineSettings.gamma, lastImageHistogram, lastGammaHistogram, gammaImage);
+    stageClock.lap(PipelineStage::GAMMA_HISTOGRAM);
+
+    if(pipelineSettings.trackThreshold)
+        result.thresholdingValue = thresholdEstimator.update(lastGammaHistogram);
+    else
+    {
+        result.thresholdingValue = getAdaptiveThreshValue(lastGammaHistogram);
+        if(result.thresholdingValue < 0) // no slope big enough: -1 would turn the whole image white
+        {
+            countEvent(PipelineCounter::THRESHOLD_SEARCH_FAILURES);
+            result.thresholdingValue = otsuThreshValue(lastGammaHistogram);
+        }
+    }
+    stageClock.lap(PipelineStage::THRESHOLD);
+
+    if(coarseToFine)
+    {
+        // binarization and detection only inside the candidate regions, measured together as the detect stage
+        detectCoarseToFine(image, lastCoarseImage, pipelineSettings.coarseLevels, pipelineSettings.gamma, result.thresholdingValue, parameters, pipelineSettings.engine, blobDetector, buffers, lastBinaryImage, keypoints, result.boxes, &lastCoarseToFineStats);
+    }
+    else if(pipelineSettings.engine == DetectorEngine::BIT_MASK)
+    {
+        // one bit per pixel, labeled on its runs: no CV_8U binary image nor label image
+        lastBinaryImage.release();
+        gammaToBitMask(image, pipelineSettings.gamma, result.thresholdingValue, lastBitMask);
+        stageClock.lap(PipelineStage::BINARIZE);
+        detectBitMaskRects(lastBitMask, parameters, runBuffers, keypoints, result.boxes);
+    }
+    else
+    {
+        // same size images keep the same binary image buffer
+        gammaToBinaryImage(image, pipelineSettings.gamma, result.thresholdingValue, lastBinaryImage);
+        stageClock.lap(PipelineStage::BINARIZE);
+        detectBinaryImage(result);
+    }
+
+    keypointsToResult(result);
+    stageClock.lap(PipelineStage::DETECT);
+}
+
+
+void Pipeline::processColor(const Mat& colorImage, const ColorClassifier& classifier, DetectionResult& result)
+{
+    StageClock stageClock;
+    lastClean = false;
+    lastImageHistogram.clear();
+    lastGammaHistogram.clear();
+    result.thresholdingValue = -1;
+
+    // the lookup table replaces gamma correction, thresholding and binarization
+    classifier.classify(colorImage, lastBinaryImage);
+    stageClock.lap(PipelineStage::BINARIZE);
+
+    detectBinaryImage(result);
+    keypointsToResult(result);
+    stageClock.lap(PipelineStage::DETECT);
+}
+
+
+void Pipeline::detectBinaryImage(DetectionResult& result)
+{
+    if(pipelineSettings.engine == DetectorEngine::SIMPLE_BLOB)
+        detectBoundingRects(blobDetector, lastBinaryImage, buffers, keypoints, result.boxes);
+    else // the bit mask engine gives the same detections as the components one
+        detectComponentRects(lastBinaryImage, parameters, buffers, keypoints, result.boxes);
+}
+
+
+void Pipeline::keypointsToResult(DetectionResult& result)
+{
+    result.centers.resize(keypoints.size());
+    result.areas.resize(keypoints.size());
+    for(int i=0; i<keypoints.size(); ++i)
+    {
+        result.centers[i] = keypoints[i].pt;
+        float radius = keypoints[i].size / 2; // the size is the diameter of the blob
+        result.areas[i] = (float)(CV_PI * radius * radius);
+    }
+    countEvent(PipelineCounter::KEYPOINTS_FOUND, keypoints.size());
+}
+
+
+const vector<float>& Pipeline::imageHistogram() const
+{
+    return lastImageHistogram;
+}
+
+
+const vector<float>& Pipeline::gammaHistogram() const
+{
+    return lastGammaHistogram;
+}
+
+
+const Mat& Pipeline::binaryImage() const
+{
+    return lastBinaryImage;
+}
+
+
+const BitMask& Pipeline::bitMask() const
+{
+    return lastBitMask;
+}
+
+
+bool Pipeline::lastImageClean() const
+{
+    return lastClean;
+}
+
+
+const CoarseToFineStats& Pipeline::coarseToFineStats() const
+{
+    return lastCoarseToFineStats;
+}
+
+
+const PipelineSettings& Pipeline::settings() const
+{
+    return pipelineSettings;
+}
+
+}
@@ -0,0 +1,145 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyPipeline_hpp
+#define parsleyPipeline_hpp
+
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include "parsleyLib.hpp"
+#include "parsleyThreshold.hpp"
+#include "parsleyPyramid.hpp"
+#include "parsleyBitMask.hpp"
+#include "parsleyColor.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ Settings of a Pipeline, the defaults are the ones of processImage.
+ */
+struct PipelineSettings
+{
+    double gamma = 1.5;   // a value between 1.0 and 3.0 is recommended
+    float minArea = 1500; // smallest impurity, in pixels
+    DetectorEngine engine = DetectorEngine::SIMPLE_BLOB;
+    bool trackThreshold = false; // consecutive images of the same scene: thresholding value from a ThresholdEstimator, searched again only on histogram drift
+    double driftBound = 0.05;    // see ThresholdEstimator
+    int coarseLevels = 0;        // if above 0 thresholding value and candidate regions come from the image downscaled by 2^coarseLevels, see detectCoarseToFine
+    double cleanFrameMargin = 0; // if above 0 images passing the sampled clean frame check (see isCleanFrame) are reported without detections, skipping the rest of the pipeline
+    int cleanFrameStride = 4;    // sampling step of the clean frame check
+};
+
+
+/**
+ What a Pipeline found in an image. Passed again to the next process call, its vectors keep their memory.
+ */
+struct DetectionResult
+{
+    std::vector<cv::Point2f> centers;   // (pixelCol, pixelRow) of each detected object
+    std::vector<float> areas;           // area in pixels of each detected object (estimated from the blob size with the blob engine)
+    std::vector<cv::RotatedRect> boxes; // rotated bounding boxes: with the blob engine the contours rectangles containing a detected center, not always one per object
+    double thresholdingValue = -1;      // the value used: if the slope search fails the last valid one (tracking) or the Otsu one
+
+    /**
+     Empties the result, keeping the memory of its vectors.
+     */
+    void clear();
+};
+
+
+/**
+ Long lived detection pipeline: gamma correction with histograms, adaptive threshold, binarization and detection.
+
+ Owns its blob detector, built once, and all the working buffers: processing images of the same size one after the other the pipeline reuses its own memory (allocations left are the ones inside the OpenCV detection calls).
+ A Pipeline is not thread safe, use one per thread.
+ */
+class Pipeline
+{
+public:
+    /**
+     @param settings gamma, minArea and detection engine
+     */
+    explicit Pipeline(const PipelineSettings& settings = PipelineSettings());
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    /**
+     Detects the impurities in a grayscale image.
+
+     @param image the CV_8U image to process
+     @param result where to save the detections, its previous content is replaced
+     @param gammaImage if not null where to save the gamma corrected image (only needed for debugging)
+     */
+    void process(const cv::Mat& image, DetectionResult& result, cv::Mat* gammaImage = nullptr);
+
+    /**
+     Detects the impurities in a color image, classifying its pixels with a color lookup table instead of gamma correction and thresholding.
+     The binary image feeds the same detection engine (the bit mask engine labels it as components), histograms are not computed and result.thresholdingValue is -1.
+
+     @param colorImage the CV_8UC3 BGR image to process
+     @param classifier a trained color classifier
+     @param result where to save the detections, its previous content is replaced
+     */
+    void processColor(const cv::Mat& colorImage, const ColorClassifier& classifier, DetectionResult& result);
+
+    /**
+     Histogram of the last processed image, before the gamma correction (with coarse to fine detection the one of the downscaled image, scaled to the image pixel count). Empty after processColor.
+     */
+    const std::vector<float>& imageHistogram() const;
+
+    /**
+     Histogram of the last processed image, after the gamma correction. Empty after processColor.
+     */
+    const std::vector<float>& gammaHistogram() const;
+
+    /**
+     Binary image of the last processed image. Overwritten by the next process call: clone it to keep it.
+     With coarse to fine detection it is black outside the candidate regions. Empty with the bit mask engine, see bitMask.
+     */
+    const cv::Mat& binaryImage() const;
+
+    /**
+     Bit packed mask of the last processed image, with the bit mask engine (without coarse to fine detection).
+     */
+    const BitMask& bitMask() const;
+
+    /**
+     True if the last processed image was reported clean by the sampled clean frame check: histograms and binary image are then empty.
+     */
+    bool lastImageClean() const;
+
+    /**
+     Candidate regions of the last processed image, with coarse to fine detection.
+     */
+    const CoarseToFineStats& coarseToFineStats() const;
+
+    const PipelineSettings& settings() const;
+
+private:
+    // keypoints and boxes of lastBinaryImage with the detection engine
+    void detectBinaryImage(DetectionResult& result);
+    // centers and areas of the result from the keypoints
+    void keypointsToResult(DetectionResult& result);
+
+    PipelineSettings pipelineSettings;
+    cv::SimpleBlobDetector::Params parameters;
+    cv::Ptr<cv::SimpleBlobDetector> blobDetector;
+
+    std::vector<float> lastImageHistogram;
+    std::vector<float> lastGammaHistogram;
+    cv::Mat lastBinaryImage;
+    cv::Mat lastCoarseImage;
+    BitMask lastBitMask;
+    CoarseToFineStats lastCoarseToFineStats;
+    std::vector<cv::KeyPoint> keypoints;
+    DetectionBuffers buffers;
+    RunLabelingBuffers runBuffers;
+    bool lastClean = false;
+    ThresholdEstimator thresholdEstimator; // used only if pipelineSettings.trackThreshold
+};
+
+}
+#endif /* parsleyPipeline_hpp */
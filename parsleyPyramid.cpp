@@ -0,0 +1,155 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyPyramid.hpp"
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+void downscaleToLevel(const Mat& image, int levels, Mat& coarseImage)
+{
+    const int scale = 1 << levels;
+    Size coarseSize(max(1, image.cols / scale), max(1, image.rows / scale));
+    resize(image, coarseImage, coarseSize, 0, 0, INTER_AREA);
+}
+
+
+void scaleHistogramToFullSize(vector<float>& histogram, Size fullSize, Size coarseSize)
+{
+    float ratio = (float)((double)fullSize.area() / coarseSize.area());
+    for(int i=0; i<histogram.size(); ++i)
+        histogram[i] *= ratio;
+}
+
+
+// Merges the overlapping regions, until none overlaps. A merged region covering pixels that it did not cover before is marked pending.
+static void mergeOverlappingRegions(vector<Rect>& regions, vector<uchar>& pending)
+{
+    bool merged = true;
+    while(merged)
+    {
+        merged = false;
+        for(int i=0; i<regions.size(); ++i)
+            for(int j=(int)regions.size()-1; j>i; --j)
+                if((regions[i] & regions[j]).area() > 0)
+                {
+                    Rect mergedRegion = regions[i] | regions[j];
+                    pending[i] = pending[i] || mergedRegion != regions[i];
+                    regions[i] = mergedRegion;
+                    regions.erase(regions.begin() + j);
+                    pending.erase(pending.begin() + j);
+                    merged = true;
+                }
+    }
+}
+
+
+// Grows region on each side where its binary image has white pixels on the border (unless it is the image border). False if there is none.
+static bool growCutRegion(const Mat& binaryImage, Rect& region, int margin)
+{
+    const Mat roi = binaryImage(region);
+    const Rect imageRect(0, 0, binaryImage.cols, binaryImage.rows);
+    bool top = region.y > 0 && countNonZero(roi.row(0)) > 0;
+    bool bottom = region.y + region.height < binaryImage.rows && countNonZero(roi.row(roi.rows - 1)) > 0;
+    bool left = region.x > 0 && countNonZero(roi.col(0)) > 0;
+    bool right = region.x + region.width < binaryImage.cols && countNonZero(roi.col(roi.cols - 1)) > 0;
+    if(!(top || bottom || left || right))
+        return false;
+
+    int x0 = region.x - (left ? margin : 0), y0 = region.y - (top ? margin : 0);
+    int x1 = region.x + region.width + (right ? margin : 0), y1 = region.y + region.height + (bottom ? margin : 0);
+    region = Rect(x0, y0, x1 - x0, y1 - y0) & imageRect;
+    return true;
+}
+
+
+void detectCoarseToFine(const Mat& image, const Mat& coarseImage, int levels, double gamma, double thresholdingValue, const SimpleBlobDetector::Params& parameters, DetectorEngine engine, Ptr<SimpleBlobDetector> blobDetector, DetectionBuffers& buffers, Mat& binaryImage, vector<KeyPoint>& keypoints, vector<RotatedRect>& boundingRects, CoarseToFineStats* stats)
+{
+    CV_Assert(image.type() == CV_8UC1 && coarseImage.type() == CV_8UC1);
+    const int scale = 1 << levels;
+    const int margin = 2 * scale;
+    const Rect imageRect(0, 0, image.cols, image.rows);
+
+    // candidate mask and its components on the pyramid level
+    gammaToBinaryImage(coarseImage, gamma, thresholdingValue, buffers.coarseBinary);
+    int nLabels = connectedComponentsWithStats(buffers.coarseBinary, buffers.coarseLabels, buffers.coarseStats, buffers.coarseCentroids, 8, CV_32S);
+
+    // areas scale with the square of the side; half of it because downscaling blurs the impurities edges
+    const double coarseMinArea = parameters.filterByArea ? parameters.minArea / (double)(scale * scale) / 2 : 0;
+    vector<Rect>& regions = buffers.regions;
+    regions.clear();
+    for(int label=1; label<nLabels; ++label)
+    {
+        const Mat& coarseStats = buffers.coarseStats;
+        if(coarseStats.at<int>(label, CC_STAT_AREA) < coarseMinArea)
+            continue;
+        Rect region(coarseStats.at<int>(label, CC_STAT_LEFT) * scale - margin, coarseStats.at<int>(label, CC_STAT_TOP) * scale - margin, coarseStats.at<int>(label, CC_STAT_WIDTH) * scale + 2 * margin, coarseStats.at<int>(label, CC_STAT_HEIGHT) * scale + 2 * margin);
+        regions.push_back(region & imageRect);
+    }
+    vector<uchar> pending(regions.size(), 1); // regions still to binarize
+    mergeOverlappingRegions(regions, pending);
+
+    // full resolution only inside the regions: the binary image stays black elsewhere
+    // a region cutting an object is grown, by a margin doubling at each attempt, and merged with the regions it then overlaps, until no region cuts an object:
+    // each object lies whole inside a single region, so it is never truncated nor detected twice
+    binaryImage.create(image.size(), CV_8U);
+    binaryImage.setTo(Scalar(0));
+    for(int growth=margin; ; growth*=2)
+    {
+        bool grown = false;
+        for(int r=0; r<regions.size(); ++r)
+        {
+            if(!pending[r])
+                continue;
+            Mat regionBinary = binaryImage(regions[r]); // written in place
+            gammaToBinaryImage(image(regions[r]), gamma, thresholdingValue, regionBinary);
+            pending[r] = growCutRegion(binaryImage, regions[r], growth);
+            grown = grown || pending[r];
+        }
+        if(!grown)
+            break;
+        mergeOverlappingRegions(regions, pending);
+    }
+
+    keypoints.clear();
+    boundingRects.clear();
+    vector<KeyPoint> regionKeypoints;
+    vector<RotatedRect> regionRects;
+    int64 refinedPixels = 0;
+    for(int r=0; r<regions.size(); ++r)
+    {
+        const Rect& region = regions[r];
+        refinedPixels += region.area();
+
+        if(engine != DetectorEngine::SIMPLE_BLOB) // regions are CV_8U views: the bit mask engine labels them as components
+            detectComponentRects(binaryImage(region), parameters, buffers, regionKeypoints, regionRects);
+        else
+            detectBoundingRects(blobDetector, binaryImage(region), buffers, regionKeypoints, regionRects);
+
+        // back to image coordinates
+        Point2f offset((float)region.x, (float)region.y);
+        for(int i=0; i<regionKeypoints.size(); ++i)
+        {
+            regionKeypoints[i].pt += offset;
+            keypoints.push_back(regionKeypoints[i]);
+        }
+        for(int i=0; i<regionRects.size(); ++i)
+        {
+            regionRects[i].center += offset;
+            boundingRects.push_back(regionRects[i]);
+        }
+    }
+
+    if(stats)
+    {
+        stats->candidateRegions = regions.size();
+        stats->refinedFraction = image.total() ? (double)refinedPixels / image.total() : 0.0;
+    }
+}
+
+}
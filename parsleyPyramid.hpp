@@ -0,0 +1,70 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyPyramid_hpp
+#define parsleyPyramid_hpp
+
+#include <cstddef>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include "parsleyLib.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ How much of the image the last coarse to fine detection refined at full resolution.
+ */
+struct CoarseToFineStats
+{
+    std::size_t candidateRegions = 0; // regions refined at full resolution, after merging the overlapping ones
+    double refinedFraction = 0.0;     // fraction of the image pixels binarized at full resolution
+};
+
+
+/**
+ Downscales an image to a pyramid level, averaging each 2^levels x 2^levels block (so that intensities, and the histogram shape, are preserved).
+
+ @param image the CV_8U image
+ @param levels number of halvings
+ @param coarseImage where to save the downscaled image
+ */
+void downscaleToLevel(const cv::Mat& image, int levels, cv::Mat& coarseImage);
+
+
+/**
+ Histogram of a pyramid level scaled to the pixel count of the full resolution image, as getAdaptiveThreshValue expects (its slope bound is in pixels).
+
+ @param histogram the histogram to scale, in place
+ @param fullSize the full resolution image size
+ @param coarseSize the pyramid level size
+ */
+void scaleHistogramToFullSize(std::vector<float>& histogram, cv::Size fullSize, cv::Size coarseSize);
+
+
+/**
+ Coarse to fine detection: candidate regions come from the binarized pyramid level, binarization and detection run at full resolution only inside them.
+
+ Candidates are the coarse components whose area reaches minArea scaled to the level (divided by 4^levels, halved to absorb the blur of the downscaling). Their bounding boxes, scaled back and dilated by 2^(levels+1) pixels, are merged when overlapping.
+ A region whose full resolution binary image has white pixels on its border (an object cut by the region) is grown, by a margin doubling at each attempt, merged with the regions it then overlaps and binarized again, until no region cuts an object: each object lies whole inside a single region, so it is neither truncated nor detected twice.
+ Impurities are sparse: most of the image is never binarized nor scanned by the detector at full resolution.
+
+ @param image the full resolution CV_8U image
+ @param coarseImage the image downscaled by downscaleToLevel
+ @param levels the pyramid level of coarseImage
+ @param gamma gamma value of the correction
+ @param thresholdingValue the thresholding value, applied at both resolutions
+ @param parameters the detection parameters (see instantiateBlobParams)
+ @param engine the detection algorithm
+ @param blobDetector the detector built from parameters, used by the blob engine only
+ @param buffers working buffers, reused across calls
+ @param binaryImage where to save the full resolution binary image: black outside the candidate regions
+ @param keypoints where to save the detected keypoints, in image coordinates
+ @param boundingRects where to save the rotated bounding rectangles, in image coordinates
+ @param stats if not null where to save the refined regions count and fraction
+ */
+void detectCoarseToFine(const cv::Mat& image, const cv::Mat& coarseImage, int levels, double gamma, double thresholdingValue, const cv::SimpleBlobDetector::Params& parameters, DetectorEngine engine, cv::Ptr<cv::SimpleBlobDetector> blobDetector, DetectionBuffers& buffers, cv::Mat& binaryImage, std::vector<cv::KeyPoint>& keypoints, std::vector<cv::RotatedRect>& boundingRects, CoarseToFineStats* stats = nullptr);
+
+}
+#endif /* parsleyPyramid_hpp */
@@ -0,0 +1,109 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyQueue_hpp
+#define parsleyQueue_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+namespace parsleyLib{
+
+
+/**
+ What a BoundedQueue does when a new item arrives and the queue is full.
+ */
+enum class FrameDropPolicy
+{
+    BLOCK,       // the producer waits (backpressure up to the frame source)
+    DROP_OLDEST, // the oldest queued item is discarded to make room for the new one
+    DROP_NEWEST  // the new item is discarded
+};
+
+
+/**
+ A fixed capacity FIFO queue connecting a producer and a consumer thread, e.g. two stages of the streaming pipeline.
+
+ The producer side applies a FrameDropPolicy when the queue is full. After close() pushes are rejected and pop() returns false once the queue is drained.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(std::size_t capacity, FrameDropPolicy policy) : capacity(capacity > 0 ? capacity : 1), policy(policy), dropped(0), closed(false) {}
+
+    /**
+     Adds an item to the queue.
+
+     @return false if an item (the new one or the oldest one, depending on the policy) was dropped or the queue is closed
+     */
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(policy == FrameDropPolicy::BLOCK)
+            notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+        if(closed)
+            return false;
+
+        bool accepted = true;
+        if(items.size() >= capacity)
+        {
+            ++dropped;
+            accepted = false;
+            if(policy == FrameDropPolicy::DROP_NEWEST)
+                return false;
+            items.pop_front(); // DROP_OLDEST
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return accepted;
+    }
+
+    /**
+     Takes the oldest item, waiting for one if the queue is empty.
+
+     @return false if the queue is closed and there is nothing left to take
+     */
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]{ return closed || !items.empty(); });
+        if(items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     Rejects further pushes and wakes up every waiting thread; queued items can still be popped.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    std::size_t droppedCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dropped;
+    }
+
+private:
+    std::size_t capacity;
+    FrameDropPolicy policy;
+    std::size_t dropped;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+}
+#endif /* parsleyQueue_hpp */
@@ -0,0 +1,399 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "parsleyRaster.hpp"
+#include "parsleyMetrics.hpp"
+#include "parsleyPipeline.hpp"
+#include "parsleyResults.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+RasterScanDetector::RasterScanDetector(int width, double gamma, float minArea, int calibrationRows, int imageRows)
+    : imageWidth(width), gamma(gamma), parameters(instantiateBlobParams()), calibrationRows(max(1, calibrationRows)), imageRows(imageRows),
+      threshold(-1), rowCount(0), maxOpenBlobs(0), maxWorkingBytes(0)
+{
+    parameters.minArea = minArea;
+}
+
+
+void RasterScanDetector::addRows(const Mat& band, vector<RasterBlob>& finished)
+{
+    CV_Assert(band.type() == CV_8UC1 && band.cols == imageWidth);
+    if(threshold < 0)
+    {
+        // held back until the calibration band is complete
+        calibrationBand.push_back(band);
+        if(calibrationBand.rows >= calibrationRows)
+        {
+            calibrate();
+            labelBand(calibrationBand, finished);
+            calibrationBand.release();
+        }
+    }
+    else
+        labelBand(band, finished);
+    updateWorkingBytes();
+}
+
+
+void RasterScanDetector::finish(vector<RasterBlob>& finished)
+{
+    if(threshold < 0 && !calibrationBand.empty()) // an image shorter than the calibration band
+    {
+        calibrate();
+        labelBand(calibrationBand, finished);
+        calibrationBand.release();
+    }
+    for(int i=0; i<openList.size(); ++i)
+        completeBlob(openList[i], finished);
+    openList.clear();
+    previousRuns.clear();
+    previousBlobs.clear();
+    updateWorkingBytes();
+}
+
+
+void RasterScanDetector::calibrate()
+{
+    vector<float> imageHistogram, gammaHistogram;
+    fusedGammaHistogram(calibrationBand, gamma, imageHistogram, gammaHistogram);
+
+    // as if taken on the whole image, or on a 4:3 frame of the same width when the height is unknown
+    double fullRows = (imageRows > 0) ? imageRows : imageWidth * 3.0 / 4.0;
+    float ratio = (float)(fullRows / calibrationBand.rows);
+    for(int i=0; i<gammaHistogram.size(); ++i)
+        gammaHistogram[i] *= ratio;
+
+    threshold = getAdaptiveThreshValue(gammaHistogram);
+    if(threshold < 0) // no slope big enough: -1 would turn the whole image white
+    {
+        countEvent(PipelineCounter::THRESHOLD_SEARCH_FAILURES);
+        threshold = otsuThreshValue(gammaHistogram);
+    }
+}
+
+
+int RasterScanDetector::newBlob()
+{
+    int blob;
+    if(freeBlobs.empty())
+    {
+        blob = (int)blobs.size();
+        blobs.push_back(OpenBlob());
+    }
+    else
+    {
+        blob = freeBlobs.back();
+        freeBlobs.pop_back();
+    }
+    OpenBlob& open = blobs[blob];
+    open.moments = PixelMoments();
+    open.parent = blob;
+    open.extremePoints.clear(); // keeps its memory
+    open.hullSize = 0;
+    return blob;
+}
+
+
+int RasterScanDetector::findBlob(int blob)
+{
+    while(blobs[blob].parent != blob)
+    {
+        blobs[blob].parent = blobs[blobs[blob].parent].parent; // path halving
+        blob = blobs[blob].parent;
+    }
+    return blob;
+}
+
+
+// Joins two open blobs, the one starting on the upper row survives (its moments origin is above the other one)
+void RasterScanDetector::mergeBlobs(int a, int b)
+{
+    if(blobs[b].box.y < blobs[a].box.y)
+        swap(a, b);
+    OpenBlob& survivor = blobs[a];
+    OpenBlob& merged = blobs[b];
+    survivor.moments.add(merged.moments, 0, merged.box.y - survivor.box.y);
+    survivor.box |= merged.box;
+    survivor.lastRow = max(survivor.lastRow, merged.lastRow);
+    survivor.extremePoints.insert(survivor.extremePoints.end(), merged.extremePoints.begin(), merged.extremePoints.end());
+    survivor.hullSize += merged.hullSize;
+    merged.parent = a;
+    mergedBlobs.push_back(b);
+}
+
+
+void RasterScanDetector::labelBand(const Mat& band, vector<RasterBlob>& finished)
+{
+    gammaToBitMask(band, gamma, threshold, bandMask);
+    for(int r=0; r<band.rows; ++r)
+    {
+        const int y = (int)rowCount++;
+        currentRuns.clear();
+        appendMaskRowRuns(bandMask, r, currentRuns);
+        currentBlobs.resize(currentRuns.size());
+
+        // both rows are sorted: the first previous run still reaching the current one only moves forward
+        int j = 0;
+        for(int i=0; i<currentRuns.size(); ++i)
+        {
+            const MaskRun& run = currentRuns[i];
+            while(j < previousRuns.size() && previousRuns[j].end < run.start) // 8-connectivity: a diagonal contact is enough
+                ++j;
+            int blob = -1;
+            for(int k=j; k<previousRuns.size() && previousRuns[k].start <= run.end; ++k)
+            {
+                int touched = findBlob(previousBlobs[k]);
+                if(blob < 0)
+                    blob = touched;
+                else if(touched != blob)
+                {
+                    mergeBlobs(blob, touched);
+                    blob = findBlob(blob);
+                }
+            }
+            if(blob < 0)
+            {
+                blob = newBlob();
+                blobs[blob].box = Rect(run.start, y, run.end - run.start, 1);
+                openList.push_back(blob);
+            }
+
+            OpenBlob& open = blobs[blob];
+            open.moments.addRun(run.start, run.end, y - open.box.y);
+            open.box |= Rect(run.start, y, run.end - run.start, 1);
+            open.lastRow = y;
+            open.extremePoints.push_back(Point(run.start, y));
+            open.extremePoints.push_back(Point(run.end - 1, y));
+            if(open.extremePoints.size() > 2 * open.hullSize + 256)
+            {
+                // the extremes of any linear function of the pixel coordinates are on the convex hull: the rest is dropped
+                convexHull(open.extremePoints, scratchPoints);
+                open.extremePoints.assign(scratchPoints.begin(), scratchPoints.end());
+                open.hullSize = scratchPoints.size();
+            }
+            currentBlobs[i] = blob;
+        }
+        for(int i=0; i<currentBlobs.size(); ++i)
+            currentBlobs[i] = findBlob(currentBlobs[i]);
+
+        // blobs without pixels on this row can not grow any more
+        int kept = 0;
+        for(int i=0; i<openList.size(); ++i)
+        {
+            int blob = openList[i];
+            if(blobs[blob].parent != blob) // merged into another open blob
+                continue;
+            if(blobs[blob].lastRow < y)
+            {
+                completeBlob(blob, finished);
+                freeBlobs.push_back(blob);
+            }
+            else
+                openList[kept++] = blob;
+        }
+        openList.resize(kept);
+        maxOpenBlobs = max(maxOpenBlobs, openList.size());
+
+        // no run refers to the merged slots any more
+        freeBlobs.insert(freeBlobs.end(), mergedBlobs.begin(), mergedBlobs.end());
+        mergedBlobs.clear();
+        swap(previousRuns, currentRuns);
+        swap(previousBlobs, currentBlobs);
+    }
+}
+
+
+void RasterScanDetector::completeBlob(int blob, vector<RasterBlob>& finished)
+{
+    const OpenBlob& open = blobs[blob];
+    countEvent(PipelineCounter::CONTOURS_FOUND);
+
+    // same bounds as SimpleBlobDetector: minArea included, maxArea excluded
+    if(parameters.filterByArea && (open.moments.n < parameters.minArea || open.moments.n >= parameters.maxArea))
+        return;
+
+    // moments and extremes relative to the bounding box, as detectComponentRects computes them: the same sums, so the same box
+    PixelMoments moments;
+    moments.add(open.moments, -open.box.x, 0);
+    scratchPoints.resize(open.extremePoints.size());
+    for(int i=0; i<open.extremePoints.size(); ++i)
+        scratchPoints[i] = open.extremePoints[i] - open.box.tl();
+
+    RasterBlob result;
+    result.box = orientedBoxFromMoments(moments, scratchPoints, open.box.tl(), result.center);
+    result.area = (float)open.moments.n;
+    result.lastRow = open.lastRow;
+    finished.push_back(result);
+}
+
+
+double RasterScanDetector::thresholdingValue() const
+{
+    return threshold;
+}
+
+
+size_t RasterScanDetector::rows() const
+{
+    return rowCount + calibrationBand.rows;
+}
+
+
+size_t RasterScanDetector::openBlobs() const
+{
+    return openList.size();
+}
+
+
+size_t RasterScanDetector::peakOpenBlobs() const
+{
+    return maxOpenBlobs;
+}
+
+
+size_t RasterScanDetector::peakWorkingBytes() const
+{
+    return maxWorkingBytes;
+}
+
+
+void RasterScanDetector::updateWorkingBytes()
+{
+    size_t bytes = calibrationBand.total() + bandMask.memoryBytes();
+    bytes += (previousRuns.capacity() + currentRuns.capacity()) * sizeof(MaskRun);
+    bytes += (previousBlobs.capacity() + currentBlobs.capacity() + freeBlobs.capacity() + openList.capacity() + mergedBlobs.capacity()) * sizeof(int);
+    bytes += blobs.capacity() * sizeof(OpenBlob) + scratchPoints.capacity() * sizeof(Point);
+    for(int i=0; i<blobs.size(); ++i)
+        bytes += blobs[i].extremePoints.capacity() * sizeof(Point);
+    maxWorkingBytes = max(maxWorkingBytes, bytes);
+}
+
+
+// Next number of a PGM header, skipping white space and comments
+static bool readPgmNumber(FILE* file, int& value)
+{
+    int c = fgetc(file);
+    while(c != EOF && (isspace(c) || c == '#'))
+    {
+        if(c == '#')
+            while(c != EOF && c != '\n')
+                c = fgetc(file);
+        c = fgetc(file);
+    }
+    value = 0;
+    bool digits = false;
+    for( ; c != EOF && isdigit(c); c = fgetc(file))
+    {
+        value = value * 10 + (c - '0');
+        digits = true;
+    }
+    return digits && c != EOF && isspace(c); // a single white space character ends the header
+}
+
+
+bool readPgmHeader(FILE* file, int& width, int& height)
+{
+    int maxValue = 0;
+    return fgetc(file) == 'P' && fgetc(file) == '5' && readPgmNumber(file, width) && readPgmNumber(file, height) && readPgmNumber(file, maxValue) && width > 0 && maxValue > 0 && maxValue < 256;
+}
+
+
+size_t processRasterScan(const string& inputPath, const RasterScanOptions& options, ResultSink* sink)
+{
+    double ticks = (double) getTickCount();
+    const bool fromStdin = (inputPath == "-");
+
+    // a PGM file is read band by band, any other image is decoded whole
+    FILE* file = fromStdin ? stdin : fopen(inputPath.c_str(), "rb");
+    int width = 0, height = 0;
+    Mat decoded;
+    if(!file || !readPgmHeader(file, width, height))
+    {
+        if(file && !fromStdin)
+            fclose(file);
+        file = nullptr;
+        if(fromStdin)
+        {
+            cerr << "The standard input is not a binary PGM stream" << endl;
+            return 0;
+        }
+        decoded = imread(inputPath, IMREAD_GRAYSCALE);
+        if(decoded.empty())
+        {
+            cerr << "Unable to read: " << inputPath << endl;
+            return 0;
+        }
+        width = decoded.cols;
+        height = decoded.rows;
+    }
+
+    const int bandRows = max(1, options.bandRows);
+    RasterScanDetector detector(width, options.gamma, options.minArea, options.calibrationRows, height);
+    Mat band(bandRows, width, CV_8U);
+    vector<RasterBlob> finished;
+    DetectionResult result;
+    size_t objects = 0;
+    bool lastBand = false;
+    for(int row=0; !lastBand; row+=bandRows)
+    {
+        int rows = 0;
+        if(file)
+        {
+            // a line scan feed may end before the height in its header
+            rows = min(bandRows, height - row);
+            rows = (rows > 0) ? (int)(fread(band.data, width, rows, file)) : 0;
+            if(rows > 0)
+                detector.addRows(band.rowRange(0, rows), finished);
+        }
+        else
+        {
+            rows = min(bandRows, height - row);
+            if(rows > 0)
+                detector.addRows(decoded.rowRange(row, row + rows), finished);
+        }
+        lastBand = (rows < bandRows);
+        if(lastBand)
+            detector.finish(finished);
+
+        for(int i=0; i<finished.size(); ++i, ++objects)
+        {
+            if(options.verbose)
+                cout << "Object " << objects << " : (" << (int)finished[i].center.x << ", " << (int)finished[i].center.y << "), area " << finished[i].area << ", complete at row " << finished[i].lastRow << '\n';
+            if(sink)
+            {
+                result.centers.push_back(finished[i].center);
+                result.areas.push_back(finished[i].area);
+                result.boxes.push_back(finished[i].box);
+            }
+        }
+        finished.clear();
+    }
+    if(file && !fromStdin)
+        fclose(file);
+    countEvent(PipelineCounter::KEYPOINTS_FOUND, objects);
+    countEvent(PipelineCounter::IMAGES_PROCESSED);
+
+    result.thresholdingValue = detector.thresholdingValue();
+    if(sink)
+        sink->write(0, inputPath, result);
+
+    double elapsedTime = ((double)getTickCount() - ticks) / getTickFrequency();
+    cout << detector.rows() << " rows, " << objects << " detected objects, thresholding value " << detector.thresholdingValue() << endl;
+    cout << "Peak open blobs: " << detector.peakOpenBlobs() << ", peak working memory: " << detector.peakWorkingBytes() / 1024.0 << " KB" << endl;
+    cout << "Execution time: " << elapsedTime << " seconds (" << (elapsedTime > 0 ? detector.rows() / elapsedTime : 0.0) << " rows/s)" << endl;
+    return objects;
+}
+
+}
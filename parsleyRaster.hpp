@@ -0,0 +1,154 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyRaster_hpp
+#define parsleyRaster_hpp
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "parsleyLib.hpp"
+#include "parsleyBitMask.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ An object found by RasterScanDetector, with the same values detectComponentRects gives for it.
+ */
+struct RasterBlob
+{
+    cv::Point2f center;   // centroid, (pixelCol, pixelRow)
+    float area = 0;       // in pixels
+    cv::RotatedRect box;  // oriented bounding box, along the principal axes
+    int lastRow = 0;      // row after which the blob was complete
+};
+
+
+/**
+ Single pass raster scan detector: the image is fed a band of rows at a time, from top to bottom, and each object is reported as soon as the row after its last one has been seen.
+
+ The first calibrationRows rows are held back to compute the thresholding value on their histogram (getAdaptiveThreshValue, Otsu as fallback), then every band is gamma corrected and thresholded into a BitMask and its runs of white pixels are joined to the runs of the previous row with a union find over the open blobs (8-connectivity).
+ Each open blob keeps its moments and the convex hull of its row extremes, enough for the same area, centroid and oriented box of detectComponentRects (same minArea/maxArea filter).
+ Memory grows with the image width and the number of open blobs, never with the image height.
+ */
+class RasterScanDetector
+{
+public:
+    /**
+     @param width the image width
+     @param gamma gamma value of the correction
+     @param minArea smallest impurity, in pixels
+     @param calibrationRows rows whose histogram gives the thresholding value
+     @param imageRows the image height if known, 0 otherwise: the calibration histogram is scaled to the whole image pixel count, as getAdaptiveThreshValue expects
+     */
+    RasterScanDetector(int width, double gamma = 1.5, float minArea = 1500, int calibrationRows = 256, int imageRows = 0);
+
+    /**
+     Feeds the next rows of the image.
+
+     @param band CV_8U rows of the image width, following the rows fed before
+     @param finished where to append the blobs completed by these rows
+     */
+    void addRows(const cv::Mat& band, std::vector<RasterBlob>& finished);
+
+    /**
+     Ends the image: the blobs still open are completed.
+
+     @param finished where to append them
+     */
+    void finish(std::vector<RasterBlob>& finished);
+
+    /** @return the thresholding value in use, -1 until the calibration band has been seen */
+    double thresholdingValue() const;
+
+    std::size_t rows() const;          // rows fed so far
+    std::size_t openBlobs() const;     // blobs not yet completed
+    std::size_t peakOpenBlobs() const;
+
+    /** @return the largest working memory used so far, in bytes (buffers capacity) */
+    std::size_t peakWorkingBytes() const;
+
+private:
+    struct OpenBlob
+    {
+        PixelMoments moments;              // relative to (0, firstRow)
+        cv::Rect box;
+        int lastRow = 0;
+        int parent = 0;                    // union find over the blob slots, merged blobs point to the survivor
+        std::vector<cv::Point> extremePoints; // first and last pixel of its rows, pruned to their convex hull
+        std::size_t hullSize = 0;          // extreme points left by the last pruning
+    };
+
+    void calibrate();
+    void labelBand(const cv::Mat& band, std::vector<RasterBlob>& finished);
+    int newBlob();
+    int findBlob(int blob);
+    void mergeBlobs(int a, int b);
+    void completeBlob(int blob, std::vector<RasterBlob>& finished);
+    void updateWorkingBytes();
+
+    int imageWidth;
+    double gamma;
+    cv::SimpleBlobDetector::Params parameters;
+    int calibrationRows;
+    int imageRows;
+    double threshold;
+    std::size_t rowCount;
+
+    cv::Mat calibrationBand;             // rows held back until the thresholding value is known
+    BitMask bandMask;
+    std::vector<MaskRun> previousRuns, currentRuns;
+    std::vector<int> previousBlobs, currentBlobs; // blob slot of each run
+    std::vector<OpenBlob> blobs;         // slots, reused once free
+    std::vector<int> freeBlobs;
+    std::vector<int> openList;           // open blob roots
+    std::vector<int> mergedBlobs;        // slots merged into another blob during the current row, freed at its end
+    std::vector<cv::Point> scratchPoints;
+    std::size_t maxOpenBlobs;
+    std::size_t maxWorkingBytes;
+};
+
+
+/**
+ Reads the header of a binary 8 bit PGM (P5) file, leaving the file at the first pixel.
+
+ @param file the file to read
+ @param width where to save the image width
+ @param height where to save the image height
+ @return false if the file is not a binary 8 bit PGM
+ */
+bool readPgmHeader(FILE* file, int& width, int& height);
+
+
+/**
+ Settings of processRasterScan().
+ */
+struct RasterScanOptions
+{
+    double gamma = 1.5;
+    float minArea = 1500;
+    int calibrationRows = 256; // leading rows giving the thresholding value
+    int bandRows = 64;         // rows read and thresholded together
+    bool verbose = true;       // prints each object as soon as it is complete
+};
+
+
+/**
+ Streams an image through a RasterScanDetector, a band of rows at a time.
+
+ A binary PGM (P5, 8 bit) file, or "-" for a PGM stream on standard input (e.g. a line scan camera feed), is read band by band: memory does not depend on the image height.
+ Any other format is decoded whole by OpenCV (it has no row by row decoding) and then fed band by band, so the image must fit in memory.
+ Prints to console the objects as they are completed and, at the end, the rows, objects, peak open blobs and peak working memory.
+
+ @param inputPath the image file, or "-" for standard input
+ @param options the raster scan settings
+ @param sink if not null where to save all the detections, as a single record at the end
+ @return the number of detected objects
+ */
+std::size_t processRasterScan(const std::string& inputPath, const RasterScanOptions& options = RasterScanOptions(), ResultSink* sink = nullptr);
+
+}
+#endif /* parsleyRaster_hpp */
@@ -0,0 +1,434 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+
+#include "parsleyResults.hpp"
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+static const char binaryResultsMagic[8] = {'P', 'R', 'S', 'L', 'R', 'E', 'S', '1'};
+static const size_t recordHeaderSize = 8 + 8 + 4 + 4;
+static const size_t objectRecordSize = 3 * 4;
+static const size_t boxRecordSize = 5 * 4;
+
+BufferedFileWriter::BufferedFileWriter(size_t bufferSize)
+    : file(nullptr), buffer(max(bufferSize, (size_t)1)), used(0), failed(false)
+{
+}
+
+
+BufferedFileWriter::~BufferedFileWriter()
+{
+    close();
+}
+
+
+bool BufferedFileWriter::open(const string& path)
+{
+    close();
+    file = fopen(path.c_str(), "wb");
+    failed = false;
+    return file != nullptr;
+}
+
+
+void BufferedFileWriter::append(const void* data, size_t size)
+{
+    if(!file)
+        return;
+    if(used + size > buffer.size())
+    {
+        flush();
+        if(size > buffer.size()) // bigger than the whole buffer: written straight to the file
+        {
+            failed = failed || fwrite(data, 1, size, file) != size;
+            return;
+        }
+    }
+    memcpy(buffer.data() + used, data, size);
+    used += size;
+}
+
+
+bool BufferedFileWriter::flush()
+{
+    if(!file)
+        return false;
+    if(used > 0)
+        failed = failed || fwrite(buffer.data(), 1, used, file) != used;
+    used = 0;
+    failed = failed || fflush(file) != 0;
+    return !failed;
+}
+
+
+bool BufferedFileWriter::close()
+{
+    if(!file)
+        return false;
+    bool succeeded = flush();
+    succeeded = (fclose(file) == 0) && succeeded;
+    file = nullptr;
+    return succeeded;
+}
+
+
+// Adds a JSON string, escaping quotes, backslashes and control characters
+static void appendJsonString(string& json, const string& text)
+{
+    json += '"';
+    for(int i=0; i<text.size(); ++i)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if(c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += (char)c;
+        }
+        else if(c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        }
+        else
+            json += (char)c;
+    }
+    json += '"';
+}
+
+
+// Adds a number with enough digits for sub-pixel coordinates and large areas
+static void appendJsonNumber(string& json, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.8g", value);
+    json += number;
+}
+
+
+bool NdjsonResultSink::open(const string& path)
+{
+    lock_guard<mutex> lock(writeMutex);
+    return file.open(path);
+}
+
+
+void NdjsonResultSink::write(uint64_t frameId, const string& name, const DetectionResult& result)
+{
+    // formatted outside the lock, each thread reuses its own line
+    thread_local string line;
+    line.clear();
+    line += "{\"frame\":";
+    line += to_string(frameId);
+    line += ",\"name\":";
+    appendJsonString(line, name);
+    line += ",\"threshold\":";
+    appendJsonNumber(line, result.thresholdingValue);
+    line += ",\"objects\":[";
+    for(int i=0; i<result.centers.size(); ++i)
+    {
+        line += i ? ",{\"x\":" : "{\"x\":";
+        appendJsonNumber(line, result.centers[i].x);
+        line += ",\"y\":";
+        appendJsonNumber(line, result.centers[i].y);
+        line += ",\"area\":";
+        appendJsonNumber(line, result.areas[i]);
+        line += '}';
+    }
+    line += "],\"boxes\":[";
+    for(int i=0; i<result.boxes.size(); ++i)
+    {
+        const RotatedRect& box = result.boxes[i];
+        line += i ? ",{\"cx\":" : "{\"cx\":";
+        appendJsonNumber(line, box.center.x);
+        line += ",\"cy\":";
+        appendJsonNumber(line, box.center.y);
+        line += ",\"width\":";
+        appendJsonNumber(line, box.size.width);
+        line += ",\"height\":";
+        appendJsonNumber(line, box.size.height);
+        line += ",\"angle\":";
+        appendJsonNumber(line, box.angle);
+        line += '}';
+    }
+    line += "]}\n";
+
+    lock_guard<mutex> lock(writeMutex);
+    file.append(line.data(), line.size());
+}
+
+
+bool NdjsonResultSink::flush()
+{
+    lock_guard<mutex> lock(writeMutex);
+    return file.flush();
+}
+
+
+static void putLittleEndian(unsigned char*& out, uint64_t value, int bytes)
+{
+    for(int i=0; i<bytes; ++i)
+        *out++ = (unsigned char)(value >> (8 * i));
+}
+
+
+static void putFloat32(unsigned char*& out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putLittleEndian(out, bits, 4);
+}
+
+
+static uint64_t getLittleEndian(const unsigned char*& in, int bytes)
+{
+    uint64_t value = 0;
+    for(int i=0; i<bytes; ++i)
+        value |= (uint64_t)(*in++) << (8 * i);
+    return value;
+}
+
+
+static float getFloat32(const unsigned char*& in)
+{
+    uint32_t bits = (uint32_t)getLittleEndian(in, 4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+
+bool BinaryResultSink::open(const string& path)
+{
+    lock_guard<mutex> lock(writeMutex);
+    if(!file.open(path))
+        return false;
+    file.append(binaryResultsMagic, sizeof(binaryResultsMagic));
+    return true;
+}
+
+
+void encodeResultRecord(uint64_t frameId, const DetectionResult& result, vector<unsigned char>& record)
+{
+    record.resize(recordHeaderSize + result.centers.size() * objectRecordSize + result.boxes.size() * boxRecordSize);
+    unsigned char* out = record.data();
+    uint64_t thresholdBits;
+    memcpy(&thresholdBits, &result.thresholdingValue, sizeof(thresholdBits));
+    putLittleEndian(out, frameId, 8);
+    putLittleEndian(out, thresholdBits, 8);
+    putLittleEndian(out, result.centers.size(), 4);
+    putLittleEndian(out, result.boxes.size(), 4);
+    for(int i=0; i<result.centers.size(); ++i)
+    {
+        putFloat32(out, result.centers[i].x);
+        putFloat32(out, result.centers[i].y);
+        putFloat32(out, result.areas[i]);
+    }
+    for(int i=0; i<result.boxes.size(); ++i)
+    {
+        putFloat32(out, result.boxes[i].center.x);
+        putFloat32(out, result.boxes[i].center.y);
+        putFloat32(out, result.boxes[i].size.width);
+        putFloat32(out, result.boxes[i].size.height);
+        putFloat32(out, result.boxes[i].angle);
+    }
+}
+
+
+size_t decodeResultRecord(const unsigned char* data, size_t size, ResultRecord& record)
+{
+    if(size < recordHeaderSize)
+        return 0;
+    const unsigned char* in = data;
+    record.frameId = getLittleEndian(in, 8);
+    uint64_t thresholdBits = getLittleEndian(in, 8);
+    memcpy(&record.result.thresholdingValue, &thresholdBits, sizeof(thresholdBits));
+    size_t objectCount = (size_t)getLittleEndian(in, 4);
+    size_t boxCount = (size_t)getLittleEndian(in, 4);
+    if(size - recordHeaderSize < objectCount * objectRecordSize + boxCount * boxRecordSize)
+        return 0;
+
+    DetectionResult& result = record.result;
+    result.centers.resize(objectCount);
+    result.areas.resize(objectCount);
+    result.boxes.resize(boxCount);
+    for(int i=0; i<objectCount; ++i)
+    {
+        result.centers[i].x = getFloat32(in);
+        result.centers[i].y = getFloat32(in);
+        result.areas[i] = getFloat32(in);
+    }
+    for(int i=0; i<boxCount; ++i)
+    {
+        result.boxes[i].center.x = getFloat32(in);
+        result.boxes[i].center.y = getFloat32(in);
+        result.boxes[i].size.width = getFloat32(in);
+        result.boxes[i].size.height = getFloat32(in);
+        result.boxes[i].angle = getFloat32(in);
+    }
+    return in - data;
+}
+
+
+void BinaryResultSink::write(uint64_t frameId, const string& /*name*/, const DetectionResult& result)
+{
+    // encoded outside the lock, each thread reuses its own record
+    thread_local vector<unsigned char> record;
+    encodeResultRecord(frameId, result, record);
+
+    lock_guard<mutex> lock(writeMutex);
+    file.append(record.data(), record.size());
+}
+
+
+bool BinaryResultSink::flush()
+{
+    lock_guard<mutex> lock(writeMutex);
+    return file.flush();
+}
+
+
+static bool hasExtension(const string& path, const string& extension)
+{
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+
+unique_ptr<ResultSink> openResultSink(const string& path)
+{
+    if(hasExtension(path, ".ndjson") || hasExtension(path, ".jsonl"))
+    {
+        unique_ptr<NdjsonResultSink> sink(new NdjsonResultSink());
+        if(sink->open(path))
+            return sink;
+    }
+    else
+    {
+        unique_ptr<BinaryResultSink> sink(new BinaryResultSink());
+        if(sink->open(path))
+            return sink;
+    }
+    return nullptr;
+}
+
+
+BinaryResultReader::BinaryResultReader()
+    : data(nullptr), size(0), offset(0), truncatedRecord(false)
+{
+}
+
+
+BinaryResultReader::~BinaryResultReader()
+{
+    unmap();
+}
+
+
+void BinaryResultReader::unmap()
+{
+    if(data)
+        munmap((void*)data, size);
+    data = nullptr;
+    size = 0;
+    offset = 0;
+    truncatedRecord = false;
+}
+
+
+bool BinaryResultReader::open(const string& path)
+{
+    unmap();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd >= 0 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(binaryResultsMagic))
+    {
+        void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped != MAP_FAILED)
+        {
+            madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL); // records are read front to back
+            data = (const unsigned char*)mapped;
+            size = (size_t)info.st_size;
+        }
+    }
+    if(fd >= 0)
+        ::close(fd);
+
+    if(!data || memcmp(data, binaryResultsMagic, sizeof(binaryResultsMagic)) != 0)
+    {
+        unmap();
+        return false;
+    }
+    offset = sizeof(binaryResultsMagic);
+    return true;
+}
+
+
+bool BinaryResultReader::next(ResultRecord& record)
+{
+    if(!data || offset >= size)
+        return false;
+    size_t recordSize = decodeResultRecord(data + offset, size - offset, record);
+    if(recordSize == 0)
+    {
+        truncatedRecord = true;
+        return false;
+    }
+    offset += recordSize;
+    return true;
+}
+
+
+bool BinaryResultReader::truncated() const
+{
+    return truncatedRecord;
+}
+
+
+
+bool readResults(const string& binaryPath, const string& ndjsonPath)
+{
+    BinaryResultReader reader;
+    if(!reader.open(binaryPath))
+    {
+        cerr << "Not a binary results file: " << binaryPath << endl;
+        return false;
+    }
+    NdjsonResultSink ndjson;
+    if(!ndjsonPath.empty() && !ndjson.open(ndjsonPath))
+    {
+        cerr << "Unable to create: " << ndjsonPath << endl;
+        return false;
+    }
+
+    ResultRecord record;
+    size_t records = 0, objects = 0, boxes = 0, maxObjects = 0;
+    while(reader.next(record))
+    {
+        ++records;
+        objects += record.result.centers.size();
+        boxes += record.result.boxes.size();
+        maxObjects = max(maxObjects, record.result.centers.size());
+        if(!ndjsonPath.empty())
+            ndjson.write(record.frameId, "", record.result);
+    }
+    bool written = ndjsonPath.empty() || ndjson.flush();
+
+    cout << records << " records, " << objects << " detected objects (" << (records ? (double)objects / records : 0.0) << " per record, at most " << maxObjects << "), " << boxes << " bounding boxes" << endl;
+    if(reader.truncated())
+        cerr << "The file ends with a truncated record: " << binaryPath << endl;
+    if(!written)
+        cerr << "Unable to write: " << ndjsonPath << endl;
+    return !reader.truncated() && written;
+}
+
+}
@@ -0,0 +1,225 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyResults_hpp
+#define parsleyResults_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "parsleyPipeline.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ Appends bytes to a file through a large buffer: the file is written only when the buffer is full, on flush and on close.
+ Not thread safe.
+ */
+class BufferedFileWriter
+{
+public:
+    /**
+     @param bufferSize bytes collected before each write to the file
+     */
+    explicit BufferedFileWriter(std::size_t bufferSize = 1 << 20);
+
+    /**
+     Flushes and closes the file.
+     */
+    ~BufferedFileWriter();
+
+    BufferedFileWriter(const BufferedFileWriter&) = delete;
+    BufferedFileWriter& operator=(const BufferedFileWriter&) = delete;
+
+    /**
+     Creates (or truncates) the file.
+
+     @return false if the file can not be created
+     */
+    bool open(const std::string& path);
+
+    void append(const void* data, std::size_t size);
+
+    /**
+     Writes the buffered bytes to the file.
+
+     @return false if some write to the file has failed since it was opened
+     */
+    bool flush();
+
+    bool close();
+
+private:
+    std::FILE* file;
+    std::vector<char> buffer;
+    std::size_t used;
+    bool failed;
+};
+
+
+/**
+ Destination of the detections of each processed image (or frame).
+ Implementations are thread safe: batch workers write to the same sink.
+ */
+class ResultSink
+{
+public:
+    virtual ~ResultSink() {}
+
+    /**
+     Saves the detections of an image.
+
+     @param frameId position of the image in the batch or stream
+     @param name the image path or frame name (not saved by every format)
+     @param result the detections
+     */
+    virtual void write(std::uint64_t frameId, const std::string& name, const DetectionResult& result) = 0;
+
+    /**
+     Writes the buffered records to the file.
+
+     @return false if some write to the file has failed
+     */
+    virtual bool flush() = 0;
+};
+
+
+/**
+ One JSON object per line:
+ {"frame":F,"name":"N","threshold":T,"objects":[{"x":X,"y":Y,"area":A},...],"boxes":[{"cx":X,"cy":Y,"width":W,"height":H,"angle":D},...]}
+ */
+class NdjsonResultSink : public ResultSink
+{
+public:
+    /**
+     @return false if the file can not be created
+     */
+    bool open(const std::string& path);
+
+    void write(std::uint64_t frameId, const std::string& name, const DetectionResult& result) override;
+    bool flush() override;
+
+private:
+    std::mutex writeMutex;
+    BufferedFileWriter file; // guarded by writeMutex
+};
+
+
+/**
+ Compact binary records, all little endian, after the 8 bytes file magic "PRSLRES1":
+ uint64 frameId, float64 threshold, uint32 objectCount, uint32 boxCount, objectCount times {float32 x, y, area}, boxCount times {float32 centerX, centerY, width, height, angle}.
+ The image name is not saved. Read the records back with BinaryResultReader.
+ */
+class BinaryResultSink : public ResultSink
+{
+public:
+    /**
+     @return false if the file can not be created
+     */
+    bool open(const std::string& path);
+
+    void write(std::uint64_t frameId, const std::string& name, const DetectionResult& result) override;
+    bool flush() override;
+
+private:
+    std::mutex writeMutex;
+    BufferedFileWriter file; // guarded by writeMutex
+};
+
+
+/**
+ Opens a sink, choosing the format from the file extension.
+
+ @param path a .ndjson or .jsonl file for NDJSON, any other file for binary records
+ @return the sink, null if the file can not be created
+ */
+std::unique_ptr<ResultSink> openResultSink(const std::string& path);
+
+
+/**
+ A record of a binary results file.
+ */
+struct ResultRecord
+{
+    std::uint64_t frameId = 0;
+    DetectionResult result; // with the thresholding value
+};
+
+
+/**
+ Encodes a record of the BinaryResultSink format (without the file magic).
+
+ @param frameId position of the image in the batch or stream
+ @param result the detections
+ @param record where to save the encoded bytes, it keeps its memory
+ */
+void encodeResultRecord(std::uint64_t frameId, const DetectionResult& result, std::vector<unsigned char>& record);
+
+
+/**
+ Decodes a record of the BinaryResultSink format.
+
+ @param data the bytes at the start of the record
+ @param size bytes available from data
+ @param record where to save the record, its vectors keep their memory
+ @return the record size in bytes, 0 if size holds only part of a record
+ */
+std::size_t decodeResultRecord(const unsigned char* data, std::size_t size, ResultRecord& record);
+
+
+/**
+ Streams back the records of a BinaryResultSink file, mapping it in memory.
+ */
+class BinaryResultReader
+{
+public:
+    BinaryResultReader();
+    ~BinaryResultReader();
+
+    BinaryResultReader(const BinaryResultReader&) = delete;
+    BinaryResultReader& operator=(const BinaryResultReader&) = delete;
+
+    /**
+     @return false if the file can not be mapped or it is not a binary results file
+     */
+    bool open(const std::string& path);
+
+    /**
+     Reads the next record.
+
+     @param record where to save the record, its vectors keep their memory
+     @return false at the end of the file, or at a truncated record (see truncated)
+     */
+    bool next(ResultRecord& record);
+
+    /**
+     @return true if the file ends with an incomplete record (e.g. the writer was killed)
+     */
+    bool truncated() const;
+
+private:
+    void unmap();
+
+    const unsigned char* data;
+    std::size_t size;
+    std::size_t offset;
+    bool truncatedRecord;
+};
+
+
+/**
+ Reader utility for a binary results file: prints to console the number of records and detections, optionally converting the records to NDJSON.
+
+ @param binaryPath the file written by a BinaryResultSink
+ @param ndjsonPath if not empty where to save the records as NDJSON (names are empty, the binary format does not keep them)
+ @return false if the file can not be read, it is truncated, or the NDJSON file can not be written
+ */
+bool readResults(const std::string& binaryPath, const std::string& ndjsonPath = "");
+
+}
+#endif /* parsleyResults_hpp */
@@ -0,0 +1,467 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "parsleyServer.hpp"
+#include "parsleyPipeline.hpp"
+#include "parsleyQueue.hpp"
+#include "parsleyStream.hpp"
+#include "parsleyMetrics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+static const size_t messageHeaderSize = 5; // requestId and kind (or status), after the length prefix
+
+static volatile sig_atomic_t serverStopping = 0;
+
+static void requestServerStop(int)
+{
+    serverStopping = 1;
+}
+
+
+// A client connection: socket connections are closed when the reader and the workers are all done with them
+struct ServerConnection
+{
+    ServerConnection(int inFd, int outFd, bool ownsFd) : inFd(inFd), outFd(outFd), ownsFd(ownsFd), writeFailed(false) {}
+    ~ServerConnection()
+    {
+        if(ownsFd)
+            close(inFd);
+    }
+
+    int inFd, outFd;
+    bool ownsFd;
+    mutex writeMutex; // responses of different workers must not interleave
+    bool writeFailed; // the client has gone away, guarded by writeMutex
+};
+
+
+struct ServerRequest
+{
+    shared_ptr<ServerConnection> connection;
+    uint32_t requestId = 0;
+    ServerRequestKind kind = ServerRequestKind::IMAGE_PATH;
+    vector<uchar> payload;
+};
+
+
+static bool readFully(int fd, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    while(size > 0)
+    {
+        ssize_t n = read(fd, bytes, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static bool writeFully(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while(size > 0)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static void putU32(vector<uchar>& buffer, uint32_t value)
+{
+    for(int i=0; i<4; ++i)
+        buffer.push_back((uchar)(value >> (8 * i)));
+}
+
+
+static uint32_t getU32(const uchar* bytes)
+{
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+
+// Writes a whole message with a single write call
+static bool sendMessage(int fd, uint32_t requestId, uint8_t type, const void* payload, size_t size)
+{
+    vector<uchar> message;
+    message.reserve(4 + messageHeaderSize + size);
+    putU32(message, (uint32_t)(messageHeaderSize + size));
+    putU32(message, requestId);
+    message.push_back(type);
+    message.insert(message.end(), (const uchar*)payload, (const uchar*)payload + size);
+    return writeFully(fd, message.data(), message.size());
+}
+
+
+// Reads a whole message, false at the end of the input or if it is malformed
+static bool receiveMessage(int fd, size_t maxPayloadBytes, uint32_t& requestId, uint8_t& type, vector<uchar>& payload, bool& tooBig)
+{
+    uchar header[4 + messageHeaderSize];
+    tooBig = false;
+    if(!readFully(fd, header, 4))
+        return false;
+    uint32_t length = getU32(header);
+    if(length < messageHeaderSize || !readFully(fd, header + 4, messageHeaderSize))
+        return false;
+    requestId = getU32(header + 4);
+    type = header[8];
+    if(length - messageHeaderSize > maxPayloadBytes)
+    {
+        tooBig = true;
+        return true;
+    }
+    payload.resize(length - messageHeaderSize);
+    return payload.empty() || readFully(fd, payload.data(), payload.size());
+}
+
+
+static void respond(ServerConnection& connection, uint32_t requestId, ServerStatus status, const string& payload)
+{
+    lock_guard<mutex> lock(connection.writeMutex);
+    if(!connection.writeFailed && !sendMessage(connection.outFd, requestId, (uint8_t)status, payload.data(), payload.size()))
+        connection.writeFailed = true;
+}
+
+
+static string resultJson(const DetectionResult& result, double milliseconds)
+{
+    ostringstream json;
+    json << "{\"threshold\":" << result.thresholdingValue << ",\"milliseconds\":" << milliseconds << ",\"objects\":[";
+    for(int i=0; i<result.centers.size(); ++i)
+        json << (i ? "," : "") << "{\"x\":" << result.centers[i].x << ",\"y\":" << result.centers[i].y << ",\"area\":" << result.areas[i] << "}";
+    json << "]}";
+    return json.str();
+}
+
+
+// Worker: owns a pipeline and answers the queued requests until the queue is closed and drained
+static void serveRequests(BoundedQueue<ServerRequest>& requests, DetectorEngine engine, atomic<size_t>& failures)
+{
+    PipelineSettings settings;
+    settings.engine = engine;
+    Pipeline pipeline(settings);
+    DetectionResult result;
+    Mat grayImage, colorImage;
+    ServerRequest request;
+    while(requests.pop(request))
+    {
+        double ticks = (double) getTickCount();
+        StageClock stageClock;
+        string error;
+        try
+        {
+            if(request.kind == ServerRequestKind::IMAGE_PATH)
+            {
+                string path(request.payload.begin(), request.payload.end());
+                if(!decodeInputImage(path, false, grayImage, colorImage))
+                    error = "Unable to read: " + path;
+            }
+            else
+            {
+                if(!request.payload.empty())
+                    imdecode(Mat(1, (int)request.payload.size(), CV_8U, request.payload.data()), IMREAD_GRAYSCALE, &grayImage);
+                if(request.payload.empty() || grayImage.empty())
+                    error = "Unable to decode the image";
+            }
+            if(error.empty())
+            {
+                stageClock.lap(PipelineStage::DECODE);
+                pipeline.process(grayImage, result);
+                countEvent(PipelineCounter::IMAGES_PROCESSED);
+            }
+        }
+        catch(const std::exception& e)
+        {
+            error = e.what();
+        }
+
+        if(error.empty())
+            respond(*request.connection, request.requestId, ServerStatus::OK, resultJson(result, ((double) getTickCount() - ticks) / getTickFrequency() * 1000));
+        else
+        {
+            ++failures;
+            respond(*request.connection, request.requestId, ServerStatus::ERROR, error);
+        }
+        request = ServerRequest(); // releases the payload and the connection
+    }
+}
+
+
+// Reader: queues the requests of a connection until it ends
+static void readRequests(shared_ptr<ServerConnection> connection, BoundedQueue<ServerRequest>& requests, size_t maxRequestBytes, atomic<size_t>& received, atomic<size_t>& failures)
+{
+    while(true)
+    {
+        ServerRequest request;
+        uint8_t kind;
+        bool tooBig;
+        if(!receiveMessage(connection->inFd, maxRequestBytes, request.requestId, kind, request.payload, tooBig))
+            break;
+        ++received;
+        if(tooBig) // its payload is not read: the stream can not be resynchronized
+        {
+            ++failures;
+            respond(*connection, request.requestId, ServerStatus::ERROR, "Request too big");
+            break;
+        }
+        if(kind != (uint8_t)ServerRequestKind::IMAGE_PATH && kind != (uint8_t)ServerRequestKind::IMAGE_BYTES)
+        {
+            ++failures;
+            respond(*connection, request.requestId, ServerStatus::ERROR, "Unknown request kind");
+            continue;
+        }
+        request.kind = (ServerRequestKind)kind;
+        request.connection = connection;
+        if(!requests.push(std::move(request)))
+            break;
+    }
+}
+
+
+// Accepts connections until SIGINT or SIGTERM, each one with its own reader thread. Returns the number of connections accepted
+static size_t acceptConnections(const string& socketPath, BoundedQueue<ServerRequest>& requests, size_t maxRequestBytes, atomic<size_t>& received, atomic<size_t>& failures)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Socket path too long: " << socketPath << endl;
+        return 0;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str()); // the socket file left by a previous run
+    if(listenFd < 0 || ::bind(listenFd, (sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, 64) < 0)
+    {
+        cerr << "Unable to listen on: " << socketPath << " (" << strerror(errno) << ")" << endl;
+        if(listenFd >= 0)
+            close(listenFd);
+        return 0;
+    }
+    serverStopping = 0;
+    signal(SIGINT, requestServerStop);
+    signal(SIGTERM, requestServerStop);
+    cerr << "Listening on " << socketPath << endl;
+
+    mutex connectionsMutex;
+    condition_variable readersDone;
+    vector<weak_ptr<ServerConnection>> connections; // guarded by connectionsMutex
+    int activeReaders = 0;                          // guarded by connectionsMutex
+    size_t accepted = 0;
+    while(!serverStopping)
+    {
+        pollfd listening = {listenFd, POLLIN, 0};
+        if(poll(&listening, 1, 200) <= 0) // timeout or signal: the stop flag is checked again
+            continue;
+        int fd = accept(listenFd, nullptr, nullptr);
+        if(fd < 0)
+            continue;
+        ++accepted;
+        shared_ptr<ServerConnection> connection(new ServerConnection(fd, fd, true));
+        {
+            lock_guard<mutex> lock(connectionsMutex);
+            connections.erase(remove_if(connections.begin(), connections.end(), [](const weak_ptr<ServerConnection>& c){ return c.expired(); }), connections.end());
+            connections.push_back(connection);
+            ++activeReaders;
+        }
+        thread([&, connection]()
+        {
+            readRequests(connection, requests, maxRequestBytes, received, failures);
+            lock_guard<mutex> lock(connectionsMutex);
+            --activeReaders;
+            readersDone.notify_all();
+        }).detach();
+    }
+
+    // the readers blocked on their connections are woken up, the requests already queued are still answered
+    {
+        unique_lock<mutex> lock(connectionsMutex);
+        for(int i=0; i<connections.size(); ++i)
+        {
+            shared_ptr<ServerConnection> connection = connections[i].lock();
+            if(connection)
+                shutdown(connection->inFd, SHUT_RD);
+        }
+        readersDone.wait(lock, [&]{ return activeReaders == 0; });
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    return accepted;
+}
+
+
+ServerStats runServer(const string& socketPath, const ServerOptions& options)
+{
+    signal(SIGPIPE, SIG_IGN); // a client gone away is a failed write, not the end of the server
+
+    // each worker already keeps a core busy
+    int previousCvThreads = getNumThreads();
+    setNumThreads(0);
+
+    int numWorkers = options.numWorkers > 0 ? options.numWorkers : max(1, (int)thread::hardware_concurrency());
+    BoundedQueue<ServerRequest> requests(options.queueCapacity, FrameDropPolicy::BLOCK);
+    atomic<size_t> received(0), failures(0);
+    vector<thread> workers;
+    for(int i=0; i<numWorkers; ++i)
+        workers.emplace_back(serveRequests, ref(requests), options.engine, ref(failures));
+
+    ServerStats stats;
+    if(socketPath == "-")
+    {
+        // stdout carries the responses only
+        shared_ptr<ServerConnection> connection(new ServerConnection(STDIN_FILENO, STDOUT_FILENO, false));
+        stats.connections = 1;
+        readRequests(connection, requests, options.maxRequestBytes, received, failures);
+    }
+    else
+        stats.connections = acceptConnections(socketPath, requests, options.maxRequestBytes, received, failures);
+
+    requests.close();
+    for(int i=0; i<workers.size(); ++i)
+        workers[i].join();
+    setNumThreads(previousCvThreads);
+
+    stats.requests = received;
+    stats.failedRequests = failures;
+    cerr << "Server stopped: " << stats.requests << " requests (" << stats.failedRequests << " failed) on " << stats.connections << " connections" << endl;
+    return stats;
+}
+
+
+static int connectToServer(const string& socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socketPath.size() >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+
+bool benchmarkServer(const string& socketPath, const string& imagePath, int connections, int requestsPerConnection, bool sendBytes)
+{
+    signal(SIGPIPE, SIG_IGN);
+    connections = max(1, connections);
+    requestsPerConnection = max(1, requestsPerConnection);
+
+    vector<uchar> payload;
+    if(sendBytes)
+    {
+        ifstream file(imagePath, ios::binary);
+        payload.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        if(payload.empty())
+        {
+            cerr << "Unable to read: " << imagePath << endl;
+            return false;
+        }
+    }
+    else
+        payload.assign(imagePath.begin(), imagePath.end());
+    const uint8_t kind = (uint8_t)(sendBytes ? ServerRequestKind::IMAGE_BYTES : ServerRequestKind::IMAGE_PATH);
+
+    vector<vector<double>> latencies(connections);
+    atomic<bool> failed(false);
+    mutex errorMutex;
+    string firstError; // guarded by errorMutex
+    double ticks = (double) getTickCount();
+    vector<thread> clients;
+    for(int c=0; c<connections; ++c)
+        clients.emplace_back([&, c]()
+        {
+            int fd = connectToServer(socketPath);
+            if(fd < 0)
+            {
+                failed = true;
+                lock_guard<mutex> lock(errorMutex);
+                firstError = "Unable to connect to: " + socketPath;
+                return;
+            }
+            vector<uchar> response;
+            for(int i=0; i<requestsPerConnection; ++i)
+            {
+                uint32_t requestId = (uint32_t)i, responseId;
+                uint8_t status;
+                bool tooBig;
+                double requestTicks = (double) getTickCount();
+                if(!sendMessage(fd, requestId, kind, payload.data(), payload.size()) || !receiveMessage(fd, SIZE_MAX, responseId, status, response, tooBig))
+                {
+                    failed = true;
+                    lock_guard<mutex> lock(errorMutex);
+                    firstError = "Connection closed by the server";
+                    break;
+                }
+                latencies[c].push_back(((double) getTickCount() - requestTicks) / getTickFrequency() * 1000);
+                if(status != (uint8_t)ServerStatus::OK || responseId != requestId)
+                {
+                    failed = true;
+                    lock_guard<mutex> lock(errorMutex);
+                    if(firstError.empty())
+                        firstError = string(response.begin(), response.end());
+                }
+            }
+            close(fd);
+        });
+    for(int c=0; c<clients.size(); ++c)
+        clients[c].join();
+    double seconds = ((double) getTickCount() - ticks) / getTickFrequency();
+
+    vector<double> allLatencies;
+    for(int c=0; c<latencies.size(); ++c)
+        allLatencies.insert(allLatencies.end(), latencies[c].begin(), latencies[c].end());
+    sort(allLatencies.begin(), allLatencies.end());
+
+    cout << allLatencies.size() << " requests on " << connections << " connections in " << seconds << " seconds: " << (seconds > 0 ? allLatencies.size() / seconds : 0.0) << " requests per second" << endl;
+    cout << "Latency (ms) p50: " << percentileOf(allLatencies, 50) << " p90: " << percentileOf(allLatencies, 90) << " p99: " << percentileOf(allLatencies, 99) << " p99.9: " << percentileOf(allLatencies, 99.9) << " max: " << (allLatencies.empty() ? 0.0 : allLatencies.back()) << endl;
+    if(failed)
+        cerr << "Some requests failed: " << firstError << endl;
+    return !failed;
+}
+
+}
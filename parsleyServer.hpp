@@ -0,0 +1,91 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyServer_hpp
+#define parsleyServer_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "parsleyLib.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ Kind of the payload of a server request.
+ */
+enum class ServerRequestKind : std::uint8_t
+{
+    IMAGE_PATH = 0,  // payload is the path of an image file readable by the server
+    IMAGE_BYTES = 1  // payload is an encoded image (any format OpenCV can decode)
+};
+
+
+/**
+ Status of a server response.
+ */
+enum class ServerStatus : std::uint8_t
+{
+    OK = 0,   // payload is the detection result as JSON: {"threshold":T,"milliseconds":M,"objects":[{"x":X,"y":Y,"area":A},...]}
+    ERROR = 1 // payload is the error message
+};
+
+
+/**
+ Settings of runServer().
+ */
+struct ServerOptions
+{
+    int numWorkers = 0;                   // detection workers, if <= 0 the number of hardware threads is used
+    std::size_t queueCapacity = 64;       // requests received but not yet taken by a worker, readers block when it is full
+    std::size_t maxRequestBytes = 256u << 20; // bigger requests are answered with an error and their connection closed
+    DetectorEngine engine = DetectorEngine::SIMPLE_BLOB;
+};
+
+
+/**
+ Summary of a server run.
+ */
+struct ServerStats
+{
+    std::size_t connections = 0;
+    std::size_t requests = 0;
+    std::size_t failedRequests = 0; // answered with ServerStatus::ERROR
+};
+
+
+/**
+ Long running detection server: the detectors are built once and images are processed without writing any file.
+
+ Messages are length prefixed, integers are little endian:
+ - request:  uint32 length of what follows, uint32 requestId, uint8 ServerRequestKind, payload
+ - response: uint32 length of what follows, uint32 requestId, uint8 ServerStatus, payload
+ A connection can send many requests without waiting for the responses, which may come back in a different order: the client matches them by requestId.
+
+ Each connection has a reader thread which queues its requests; a fixed pool of workers, each owning a Pipeline, takes them from the queue and writes the responses.
+ The server stops on SIGINT or SIGTERM (socket) or at the end of the input (stdio), after answering the requests already received.
+
+ @param socketPath path of the Unix domain socket to listen on (an existing socket file is replaced), "-" to take requests from stdin and write responses to stdout
+ @param options workers and limits
+ @return the server statistics
+ */
+ServerStats runServer(const std::string& socketPath, const ServerOptions& options = ServerOptions());
+
+
+/**
+ Test client of runServer: sends the same image over many connections and measures throughput and latency.
+
+ Each connection sends its next request as soon as the previous response arrives. Prints to console the requests per second and the latency percentiles.
+
+ @param socketPath the server socket
+ @param imagePath the image to send
+ @param connections concurrent connections
+ @param requestsPerConnection requests sent on each connection
+ @param sendBytes if true the encoded image is sent in each request, otherwise its path
+ @return false if a connection failed or some request was answered with an error
+ */
+bool benchmarkServer(const std::string& socketPath, const std::string& imagePath, int connections = 8, int requestsPerConnection = 100, bool sendBytes = true);
+
+}
+#endif /* parsleyServer_hpp */
@@ -0,0 +1,463 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+
+#include "parsleyShard.hpp"
+#include "parsleyBatch.hpp"
+#include "parsleyResults.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+// Writes all the bytes, retrying after signals and partial writes
+static bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while(size > 0)
+    {
+        ssize_t written = ::write(fd, bytes, size);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+
+// Adds the CPUs of a list as "0-3,8,10-11" (the sysfs cpulist format)
+static void parseCpuList(const string& text, vector<int>& cpus)
+{
+    stringstream items(text);
+    string item;
+    while(getline(items, item, ','))
+    {
+        int first = 0, last = 0;
+        if(sscanf(item.c_str(), "%d-%d", &first, &last) == 2)
+            for(int cpu=first; cpu<=last; ++cpu)
+                cpus.push_back(cpu);
+        else if(sscanf(item.c_str(), "%d", &first) == 1)
+            cpus.push_back(first);
+    }
+}
+
+
+// The inverse of parseCpuList, for the console
+static string cpuListText(const vector<int>& cpus)
+{
+    string text;
+    for(int i=0; i<cpus.size(); )
+    {
+        int j = i;
+        while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            ++j;
+        text += (text.empty() ? "" : ",") + to_string(cpus[i]) + (j > i ? "-" + to_string(cpus[j]) : "");
+        i = j + 1;
+    }
+    return text;
+}
+
+
+vector<vector<int>> numaCpuGroups()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for(int cpu=0; cpu<(int)thread::hardware_concurrency() && cpu<CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &allowed);
+
+    // node directories are not always numbered without gaps
+    vector<int> nodes;
+    if(DIR* nodeDirectory = opendir("/sys/devices/system/node"))
+    {
+        while(dirent* entry = readdir(nodeDirectory))
+        {
+            int node = 0;
+            char trailing = 0;
+            if(sscanf(entry->d_name, "node%d%c", &node, &trailing) == 1)
+                nodes.push_back(node);
+        }
+        closedir(nodeDirectory);
+    }
+    sort(nodes.begin(), nodes.end());
+
+    vector<vector<int>> groups;
+    for(int i=0; i<nodes.size(); ++i)
+    {
+        ifstream cpuList("/sys/devices/system/node/node" + to_string(nodes[i]) + "/cpulist");
+        string text;
+        getline(cpuList, text);
+        vector<int> cpus, usable;
+        parseCpuList(text, cpus);
+        for(int c=0; c<cpus.size(); ++c)
+            if(cpus[c] >= 0 && cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed))
+                usable.push_back(cpus[c]);
+        if(!usable.empty())
+            groups.push_back(usable);
+    }
+
+    if(groups.empty())
+    {
+        groups.resize(1);
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &allowed))
+                groups[0].push_back(cpu);
+    }
+    return groups;
+}
+
+
+// Worker w runs on node w % nodes, the workers of a node split its CPUs in contiguous blocks
+static vector<vector<int>> assignWorkerCpus(const vector<vector<int>>& groups, int numWorkers)
+{
+    vector<vector<int>> workerCpus(numWorkers);
+    for(int g=0; g<groups.size(); ++g)
+    {
+        vector<int> nodeWorkers;
+        for(int w=g; w<numWorkers; w+=groups.size())
+            nodeWorkers.push_back(w);
+        const vector<int>& cpus = groups[g];
+        for(int k=0; k<nodeWorkers.size(); ++k)
+        {
+            size_t begin = cpus.size() * k / nodeWorkers.size(), end = cpus.size() * (k + 1) / nodeWorkers.size();
+            if(begin == end) // more workers than CPUs: some share one
+                workerCpus[nodeWorkers[k]].push_back(cpus[k % cpus.size()]);
+            else
+                workerCpus[nodeWorkers[k]].assign(cpus.begin() + begin, cpus.begin() + end);
+        }
+    }
+    return workerCpus;
+}
+
+
+// A worker process and the shard of images it owns
+struct ShardWorker
+{
+    vector<size_t> images;          // positions in inputImgPaths
+    vector<int> cpus;               // empty if not pinned
+    pid_t pid = -1;
+    int resultFd = -1;              // read end of its result pipe, -1 once the worker has ended
+    vector<unsigned char> received; // bytes of a record not yet complete
+    int restarts = 0;
+    size_t completed = 0;
+    double endTicks = 0.0;
+};
+
+
+// Starts a worker on the images of its shard still to process
+static bool startWorker(ShardWorker& worker, const vector<size_t>& images, const vector<string>& inputImgPaths, const string& outputImgPath, const ShardOptions& options, int numThreads)
+{
+    // everything the child needs is prepared before fork: between fork and exec only async signal safe calls are allowed
+    vector<string> arguments(1, "APParsley");
+    arguments.insert(arguments.end(), options.workerOptions.begin(), options.workerOptions.end());
+    arguments.push_back("--shard-worker");
+    arguments.push_back("3"); // result pipe
+    arguments.push_back(outputImgPath);
+    arguments.push_back(to_string(numThreads));
+    arguments.push_back(options.outputLevel);
+    arguments.push_back(options.compression);
+    vector<char*> argv;
+    for(int i=0; i<arguments.size(); ++i)
+        argv.push_back(&arguments[i][0]);
+    argv.push_back(nullptr);
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for(int i=0; i<worker.cpus.size(); ++i)
+        CPU_SET(worker.cpus[i], &cpuSet);
+
+    // close on exec: a worker must not keep the pipes of the others open
+    int inputPipe[2], resultPipe[2];
+    if(pipe2(inputPipe, O_CLOEXEC) != 0)
+        return false;
+    if(pipe2(resultPipe, O_CLOEXEC) != 0)
+    {
+        close(inputPipe[0]);
+        close(inputPipe[1]);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        // dup2 onto the same descriptor keeps close on exec, so it is cleared explicitly
+        if(dup2(inputPipe[0], 0) < 0 || dup2(resultPipe[1], 3) < 0 || fcntl(0, F_SETFD, 0) != 0 || fcntl(3, F_SETFD, 0) != 0)
+            _exit(127);
+        if(!worker.cpus.empty())
+            sched_setaffinity(0, sizeof(cpuSet), &cpuSet); // kept across exec, the memory of the worker is then first touched on its own node
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    close(inputPipe[0]);
+    close(resultPipe[1]);
+    if(pid < 0)
+    {
+        close(inputPipe[1]);
+        close(resultPipe[0]);
+        return false;
+    }
+
+    // the worker reads all its input before writing any result: the whole list can be written at once
+    string input;
+    for(int i=0; i<images.size(); ++i)
+        input += to_string(images[i]) + " " + inputImgPaths[images[i]] + "\n";
+    writeAll(inputPipe[1], input.data(), input.size()); // a failure means the worker already died, seen at the end of its pipe
+    close(inputPipe[1]);
+
+    worker.pid = pid;
+    worker.resultFd = resultPipe[0];
+    worker.received.clear();
+    return true;
+}
+
+
+ShardStats processSharded(const vector<string>& inputImgPaths, const string& outputImgPath, const ShardOptions& options, ResultSink& sink)
+{
+    enum ImageState : uchar { PENDING, DONE, FAILED };
+
+    ShardStats stats;
+    stats.images = inputImgPaths.size();
+    vector<vector<int>> groups = numaCpuGroups();
+    size_t totalCpus = 0;
+    for(int g=0; g<groups.size(); ++g)
+        totalCpus += groups[g].size();
+    const int numWorkers = (int)max((size_t)1, min(inputImgPaths.size(), (size_t)(options.numWorkers > 0 ? options.numWorkers : (int)groups.size())));
+    vector<vector<int>> workerCpus = assignWorkerCpus(groups, numWorkers);
+
+    // image i goes to shard i % numWorkers: images of similar size, often adjacent in the list, are spread evenly
+    vector<ShardWorker> workers(numWorkers);
+    for(size_t i=0; i<inputImgPaths.size(); ++i)
+        workers[i % numWorkers].images.push_back(i);
+
+    vector<uchar> states(inputImgPaths.size(), PENDING);
+    map<size_t, DetectionResult> completedResults; // done, but waiting for an image before them
+    size_t nextImage = 0;
+
+    void (*previousPipeHandler)(int) = signal(SIGPIPE, SIG_IGN); // a worker gone away is a failed write
+    double ticks = (double) getTickCount();
+    cout << "Processing " << inputImgPaths.size() << " images with " << numWorkers << " worker processes on " << groups.size() << " NUMA nodes" << endl;
+
+    int runningWorkers = 0;
+    for(int w=0; w<numWorkers; ++w)
+    {
+        ShardWorker& worker = workers[w];
+        if(options.pinCpus)
+            worker.cpus = workerCpus[w];
+        int numThreads = options.pinCpus ? (int)worker.cpus.size() : (int)max((size_t)1, totalCpus / numWorkers);
+        if(startWorker(worker, worker.images, inputImgPaths, outputImgPath, options, numThreads))
+        {
+            ++runningWorkers;
+            cout << "Worker " << w << ": pid " << worker.pid << ", " << worker.images.size() << " images";
+            if(options.pinCpus)
+                cout << ", CPUs " << cpuListText(worker.cpus);
+            cout << endl;
+        }
+        else
+        {
+            cerr << "Unable to start worker " << w << endl;
+            for(int i=0; i<worker.images.size(); ++i)
+                states[worker.images[i]] = FAILED;
+        }
+    }
+
+    ResultRecord record;
+    vector<unsigned char> chunk(1 << 16);
+    vector<pollfd> pollFds;
+    vector<int> pollWorkers;
+    while(runningWorkers > 0)
+    {
+        pollFds.clear();
+        pollWorkers.clear();
+        for(int w=0; w<numWorkers; ++w)
+            if(workers[w].resultFd >= 0)
+            {
+                pollFds.push_back(pollfd{workers[w].resultFd, POLLIN, 0});
+                pollWorkers.push_back(w);
+            }
+        if(poll(pollFds.data(), pollFds.size(), -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            cerr << "Unable to wait for the workers" << endl;
+            break;
+        }
+
+        for(int p=0; p<pollFds.size(); ++p)
+        {
+            if(pollFds[p].revents == 0)
+                continue;
+            const int w = pollWorkers[p];
+            ShardWorker& worker = workers[w];
+            ssize_t bytesRead = ::read(worker.resultFd, chunk.data(), chunk.size());
+            if(bytesRead < 0 && errno == EINTR)
+                continue;
+            if(bytesRead > 0)
+            {
+                worker.received.insert(worker.received.end(), chunk.begin(), chunk.begin() + bytesRead);
+                size_t offset = 0, recordSize;
+                while((recordSize = decodeResultRecord(worker.received.data() + offset, worker.received.size() - offset, record)) > 0)
+                {
+                    offset += recordSize;
+                    if(record.frameId < states.size() && states[record.frameId] == PENDING)
+                    {
+                        states[record.frameId] = DONE;
+                        completedResults[record.frameId] = record.result;
+                        ++worker.completed;
+                    }
+                }
+                worker.received.erase(worker.received.begin(), worker.received.begin() + offset);
+                continue;
+            }
+
+            // end of the pipe: the worker has ended, every record it wrote has been read
+            close(worker.resultFd);
+            worker.resultFd = -1;
+            --runningWorkers;
+            int status = 0;
+            while(waitpid(worker.pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            bool crashed = !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            vector<size_t> missing;
+            for(int i=0; i<worker.images.size(); ++i)
+                if(states[worker.images[i]] == PENDING)
+                    missing.push_back(worker.images[i]);
+
+            if(crashed && !missing.empty())
+            {
+                if(WIFSIGNALED(status))
+                    cerr << "Worker " << w << " (pid " << worker.pid << ") killed by signal " << WTERMSIG(status);
+                else
+                    cerr << "Worker " << w << " (pid " << worker.pid << ") ended with code " << WEXITSTATUS(status);
+                cerr << ", " << missing.size() << " images left" << endl;
+            }
+            if(crashed && !missing.empty() && worker.restarts < options.maxRestarts)
+            {
+                ++worker.restarts;
+                ++stats.restarts;
+                int numThreads = options.pinCpus ? (int)worker.cpus.size() : (int)max((size_t)1, totalCpus / numWorkers);
+                if(startWorker(worker, missing, inputImgPaths, outputImgPath, options, numThreads))
+                {
+                    ++runningWorkers;
+                    cout << "Worker " << w << " restarted: pid " << worker.pid << endl;
+                    continue;
+                }
+            }
+            // images not processed by a worker which ended normally failed (see processBatch), the others are given up
+            for(int i=0; i<missing.size(); ++i)
+                states[missing[i]] = FAILED;
+            worker.endTicks = (double) getTickCount();
+        }
+
+        // merged log: each record is written once all the images before it are done or failed
+        for( ; nextImage<states.size() && states[nextImage] != PENDING; ++nextImage)
+        {
+            map<size_t, DetectionResult>::iterator completed = completedResults.find(nextImage);
+            if(completed == completedResults.end())
+                continue;
+            sink.write(nextImage, inputImgPaths[nextImage], completed->second);
+            completedResults.erase(completed);
+        }
+    }
+    sink.flush();
+    stats.elapsedTime = ((double)getTickCount() - ticks) / getTickFrequency();
+    signal(SIGPIPE, previousPipeHandler);
+
+    for(int i=0; i<states.size(); ++i)
+    {
+        stats.succeeded += (states[i] == DONE) ? 1 : 0;
+        stats.failed += (states[i] != DONE) ? 1 : 0;
+    }
+    for(int w=0; w<numWorkers; ++w)
+    {
+        double workerTime = (workers[w].endTicks > 0) ? (workers[w].endTicks - ticks) / getTickFrequency() : stats.elapsedTime;
+        cout << "Worker " << w << ": " << workers[w].completed << "/" << workers[w].images.size() << " images in " << workerTime << " seconds";
+        if(workerTime > 0)
+            cout << " (" << workers[w].completed / workerTime << " images per second)";
+        cout << ", " << workers[w].restarts << " restarts" << endl;
+    }
+    cout << "Processed " << stats.succeeded << "/" << stats.images << " images in " << stats.elapsedTime << " seconds";
+    if(stats.elapsedTime > 0)
+        cout << " (" << stats.succeeded / stats.elapsedTime << " images per second)";
+    cout << ", " << stats.restarts << " worker restarts" << endl;
+    return stats;
+}
+
+
+// Result sink of a worker: records go to the coordinator pipe, with the frame ids of the whole input
+class PipeResultSink : public ResultSink
+{
+public:
+    PipeResultSink(int fd, const vector<uint64_t>& frameIds)
+        : fd(fd), frameIds(frameIds), failed(false)
+    {
+    }
+
+    void write(uint64_t frameId, const string& /*name*/, const DetectionResult& result) override
+    {
+        thread_local vector<unsigned char> record;
+        encodeResultRecord(frameIds[frameId], result, record);
+        lock_guard<mutex> lock(writeMutex); // records of different threads must not interleave
+        failed = failed || !writeAll(fd, record.data(), record.size());
+    }
+
+    bool flush() override
+    {
+        lock_guard<mutex> lock(writeMutex);
+        return !failed;
+    }
+
+private:
+    int fd;
+    const vector<uint64_t>& frameIds;
+    mutex writeMutex;
+    bool failed; // guarded by writeMutex
+};
+
+
+int runShardWorker(int resultFd, const string& outputImgPath, int numThreads, OutputLevel outputLevel, TiffCompression compression, DetectorEngine engine, const ColorClassifier* classifier, double cleanFrameMargin, ResultCache* cache)
+{
+    vector<string> inputImgPaths;
+    vector<uint64_t> frameIds;
+    string line;
+    while(getline(cin, line))
+    {
+        if(line.empty())
+            continue;
+        size_t space = line.find(' ');
+        if(space == string::npos)
+        {
+            cerr << "Invalid shard input: " << line << endl;
+            return 1;
+        }
+        frameIds.push_back(strtoull(line.c_str(), nullptr, 10));
+        inputImgPaths.push_back(line.substr(space + 1));
+    }
+
+    PipeResultSink sink(resultFd, frameIds);
+    processBatch(inputImgPaths, outputImgPath, numThreads, outputLevel, compression, engine, &sink, classifier, cleanFrameMargin, cache);
+    bool written = sink.flush();
+    close(resultFd);
+    return written ? 0 : 1;
+}
+
+}
@@ -0,0 +1,86 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyShard_hpp
+#define parsleyShard_hpp
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "parsleyLib.hpp"
+#include "parsleyOutput.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ Settings of processSharded().
+ */
+struct ShardOptions
+{
+    int numWorkers = 0;          // worker processes, if <= 0 one per NUMA node
+    bool pinCpus = true;         // each worker pinned to its own CPUs, within a single NUMA node
+    int maxRestarts = 3;         // restarts of a crashed worker, after which the images left in its shard are reported failed
+    std::string outputLevel = "full";  // see parseOutputLevel
+    std::string compression = "none";  // see parseTiffCompression
+    std::vector<std::string> workerOptions; // options put on every worker command line, e.g. "--engine=components"
+};
+
+
+/**
+ Summary of a sharded run.
+ */
+struct ShardStats
+{
+    std::size_t images = 0;
+    std::size_t succeeded = 0;
+    std::size_t failed = 0;     // not processed by their worker, or left in a shard whose worker crashed too many times
+    std::size_t restarts = 0;
+    double elapsedTime = 0.0;   // seconds
+};
+
+
+/**
+ Groups the CPUs this process may run on by NUMA node, as listed in /sys/devices/system/node.
+
+ @return the CPUs of each node, a single group with all the CPUs if the system lists no nodes
+ */
+std::vector<std::vector<int>> numaCpuGroups();
+
+
+/**
+ Batch mode over many worker processes: the images are split into numWorkers shards (image i goes to shard i % numWorkers), each processed by a separate APParsley process with processBatch.
+
+ Separate processes do not share OpenCV global state nor the allocator, so they scale where the threads of a single process do not (e.g. multi-socket servers).
+ Each worker is started by running this same executable with --shard-worker, pinned (if options.pinCpus) to a block of the CPUs of one NUMA node, and gets its images on stdin.
+ Its detections come back over a pipe as BinaryResultSink records and are merged into sink in image order, each record written as soon as all the images before it are done.
+ A worker killed by a signal or ending with an error is started again with the images of its shard still missing, up to options.maxRestarts times.
+ Prints to console the workers, their restarts and, at the end, the throughput of each worker and of the whole run.
+
+ @param inputImgPaths the images to process
+ @param outputImgPath output directory of the images saved by the workers
+ @param options workers, pinning and the batch settings passed to the workers
+ @param sink where to merge the detections, with the position of each image in inputImgPaths as frame id
+ @return the run statistics
+ */
+ShardStats processSharded(const std::vector<std::string>& inputImgPaths, const std::string& outputImgPath, const ShardOptions& options, ResultSink& sink);
+
+
+/**
+ Worker side of processSharded(): reads "<frameId> <image path>" lines from stdin until its end, processes the images with processBatch and writes their detections to resultFd as BinaryResultSink records (without the file magic).
+
+ @param resultFd file descriptor of the pipe to the coordinator
+ @param outputImgPath output directory
+ @param numThreads batch worker threads, if <= 0 the number of hardware threads is used
+ @param outputLevel which images to save for each input image
+ @param compression compression of the saved TIFF files
+ @param engine the algorithm used to extract the impurities from the binary image
+ @param classifier if not null the color lookup table, see processBatch
+ @param cleanFrameMargin see processBatch
+ @param cache see processBatch
+ @return the process exit code: 0, or 1 if the input is invalid or the pipe can not be written
+ */
+int runShardWorker(int resultFd, const std::string& outputImgPath, int numThreads, OutputLevel outputLevel = OutputLevel::FULL_DEBUG, TiffCompression compression = TiffCompression::NONE, DetectorEngine engine = DetectorEngine::SIMPLE_BLOB, const ColorClassifier* classifier = nullptr, double cleanFrameMargin = 0, ResultCache* cache = nullptr);
+
+}
+#endif /* parsleyShard_hpp */
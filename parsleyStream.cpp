@@ -0,0 +1,288 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyStream.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyMetrics.hpp"
+#include "parsleyThreshold.hpp"
+#include "parsleyResults.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+// -1 if the file does not exist
+static long long fileSize(const string& path)
+{
+    struct stat info;
+    return (stat(path.c_str(), &info) == 0) ? (long long)info.st_size : -1;
+}
+
+
+// Decode stage for a video file: reads frames until the end of the file
+static void decodeVideoFrames(VideoCapture& capture, BoundedQueue<StreamFrame>& decodedFrames, size_t& framesDecoded)
+{
+    Mat colorFrame;
+    long frameId = 0;
+    while(true)
+    {
+        double captureTicks = (double) getTickCount();
+        if(!capture.read(colorFrame))
+            return;
+
+        StreamFrame frame;
+        frame.frameId = frameId;
+        frame.name = to_string(frameId);
+        frame.captureTicks = captureTicks;
+        if(colorFrame.channels() == 3)
+            cvtColor(colorFrame, frame.image, COLOR_BGR2GRAY);
+        else
+            frame.image = colorFrame.clone(); // the capture reuses its buffer at the next read
+        observeStage(PipelineStage::DECODE, ((double)getTickCount() - captureTicks) / getTickFrequency());
+
+        ++frameId;
+        ++framesDecoded;
+        decodedFrames.push(std::move(frame));
+    }
+}
+
+
+// Decode stage for a watched directory: polls it and decodes new files in name order
+static void decodeDirectoryFrames(const string& directory, const StreamOptions& options, BoundedQueue<StreamFrame>& decodedFrames, size_t& framesDecoded)
+{
+    set<string> consumed;            // files already sent down the pipeline (or not images)
+    map<string, long long> lastSize; // files seen only once, still possibly being written
+    long frameId = 0;
+    double lastFrameTicks = (double) getTickCount();
+
+    while(true)
+    {
+        vector<String> files;
+        glob(directory, files, false);
+
+        bool newFrames = false;
+        for(int i=0; i<files.size(); ++i)
+        {
+            const string& path = files[i];
+            if(consumed.count(path))
+                continue;
+
+            // a file is taken only once its size did not change between two scans: the camera may still be writing it
+            long long size = fileSize(path);
+            map<string, long long>::iterator it = lastSize.find(path);
+            if(it == lastSize.end() || it->second != size)
+            {
+                lastSize[path] = size;
+                continue;
+            }
+            lastSize.erase(it);
+            consumed.insert(path);
+
+            if(!haveImageReader(path))
+                continue;
+
+            StreamFrame frame;
+            frame.captureTicks = (double) getTickCount();
+            Mat unusedColor; // the stream emits results only
+            if(!decodeInputImage(path, false, frame.image, unusedColor))
+                continue;
+            observeStage(PipelineStage::DECODE, ((double)getTickCount() - frame.captureTicks) / getTickFrequency());
+            frame.frameId = frameId++;
+            frame.name = path;
+
+            ++framesDecoded;
+            newFrames = true;
+            decodedFrames.push(std::move(frame));
+        }
+
+        if(newFrames)
+            lastFrameTicks = (double) getTickCount();
+        else if(options.idleTimeout > 0 && ((double)getTickCount() - lastFrameTicks) / getTickFrequency() >= options.idleTimeout)
+            return;
+
+        this_thread::sleep_for(chrono::milliseconds(options.pollInterval));
+    }
+}
+
+
+StreamStats processStream(const string& source, const StreamOptions& options)
+{
+    StreamStats stats;
+
+    bool watchDirectory = isDirectory(source);
+    VideoCapture capture;
+    if(!watchDirectory && !capture.open(source))
+    {
+        cerr << "Unable to open stream source: " << source << endl;
+        return stats;
+    }
+
+    // only the first queue drops frames: when a later stage falls behind the queues before it fill up and the pressure reaches the source
+    BoundedQueue<StreamFrame> decodedFrames(options.queueCapacity, options.dropPolicy);
+    BoundedQueue<StreamFrame> binaryFrames(options.queueCapacity, FrameDropPolicy::BLOCK);
+    BoundedQueue<StreamFrame> detectedFrames(options.queueCapacity, FrameDropPolicy::BLOCK);
+
+    // Decode stage
+    thread decodeStage([&]()
+    {
+        if(watchDirectory)
+            decodeDirectoryFrames(source, options, decodedFrames, stats.framesDecoded);
+        else
+            decodeVideoFrames(capture, decodedFrames, stats.framesDecoded);
+        decodedFrames.close();
+    });
+
+    // Gamma correction and thresholding stage
+    thread thresholdStage([&]()
+    {
+        StreamFrame frame;
+        vector<float> imageHistogram;
+        vector<float> gammaHistogram;
+        ThresholdEstimator thresholdEstimator(0.2, options.driftBound); // frames of the same scene: the slope search runs again only on drift
+        while(decodedFrames.pop(frame))
+        {
+            // the gamma image itself is never needed: histogram and binary image come straight from the frame
+            StageClock stageClock;
+            frame.clean = options.cleanFrameMargin > 0 && isCleanFrame(frame.image, options.gamma, options.minArea, options.cleanFrameMargin, options.cleanFrameStride, &frame.thresholdingValue);
+            if(frame.clean)
+            {
+                stageClock.lap(PipelineStage::THRESHOLD);
+                ++stats.framesSkippedClean;
+                frame.binaryImage.release();
+                binaryFrames.push(std::move(frame));
+                continue;
+            }
+            fusedGammaHistogram(frame.image, options.gamma, imageHistogram, gammaHistogram);
+            stageClock.lap(PipelineStage::GAMMA_HISTOGRAM);
+            if(options.trackThreshold)
+                frame.thresholdingValue = thresholdEstimator.update(gammaHistogram);
+            else
+            {
+                ++stats.thresholdSearches;
+                frame.thresholdingValue = getAdaptiveThreshValue(gammaHistogram);
+                if(frame.thresholdingValue < 0) // no slope big enough: -1 would turn the whole frame white
+                {
+                    ++stats.thresholdSearchFailures;
+                    countEvent(PipelineCounter::THRESHOLD_SEARCH_FAILURES);
+                    frame.thresholdingValue = otsuThreshValue(gammaHistogram);
+                }
+            }
+            stageClock.lap(PipelineStage::THRESHOLD);
+            gammaToBinaryImage(frame.image, options.gamma, frame.thresholdingValue, frame.binaryImage);
+            stageClock.lap(PipelineStage::BINARIZE);
+            binaryFrames.push(std::move(frame));
+        }
+        if(options.trackThreshold)
+        {
+            stats.thresholdSearches = thresholdEstimator.searches();
+            stats.thresholdSearchFailures = thresholdEstimator.failedSearches();
+        }
+        binaryFrames.close();
+    });
+
+    // Blob detection stage, the detector is built once for the whole stream
+    thread detectStage([&]()
+    {
+        SimpleBlobDetector::Params parameters = instantiateBlobParams();
+        Ptr<SimpleBlobDetector> blobDetector = getBlobDetectorInstance(&parameters, options.minArea);
+
+        StreamFrame frame;
+        while(binaryFrames.pop(frame))
+        {
+            StageClock stageClock;
+            if(frame.clean)
+            {
+                frame.keypoints.clear();
+                frame.boxes.clear();
+            }
+            else if(options.engine != DetectorEngine::SIMPLE_BLOB) // the threshold stage gives CV_8U frames: the bit mask engine labels them as components
+                frame.keypoints = detectComponentRects(frame.binaryImage, parameters, frame.boxes);
+            else
+                frame.keypoints = detectBoundingRects(blobDetector, frame.binaryImage, frame.boxes);
+            stageClock.lap(PipelineStage::DETECT);
+            countEvent(PipelineCounter::KEYPOINTS_FOUND, frame.keypoints.size());
+            detectedFrames.push(std::move(frame));
+        }
+        detectedFrames.close();
+    });
+
+    // Result emission stage, runs on the calling thread
+    vector<double> latencies;
+    StreamFrame frame;
+    DetectionResult result;
+    while(detectedFrames.pop(frame))
+    {
+        double latency = ((double)getTickCount() - frame.captureTicks) * 1000.0 / getTickFrequency(); // milliseconds
+        latencies.push_back(latency);
+        countEvent(PipelineCounter::IMAGES_PROCESSED);
+
+        bool deadlineMissed = options.latencyTarget > 0 && latency > options.latencyTarget;
+        if(deadlineMissed)
+            ++stats.deadlineMisses;
+
+        if(options.sink)
+        {
+            result.thresholdingValue = frame.thresholdingValue;
+            result.centers.resize(frame.keypoints.size());
+            result.areas.resize(frame.keypoints.size());
+            for(int i=0; i<frame.keypoints.size(); ++i)
+            {
+                result.centers[i] = frame.keypoints[i].pt;
+                float radius = frame.keypoints[i].size / 2; // the size is the diameter of the blob
+                result.areas[i] = (float)(CV_PI * radius * radius);
+            }
+            result.boxes.swap(frame.boxes);
+            options.sink->write(frame.frameId, frame.name, result);
+        }
+
+        cout << "Frame " << frame.frameId << " (" << frame.name << "): " << frame.keypoints.size() << " detected objects, latency " << latency << " ms" << (frame.clean ? " (clean frame)" : "") << (deadlineMissed ? " (deadline missed)" : "") << endl;
+    }
+
+    decodeStage.join();
+    thresholdStage.join();
+    detectStage.join();
+
+    stats.framesProcessed = latencies.size();
+    stats.framesDropped = decodedFrames.droppedCount();
+    sort(latencies.begin(), latencies.end());
+    stats.latencyP50 = percentileOf(latencies, 50);
+    stats.latencyP90 = percentileOf(latencies, 90);
+    stats.latencyP99 = percentileOf(latencies, 99);
+    stats.latencyMax = latencies.empty() ? 0.0 : latencies.back();
+
+    cout << "Frames decoded: " << stats.framesDecoded << ", processed: " << stats.framesProcessed << ", dropped: " << stats.framesDropped << endl;
+    cout << "Latency (ms) p50: " << stats.latencyP50 << " p90: " << stats.latencyP90 << " p99: " << stats.latencyP99 << " max: " << stats.latencyMax << endl;
+    if(options.latencyTarget > 0)
+        cout << "Frames over the " << options.latencyTarget << " ms target: " << stats.deadlineMisses << endl;
+    cout << "Thresholding value searches: " << stats.thresholdSearches << " (failed: " << stats.thresholdSearchFailures << ")" << endl;
+    if(options.cleanFrameMargin > 0)
+        cout << "Clean frames skipped: " << stats.framesSkippedClean << endl;
+
+    return stats;
+}
+
+
+double percentileOf(const vector<double>& sortedValues, double percentile)
+{
+    if(sortedValues.empty())
+        return 0.0;
+    // nearest rank: the smallest value such that at least percentile% of the values are <= to it
+    size_t rank = (size_t)ceil(percentile / 100.0 * sortedValues.size());
+    rank = min(max(rank, (size_t)1), sortedValues.size());
+    return sortedValues[rank - 1];
+}
+
+}
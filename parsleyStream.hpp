@@ -0,0 +1,97 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyStream_hpp
+#define parsleyStream_hpp
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include "parsleyLib.hpp"
+#include "parsleyQueue.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ A frame flowing through the streaming pipeline, each stage fills its own fields.
+ */
+struct StreamFrame
+{
+    long frameId = 0;
+    std::string name;          // source file name, or the frame position in a video file
+    cv::Mat image;             // grayscale frame, set by the decode stage
+    cv::Mat binaryImage;       // set by the gamma and threshold stage
+    double thresholdingValue = 0.0;
+    bool clean = false;        // set by the gamma and threshold stage when the frame passes the clean frame check, binaryImage is then empty
+    std::vector<cv::KeyPoint> keypoints; // set by the blob detection stage
+    std::vector<cv::RotatedRect> boxes;  // set by the blob detection stage
+    double captureTicks = 0.0; // cv::getTickCount() when the frame was decoded
+};
+
+
+/**
+ Settings of processStream().
+ */
+struct StreamOptions
+{
+    std::size_t queueCapacity = 4;                       // capacity of each queue between stages
+    FrameDropPolicy dropPolicy = FrameDropPolicy::BLOCK; // applied to incoming frames when the pipeline falls behind
+    double gamma = 1.5;
+    float minArea = 1500;
+    DetectorEngine engine = DetectorEngine::SIMPLE_BLOB;
+    double latencyTarget = 0.0; // per frame end to end deadline in milliseconds, 0 to disable
+    int pollInterval = 100;     // milliseconds between two scans of a watched directory
+    double idleTimeout = 0.0;   // seconds without new files after which a watched directory stream ends, 0 to watch forever
+    bool trackThreshold = true; // thresholding value from a ThresholdEstimator, searched again only on histogram drift
+    double driftBound = 0.05;   // see ThresholdEstimator
+    ResultSink* sink = nullptr; // if not null where the emission stage saves the detections of each frame
+    double cleanFrameMargin = 0.0; // if above 0 frames passing the sampled clean frame check (see isCleanFrame) skip thresholding and detection
+    int cleanFrameStride = 4;      // sampling step of the clean frame check, see PipelineSettings
+};
+
+
+/**
+ Summary of a stream run.
+ */
+struct StreamStats
+{
+    std::size_t framesDecoded = 0;
+    std::size_t framesProcessed = 0;
+    std::size_t framesDropped = 0;
+    std::size_t deadlineMisses = 0; // processed frames whose latency exceeded StreamOptions::latencyTarget
+    double latencyP50 = 0.0;        // end to end latency percentiles in milliseconds
+    double latencyP90 = 0.0;
+    double latencyP99 = 0.0;
+    double latencyMax = 0.0;
+    std::size_t thresholdSearches = 0;      // frames on which the slope search ran
+    std::size_t thresholdSearchFailures = 0; // searches which found no slope big enough (a fallback value was used)
+    std::size_t framesSkippedClean = 0;     // frames which passed the clean frame check
+};
+
+
+/**
+ Processes a continuous feed of frames: a video file or a directory in which new frames are dropped.
+
+ Decode, gamma correction and thresholding, blob detection and result emission run as separate stages connected by BoundedQueue objects, so that each frame is decoded while the previous ones are still being processed.
+ The blob detector is built once for the whole stream. Prints to console the detected objects count of each frame and, at the end, the latency percentiles.
+
+ @param source a video file or a directory to watch
+ @param options the stream settings
+ @return the stream statistics
+ */
+StreamStats processStream(const std::string& source, const StreamOptions& options);
+
+
+/**
+ Computes a percentile of a set of values with the nearest rank method.
+
+ @param sortedValues values sorted in ascending order
+ @param percentile a value in [0, 100]
+ @return the percentile, 0 if sortedValues is empty
+ */
+double percentileOf(const std::vector<double>& sortedValues, double percentile);
+
+}
+#endif /* parsleyStream_hpp */
@@ -0,0 +1,151 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleySweep.hpp"
+#include "parsleyLib.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+static double elapsedMilliseconds(double& ticks)
+{
+    double now = (double) getTickCount();
+    double milliseconds = (now - ticks) / getTickFrequency() * 1000;
+    ticks = now;
+    return milliseconds;
+}
+
+
+vector<SweepResult> sweepParameters(const vector<string>& inputImgPaths, const vector<double>& gammas, const vector<float>& minAreas)
+{
+    vector<SweepResult> results(gammas.size() * minAreas.size());
+    for(int g=0; g<gammas.size(); ++g)
+        for(int a=0; a<minAreas.size(); ++a)
+        {
+            results[g * minAreas.size() + a].gamma = gammas[g];
+            results[g * minAreas.size() + a].minArea = minAreas[a];
+        }
+
+    const SimpleBlobDetector::Params parameters = instantiateBlobParams();
+    Mat image, colorImage, binaryImage, labels, stats, centroids;
+    vector<float> imageHistogram, gammaHistogram;
+    vector<int> areas;
+    size_t evaluatedImages = 0;
+    double decodeMilliseconds = 0;
+    for(int i=0; i<inputImgPaths.size(); ++i)
+    {
+        double ticks = (double) getTickCount();
+        if(!decodeInputImage(inputImgPaths[i], false, image, colorImage))
+        {
+            cerr << "Unable to read: " << inputImgPaths[i] << endl;
+            continue;
+        }
+        decodeMilliseconds += elapsedMilliseconds(ticks);
+        ++evaluatedImages;
+
+        for(int g=0; g<gammas.size(); ++g)
+        {
+            // the work shared by every minArea of this gamma
+            fusedGammaHistogram(image, gammas[g], imageHistogram, gammaHistogram);
+            double thresholdingValue = getAdaptiveThreshValue(gammaHistogram);
+            bool thresholdFailed = thresholdingValue < 0;
+            if(thresholdFailed)
+                thresholdingValue = otsuThreshValue(gammaHistogram);
+            gammaToBinaryImage(image, gammas[g], thresholdingValue, binaryImage);
+            int nLabels = connectedComponentsWithStats(binaryImage, labels, stats, centroids, 8, CV_32S);
+
+            // same bounds as the components engine: maxArea excluded here, minArea by each setting
+            areas.clear();
+            for(int label=1; label<nLabels; ++label)
+            {
+                int area = stats.at<int>(label, CC_STAT_AREA);
+                if(area < parameters.maxArea)
+                    areas.push_back(area);
+            }
+            sort(areas.begin(), areas.end());
+            double sharedMilliseconds = elapsedMilliseconds(ticks);
+
+            for(int a=0; a<minAreas.size(); ++a)
+            {
+                SweepResult& result = results[g * minAreas.size() + a];
+                result.detections += areas.end() - lower_bound(areas.begin(), areas.end(), minAreas[a], [](int area, float minArea){ return area < minArea; });
+                result.thresholdFailures += thresholdFailed ? 1 : 0;
+                result.sharedMilliseconds += sharedMilliseconds;
+                result.filterMilliseconds += elapsedMilliseconds(ticks);
+            }
+        }
+    }
+
+    // per image means
+    for(int r=0; r<results.size() && evaluatedImages > 0; ++r)
+    {
+        results[r].sharedMilliseconds /= evaluatedImages;
+        results[r].filterMilliseconds /= evaluatedImages;
+    }
+
+    // a full run of each setting would repeat decode and shared work, only the filter differs
+    double sweepMilliseconds = evaluatedImages > 0 ? decodeMilliseconds / evaluatedImages : 0, separateMilliseconds = 0;
+    for(int r=0; r<results.size(); ++r)
+    {
+        sweepMilliseconds += results[r].filterMilliseconds + (r % minAreas.size() == 0 ? results[r].sharedMilliseconds : 0);
+        separateMilliseconds += (evaluatedImages > 0 ? decodeMilliseconds / evaluatedImages : 0) + results[r].sharedMilliseconds + results[r].filterMilliseconds;
+    }
+
+    cout << "gamma\tminArea\tdetections\tper image\tthreshold failures\tshared (ms)\tfilter (ms)" << endl;
+    for(int r=0; r<results.size(); ++r)
+    {
+        const SweepResult& result = results[r];
+        cout << result.gamma << "\t" << result.minArea << "\t" << result.detections << "\t" << (evaluatedImages > 0 ? (double)result.detections / evaluatedImages : 0.0);
+        cout << "\t" << result.thresholdFailures << "\t" << result.sharedMilliseconds << "\t" << result.filterMilliseconds << endl;
+    }
+    cout << results.size() << " settings on " << evaluatedImages << " images: " << sweepMilliseconds << " ms per image (" << separateMilliseconds << " ms running each setting separately)" << endl;
+    return results;
+}
+
+
+bool parseSweepValues(const string& text, vector<double>& values)
+{
+    values.clear();
+    char* end;
+    if(text.find(':') != string::npos)
+    {
+        double range[3];
+        const char* start = text.c_str();
+        for(int i=0; i<3; ++i)
+        {
+            range[i] = strtod(start, &end);
+            if(end == start || *end != (i < 2 ? ':' : '\0'))
+                return false;
+            start = end + 1;
+        }
+        if(range[2] <= 0 || range[1] < range[0])
+            return false;
+        // counted from the start, so that the end is not lost to rounding
+        int steps = (int)((range[1] - range[0]) / range[2] + 1e-9);
+        for(int i=0; i<=steps; ++i)
+            values.push_back(range[0] + i * range[2]);
+        return true;
+    }
+
+    stringstream list(text);
+    string item;
+    while(getline(list, item, ','))
+    {
+        double value = strtod(item.c_str(), &end);
+        if(item.empty() || *end != '\0')
+            return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+}
@@ -0,0 +1,53 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleySweep_hpp
+#define parsleySweep_hpp
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+namespace parsleyLib{
+
+
+/**
+ Detections and processing time of a gamma and minArea setting over the images of a sweep.
+ */
+struct SweepResult
+{
+    double gamma = 0.0;
+    float minArea = 0;
+    std::size_t detections = 0;       // objects detected over all the images
+    std::size_t thresholdFailures = 0; // images whose slope search failed (the Otsu value was used)
+    double sharedMilliseconds = 0.0;  // per image: gamma correction, threshold, binarization and labeling, shared by the settings with the same gamma
+    double filterMilliseconds = 0.0;  // per image: the area filter of this setting
+};
+
+
+/**
+ Evaluates a grid of gamma and minArea settings with the connected components engine, sharing the work between settings.
+
+ Each image is decoded once. For each gamma the image is corrected, thresholded, binarized and labeled once, and the component areas are sorted: the count of every minArea is then a binary search over them.
+ The counts are the ones of the connected components engine run with each setting (same area bounds: minArea included, maxArea of instantiateBlobParams excluded).
+ Prints to console a table with one row per setting.
+
+ @param inputImgPaths the images to evaluate
+ @param gammas the gamma values
+ @param minAreas the minimum areas, in pixels
+ @return one result per setting, gamma major
+ */
+std::vector<SweepResult> sweepParameters(const std::vector<std::string>& inputImgPaths, const std::vector<double>& gammas, const std::vector<float>& minAreas);
+
+
+/**
+ Parses the values of a sweep axis: a comma separated list ("1.0,1.5,2.5") or a range with its step ("1.0:3.0:0.25", end included).
+
+ @param text the values
+ @param values where to save the values
+ @return false if the text is not a list of numbers nor a valid range
+ */
+bool parseSweepValues(const std::string& text, std::vector<double>& values);
+
+}
+#endif /* parsleySweep_hpp */
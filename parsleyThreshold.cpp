@@ -0,0 +1,156 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+
+#include "parsleyThreshold.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyMetrics.hpp"
+#include <cmath>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+ThresholdEstimator::ThresholdEstimator(double smoothing, double driftBound)
+    : smoothing(smoothing), driftBound(driftBound), thresholdingValue(-1), fallbackValue(false), drift(0), nSearches(0), nReused(0), nFailed(0)
+{
+}
+
+
+double ThresholdEstimator::update(const vector<float>& gammaHistogram)
+{
+    double total = 0.0;
+    for(int i=0; i<gammaHistogram.size(); ++i)
+        total += gammaHistogram[i];
+    if(total <= 0) // an empty frame tells nothing about the distribution
+        return thresholdingValue >= 0 ? thresholdingValue : 0;
+
+    // running histogram, normalized so that frames of different sizes weigh the same
+    if(runningHistogram.empty())
+    {
+        runningHistogram.resize(gammaHistogram.size());
+        for(int i=0; i<gammaHistogram.size(); ++i)
+            runningHistogram[i] = gammaHistogram[i] / total;
+    }
+    else
+    {
+        for(int i=0; i<gammaHistogram.size(); ++i)
+            runningHistogram[i] = (1 - smoothing) * runningHistogram[i] + smoothing * gammaHistogram[i] / total;
+    }
+
+    // drift from the histogram of the last search: a slow drift accumulates until it triggers a new search
+    drift = 1.0;
+    if(!searchedHistogram.empty())
+    {
+        drift = 0.0;
+        for(int i=0; i<runningHistogram.size(); ++i)
+            drift += fabs(runningHistogram[i] - searchedHistogram[i]);
+        drift /= 2;
+    }
+    if(thresholdingValue >= 0 && drift <= driftBound)
+    {
+        ++nReused;
+        return thresholdingValue;
+    }
+
+    // the slope search works on pixel counts: the smoothed distribution is scaled back to the frame size
+    searchCounts.resize(runningHistogram.size());
+    for(int i=0; i<runningHistogram.size(); ++i)
+        searchCounts[i] = (float)(runningHistogram[i] * total);
+    ++nSearches;
+    searchedHistogram = runningHistogram; // also after a failure: the search runs again only after a further drift
+
+    double searched = getAdaptiveThreshValue(searchCounts);
+    if(searched >= 0)
+    {
+        thresholdingValue = searched;
+        fallbackValue = false;
+    }
+    else
+    {
+        ++nFailed;
+        countEvent(PipelineCounter::THRESHOLD_SEARCH_FAILURES);
+        // a searched value stays valid, a fallback one follows the drifted distribution
+        if(thresholdingValue < 0 || fallbackValue)
+        {
+            thresholdingValue = otsuThreshValue(searchCounts);
+            fallbackValue = true;
+        }
+    }
+    return thresholdingValue;
+}
+
+
+void ThresholdEstimator::reset()
+{
+    runningHistogram.clear();
+    searchedHistogram.clear();
+    thresholdingValue = -1;
+    fallbackValue = false;
+    drift = 0;
+}
+
+
+double ThresholdEstimator::lastDrift() const
+{
+    return drift;
+}
+
+
+size_t ThresholdEstimator::searches() const
+{
+    return nSearches;
+}
+
+
+size_t ThresholdEstimator::reusedThresholds() const
+{
+    return nReused;
+}
+
+
+size_t ThresholdEstimator::failedSearches() const
+{
+    return nFailed;
+}
+
+
+bool isCleanFrame(const Mat& image, double gamma, float minArea, double margin, int stride, double* thresholdingValue)
+{
+    CV_Assert(image.type() == CV_8UC1);
+    stride = max(1, stride);
+    const uchar* lookUpTable = getGammaLookUpTable(gamma);
+
+    // the pixel at the center of each stride x stride cell
+    int counts[256] = {0};
+    int64 samples = 0;
+    for(int r=stride/2; r<image.rows; r+=stride)
+    {
+        const uchar* row = image.ptr<uchar>(r);
+        for(int c=stride/2; c<image.cols; c+=stride)
+            ++counts[lookUpTable[row[c]]];
+        samples += (image.cols - stride/2 + stride - 1) / stride;
+    }
+    vector<float> gammaHistogram(256, 0.f);
+    const double scale = samples ? (double)image.total() / samples : 0.0;
+    for(int i=0; i<256; ++i)
+        gammaHistogram[i] = (float)(counts[i] * scale);
+
+    double sampledValue = getAdaptiveThreshValue(gammaHistogram);
+    if(thresholdingValue)
+        *thresholdingValue = sampledValue;
+    bool clean = false;
+    if(sampledValue >= 0)
+    {
+        // the same decision of gammaToBinaryImage: gamma corrected intensities above the floor of the thresholding value are white
+        double whitePixels = 0.0;
+        for(int i=cvFloor(sampledValue)+1; i<256; ++i)
+            whitePixels += gammaHistogram[i];
+        clean = whitePixels < margin * minArea;
+    }
+    countEvent(clean ? PipelineCounter::CLEAN_FRAMES_SKIPPED : PipelineCounter::CLEAN_CHECKS_ESCALATED);
+    return clean;
+}
+
+}
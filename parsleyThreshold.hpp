@@ -0,0 +1,83 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyThreshold_hpp
+#define parsleyThreshold_hpp
+
+#include <cstddef>
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+namespace parsleyLib{
+
+
+/**
+ Stateful thresholding value estimator for consecutive frames of the same scene (e.g. a conveyor with nearly constant lighting and product).
+
+ Keeps a running histogram, exponentially smoothed and normalized, and the one on which the last slope search (getAdaptiveThreshValue) ran. While the two stay close the previous thresholding value is reused: the search runs again only when the distribution has drifted beyond a bound.
+ Drift is the total variation distance between the two distributions: half the sum of the absolute differences of the bins, from 0 (same) to 1 (disjoint).
+ When the search finds no slope big enough (getAdaptiveThreshValue returns -1) the last searched thresholding value is kept, or the Otsu one is used if no search has succeeded yet: a valid value is always returned.
+ */
+class ThresholdEstimator
+{
+public:
+    /**
+     @param smoothing weight of the newest frame in the running histogram, from 0 (never updated) to 1 (last frame only)
+     @param driftBound drift over which the slope search runs again
+     */
+    explicit ThresholdEstimator(double smoothing = 0.2, double driftBound = 0.05);
+
+    /**
+     Adds a frame and gives its thresholding value.
+
+     @param gammaHistogram the frame histogram after the gamma correction (256 bins)
+     @return the thresholding value to use for the frame
+     */
+    double update(const std::vector<float>& gammaHistogram);
+
+    /**
+     Forgets every frame seen, the next update runs the search.
+     */
+    void reset();
+
+    /**
+     Drift of the running histogram from the last searched one, as computed by the last update.
+     */
+    double lastDrift() const;
+
+    std::size_t searches() const;        // updates which ran the slope search
+    std::size_t reusedThresholds() const; // updates which reused the previous thresholding value
+    std::size_t failedSearches() const;  // searches which found no slope big enough
+
+private:
+    double smoothing;
+    double driftBound;
+    std::vector<double> runningHistogram;  // normalized, empty before the first frame
+    std::vector<double> searchedHistogram; // normalized running histogram at the last search
+    std::vector<float> searchCounts;       // running histogram scaled to the frame pixel count, as the slope search expects
+    double thresholdingValue;              // -1 until a value is known
+    bool fallbackValue;                    // thresholdingValue is the Otsu one, no search has succeeded yet
+    double drift;
+    std::size_t nSearches, nReused, nFailed;
+};
+
+
+/**
+ Quick reject of frames without impurities, before any full resolution pass.
+
+ The gamma histogram is estimated from one pixel every stride rows and columns, scaled to the image pixel count, and the slope search (getAdaptiveThreshValue) runs on it.
+ The frame is clean when the estimated pixels above that thresholding value, the ones binarization would turn white, are fewer than margin * minArea: not even all together could they make an impurity.
+ A failed slope search is never clean. Counts CLEAN_FRAMES_SKIPPED or CLEAN_CHECKS_ESCALATED.
+
+ @param image the CV_8U image to check
+ @param gamma gamma value of the correction
+ @param minArea smallest impurity, in pixels
+ @param margin confidence margin, from 0 (nothing is clean) to 1 (the estimate is trusted as is): lower values absorb the sampling error
+ @param stride sampling step in rows and columns
+ @param thresholdingValue if not null where to save the thresholding value of the sampled histogram (-1 if the search failed)
+ @return true if the frame is confidently without impurities
+ */
+bool isCleanFrame(const cv::Mat& image, double gamma, float minArea, double margin, int stride = 4, double* thresholdingValue = nullptr);
+
+}
+#endif /* parsleyThreshold_hpp */
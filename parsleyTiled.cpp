@@ -0,0 +1,334 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "parsleyTiled.hpp"
+#include "parsleyLib.hpp"
+#include "parsleyRaster.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sys/mman.h>
+
+using namespace std;
+using namespace cv;
+
+namespace parsleyLib {
+
+// A component as seen inside one tile, coordinates relative to the tile
+struct TileComponent
+{
+    PixelMoments moments;
+    Rect box;
+    vector<Point> extremePoints; // first and last pixel of each row
+    Point firstPixel;            // first pixel in raster order
+    int lastRow = -1;            // last row added to extremePoints, while scanning
+};
+
+// What is kept of a tile once labeled: its components and the labels along its borders (0 is background, label l is components[l-1])
+struct TileResult
+{
+    Rect tileRect;
+    vector<TileComponent> components;
+    vector<int> top, bottom, left, right;
+};
+
+
+// Binarizes and labels one tile, summarizing its components
+static void labelTile(const Mat& image, double gamma, double thresholdingValue, TileResult& tile)
+{
+    Mat binaryTile;
+    gammaToBinaryImage(image(tile.tileRect), gamma, thresholdingValue, binaryTile);
+
+    Mat labels, stats, centroids;
+    int nLabels = connectedComponentsWithStats(binaryTile, labels, stats, centroids, 8, CV_32S);
+    tile.components.assign(nLabels - 1, TileComponent());
+    for(int label=1; label<nLabels; ++label)
+        tile.components[label-1].box = Rect(stats.at<int>(label, CC_STAT_LEFT), stats.at<int>(label, CC_STAT_TOP), stats.at<int>(label, CC_STAT_WIDTH), stats.at<int>(label, CC_STAT_HEIGHT));
+
+    // single scan of the labels, run by run
+    for(int y=0; y<labels.rows; ++y)
+    {
+        const int* row = labels.ptr<int>(y);
+        int x = 0;
+        while(x < labels.cols)
+        {
+            int label = row[x];
+            if(label == 0)
+            {
+                ++x;
+                continue;
+            }
+            TileComponent& component = tile.components[label-1];
+            int runStart = x;
+            for( ; x<labels.cols && row[x]==label; ++x)
+                component.moments.add(x, y);
+
+            if(component.lastRow != y) // first run of this component in the row
+            {
+                if(component.lastRow < 0)
+                    component.firstPixel = Point(runStart, y);
+                component.extremePoints.push_back(Point(runStart, y));
+                component.extremePoints.push_back(Point(x - 1, y));
+                component.lastRow = y;
+            }
+            else
+                component.extremePoints.back().x = x - 1;
+        }
+    }
+
+    // border labels, used to stitch components across the seams
+    const int lastRow = labels.rows - 1, lastCol = labels.cols - 1;
+    tile.top.assign(labels.ptr<int>(0), labels.ptr<int>(0) + labels.cols);
+    tile.bottom.assign(labels.ptr<int>(lastRow), labels.ptr<int>(lastRow) + labels.cols);
+    tile.left.resize(labels.rows);
+    tile.right.resize(labels.rows);
+    for(int y=0; y<labels.rows; ++y)
+    {
+        tile.left[y] = labels.at<int>(y, 0);
+        tile.right[y] = labels.at<int>(y, lastCol);
+    }
+}
+
+
+// Union-find over the components of all the tiles
+static int findRoot(vector<int>& parent, int i)
+{
+    while(parent[i] != i)
+    {
+        parent[i] = parent[parent[i]]; // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+static void unite(vector<int>& parent, int a, int b)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if(a != b)
+        parent[max(a, b)] = min(a, b);
+}
+
+
+// Unites the components on the two sides of a seam: labelsA and labelsB are the facing borders, pixel i of A touches pixels i-1, i, i+1 of B
+static void stitchSeam(const vector<int>& labelsA, int offsetA, const vector<int>& labelsB, int offsetB, vector<int>& parent)
+{
+    for(int i=0; i<labelsA.size(); ++i)
+    {
+        if(labelsA[i] == 0)
+            continue;
+        for(int j=max(0, i-1); j<=min((int)labelsB.size()-1, i+1); ++j)
+            if(labelsB[j] != 0)
+                unite(parent, offsetA + labelsA[i] - 1, offsetB + labelsB[j] - 1);
+    }
+}
+
+
+vector<KeyPoint> detectComponentRectsTiled(const Mat& image, double gamma, const SimpleBlobDetector::Params& parameters, int tileSide, vector<RotatedRect>& boundingRects, double& thresholdingValue)
+{
+    CV_Assert(image.type() == CV_8UC1 && tileSide > 0);
+
+    // global thresholding value, from the histogram of the whole image (no gamma image is stored)
+    vector<float> imageHistogram, gammaHistogram;
+    fusedGammaHistogram(image, gamma, imageHistogram, gammaHistogram);
+    thresholdingValue = getAdaptiveThreshValue(gammaHistogram);
+    if(thresholdingValue < 0) // no slope big enough: -1 would turn the whole image white
+        thresholdingValue = otsuThreshValue(gammaHistogram);
+
+    const int nTilesX = (image.cols + tileSide - 1) / tileSide;
+    const int nTilesY = (image.rows + tileSide - 1) / tileSide;
+    vector<TileResult> tiles(nTilesX * nTilesY);
+    for(int ty=0; ty<nTilesY; ++ty)
+        for(int tx=0; tx<nTilesX; ++tx)
+            tiles[ty * nTilesX + tx].tileRect = Rect(tx * tileSide, ty * tileSide, tileSide, tileSide) & Rect(0, 0, image.cols, image.rows);
+
+    // tiles are labeled in parallel, each thread only holds the buffers of the tile it is working on
+    parallel_for_(Range(0, (int)tiles.size()), [&](const Range& range)
+    {
+        for(int t=range.start; t<range.end; ++t)
+            labelTile(image, gamma, thresholdingValue, tiles[t]);
+    });
+
+    // global index of the first component of each tile
+    vector<int> offsets(tiles.size() + 1, 0);
+    for(int t=0; t<tiles.size(); ++t)
+        offsets[t+1] = offsets[t] + (int)tiles[t].components.size();
+    vector<int> parent(offsets.back());
+    for(int i=0; i<parent.size(); ++i)
+        parent[i] = i;
+
+    // stitches every seam: right and bottom neighbours, and the two diagonal neighbours below (8-connectivity across tile corners)
+    for(int ty=0; ty<nTilesY; ++ty)
+        for(int tx=0; tx<nTilesX; ++tx)
+        {
+            int t = ty * nTilesX + tx;
+            const TileResult& tile = tiles[t];
+            if(tx + 1 < nTilesX)
+                stitchSeam(tile.right, offsets[t], tiles[t+1].left, offsets[t+1], parent);
+            if(ty + 1 < nTilesY)
+            {
+                int below = t + nTilesX;
+                stitchSeam(tile.bottom, offsets[t], tiles[below].top, offsets[below], parent);
+                if(tx + 1 < nTilesX && tile.bottom.back() != 0 && tiles[below+1].top.front() != 0)
+                    unite(parent, offsets[t] + tile.bottom.back() - 1, offsets[below+1] + tiles[below+1].top.front() - 1);
+                if(tx > 0 && tile.bottom.front() != 0 && tiles[below-1].top.back() != 0)
+                    unite(parent, offsets[t] + tile.bottom.front() - 1, offsets[below-1] + tiles[below-1].top.back() - 1);
+            }
+        }
+
+    // groups the tile components by root, in image coordinates
+    struct MergedComponent
+    {
+        Rect box;
+        Point firstPixel;
+        vector<pair<int, int>> members; // (tile, component index)
+    };
+    vector<int> groupOf(parent.size(), -1);
+    vector<MergedComponent> merged;
+    for(int t=0; t<tiles.size(); ++t)
+        for(int i=0; i<tiles[t].components.size(); ++i)
+        {
+            int root = findRoot(parent, offsets[t] + i);
+            if(groupOf[root] < 0)
+            {
+                groupOf[root] = (int)merged.size();
+                merged.push_back(MergedComponent());
+            }
+            MergedComponent& group = merged[groupOf[root]];
+            const TileComponent& component = tiles[t].components[i];
+            Point tileOrigin = tiles[t].tileRect.tl();
+            Rect box(component.box.tl() + tileOrigin, component.box.size());
+            Point firstPixel = component.firstPixel + tileOrigin;
+            if(group.members.empty())
+            {
+                group.box = box;
+                group.firstPixel = firstPixel;
+            }
+            else
+            {
+                group.box |= box;
+                if(firstPixel.y < group.firstPixel.y || (firstPixel.y == group.firstPixel.y && firstPixel.x < group.firstPixel.x))
+                    group.firstPixel = firstPixel;
+            }
+            group.members.push_back(make_pair(t, i));
+        }
+
+    // raster order of the first pixel, independent of the tiling and the same as detectComponentRects
+    sort(merged.begin(), merged.end(), [](const MergedComponent& a, const MergedComponent& b)
+    {
+        return a.firstPixel.y < b.firstPixel.y || (a.firstPixel.y == b.firstPixel.y && a.firstPixel.x < b.firstPixel.x);
+    });
+
+    vector<KeyPoint> keypoints;
+    boundingRects.clear();
+    for(int g=0; g<merged.size(); ++g)
+    {
+        // moments and row extremes moved to the merged bounding box origin, the same coordinate system of the untiled detectComponentRects
+        const MergedComponent& group = merged[g];
+        PixelMoments moments;
+        vector<Point> extremePoints;
+        for(int m=0; m<group.members.size(); ++m)
+        {
+            const TileComponent& component = tiles[group.members[m].first].components[group.members[m].second];
+            Point shift = tiles[group.members[m].first].tileRect.tl() - group.box.tl();
+            moments.add(component.moments, shift.x, shift.y);
+            for(int p=0; p<component.extremePoints.size(); ++p)
+                extremePoints.push_back(component.extremePoints[p] + shift);
+        }
+
+        // the area filter applies to the whole merged component
+        if(parameters.filterByArea && (moments.n < parameters.minArea || moments.n >= parameters.maxArea))
+            continue;
+
+        Point2f centroid;
+        boundingRects.push_back(orientedBoxFromMoments(moments, extremePoints, group.box.tl(), centroid));
+        keypoints.push_back(KeyPoint(centroid, (float)(2 * sqrt(moments.n / CV_PI))));
+    }
+    return keypoints;
+}
+
+
+// Maps a binary 8 bit PGM file in memory, image is a header on its pixels. False if the file is not a complete PGM.
+static bool mapPgmImage(const string& path, Mat& image, void*& mapped, size_t& mappedBytes)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file)
+        return false;
+    int width = 0, height = 0;
+    bool mappable = readPgmHeader(file, width, height);
+    long pixelsOffset = mappable ? ftell(file) : -1;
+    if(mappable && pixelsOffset > 0 && fseek(file, 0, SEEK_END) == 0)
+    {
+        mappedBytes = (size_t)ftell(file);
+        mappable = mappedBytes >= (size_t)pixelsOffset + (size_t)width * height;
+        mapped = mappable ? mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fileno(file), 0) : MAP_FAILED;
+        mappable = (mapped != MAP_FAILED);
+    }
+    else
+        mappable = false;
+    fclose(file); // the mapping outlives the file descriptor
+    if(mappable)
+        image = Mat(height, width, CV_8U, (uchar*)mapped + pixelsOffset);
+    return mappable;
+}
+
+
+size_t processImageTiled(string inputImgPath, string outputImgPath, int tileSide, OutputLevel outputLevel, bool verbose)
+{
+    // Starts calculating time to have an idea of processing time
+    double ticks = (double) getTickCount();
+
+    // a PGM file is mapped in memory and its tiles read in place, any other image is decoded whole; the color image is kept only for the annotated output
+    Mat img, colorImg;
+    void* mapped = MAP_FAILED;
+    size_t mappedBytes = 0;
+    if(mapPgmImage(inputImgPath, img, mapped, mappedBytes))
+    {
+        if(outputLevel != OutputLevel::RESULTS_ONLY)
+            cvtColor(img, colorImg, COLOR_GRAY2BGR);
+    }
+    else if(!parsleyLib::decodeInputImage(inputImgPath, outputLevel != OutputLevel::RESULTS_ONLY, img, colorImg))
+        CV_Error(Error::StsError, "Unable to read: " + inputImgPath);
+
+    // same settings as processImage
+    double gamma = 1.5;
+    SimpleBlobDetector::Params parameters = parsleyLib::instantiateBlobParams();
+    parameters.minArea = 1500;
+
+    vector<RotatedRect> boundingRects;
+    double thresholdingValue;
+    vector<KeyPoint> keypoints = parsleyLib::detectComponentRectsTiled(img, gamma, parameters, tileSide, boundingRects, thresholdingValue);
+    img.release(); // the grayscale plane is not needed anymore
+    if(mapped != MAP_FAILED)
+        munmap(mapped, mappedBytes);
+
+    if(verbose)
+    {
+        cout << "Number of detected objects for: "  << inputImgPath << ": " << keypoints.size() << " (thresholding value " << thresholdingValue << ")" << endl;
+        cout << "The detected objects have centers at the following coordinates (pixelCol, pixelRow): " << endl;
+        for(int i=0; i<keypoints.size(); ++i)
+        {
+            cout << "Object " << i << " : (" << (int)keypoints[i].pt.x << ", " << (int)keypoints[i].pt.y << ")" << endl;
+        }
+    }
+
+    if(outputLevel != OutputLevel::RESULTS_ONLY)
+    {
+        Mat imgWithBoundingBoxes = colorImg;
+        parsleyLib::drawRotatedBoundingBoxes(imgWithBoundingBoxes, boundingRects);
+        imwrite(outputImgPath + "/annotated.tiff", imgWithBoundingBoxes);
+    }
+
+    // Stops the chrono and shows the elapsed time to process the image
+    double elapsedTime = ((double)getTickCount() - ticks) / getTickFrequency();
+    if(verbose)
+        cout << "Single image execution time: " << elapsedTime << " seconds" << endl;
+
+    return keypoints.size();
+}
+
+}
@@ -0,0 +1,51 @@
+// APParsley: un sistema di visione artificiale per l'individuazione di impurità tra foglie di prezzemolo essiccate
+// Andrew Zamai
+#ifndef parsleyTiled_hpp
+#define parsleyTiled_hpp
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include "parsleyOutput.hpp"
+
+
+namespace parsleyLib{
+
+
+/**
+ Tiled version of gammaToBinaryImage + detectComponentRects, for very large images (e.g. line scan images of 100+ megapixels).
+
+ The thresholding value is computed on the histogram of the whole image (merged from the fusedGammaHistogram stripes). Then tiles are binarized and labeled in parallel, each keeping only the moments, the row extremes and the border labels of its components.
+ Components touching across a tile seam (8-connectivity, corners included) are merged, and detections are sorted in raster order of their first pixel, the order of detectComponentRects: the result is the same as the untiled one, in the same order.
+ Working memory is a few tile-sized buffers per thread, independent of the image size.
+
+ @param image the CV_8U image to process
+ @param gamma gamma value of the correction
+ @param parameters the detection parameters (see instantiateBlobParams), only the area filter is used
+ @param tileSide side of the square tiles in pixels
+ @param boundingRects where to save the oriented bounding rectangles of the kept components
+ @param thresholdingValue where to save the computed thresholding value
+ @return a keypoint for each kept component, in the same order as boundingRects
+ */
+std::vector<cv::KeyPoint> detectComponentRectsTiled(const cv::Mat& image, double gamma, const cv::SimpleBlobDetector::Params& parameters, int tileSide, std::vector<cv::RotatedRect>& boundingRects, double& thresholdingValue);
+
+
+/**
+ Process a single very large image in tiles, with the same settings as processImage and the connected components engine.
+
+ Prints to console detected objects list as pair (pixelColumn, pixelRow). Only RESULTS_ONLY and ANNOTATED output levels are available: the annotated image is saved as annotated.tiff in the output path.
+ A binary PGM (P5, 8 bit) file is mapped in memory and its tiles are read in place: with RESULTS_ONLY the working memory depends on the tile size only, the pages of the file are left to the kernel page cache.
+ Any other format is decoded whole by OpenCV (it has no tile decoding), and ANNOTATED needs the whole color image in memory to draw and encode the TIFF: in those cases memory grows with the image size.
+
+ @param inputImgPath input image path
+ @param outputImgPath output path where to save the annotated image
+ @param tileSide side of the square tiles in pixels
+ @param outputLevel RESULTS_ONLY or ANNOTATED (FULL_DEBUG is treated as ANNOTATED)
+ @param verbose if false nothing is printed to console
+ @return the number of detected objects
+ */
+std::size_t processImageTiled(std::string inputImgPath, std::string outputImgPath, int tileSide = 2048, OutputLevel outputLevel = OutputLevel::RESULTS_ONLY, bool verbose = true);
+
+}
+#endif /* parsleyTiled_hpp */